@@ -0,0 +1,605 @@
+/*
+ * Copyright (c) 2012 - 2013, YukChung Lee <liexusong@qq.com>
+ * All rights reserved.
+ *  __   __  __   __         _______  __   __  _______  __   __  _______  ______
+ * |  |_|  ||  |_|  |       |       ||  | |  ||       ||  | |  ||       ||      |
+ * |       ||       | ____  |   _   ||  | |  ||    ___||  | |  ||    ___||  _    |
+ * |       ||       ||____| |  | |  ||  |_|  ||   |___ |  |_|  ||   |___ | | |   |
+ * |       | |     |        |  |_|  ||       ||    ___||       ||    ___|| |_|   |
+ * | ||_|| ||   _   |       |      | |       ||   |___ |       ||   |___ |       |
+ * |_|   |_||__| |__|       |____||_||_______||_______||_______||_______||______|
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/*
+ * Persistent job arena.
+ *
+ * Jobs and queue records are allocated from a shared file mapping, every
+ * allocation has a block header which only use offsets (relative pointers)
+ * to link to other blocks. After restart the process maps the file again
+ * and walks the blocks once to rebuild the skiplists and the free lists,
+ * nothing need to be parsed or copied.
+ *
+ * A job block is `pending' until its body was completed, pending blocks
+ * are dropped by the recovery pass. Where the job goes after recovery is
+ * decided by its fields: a recycle id means it was touched, a timeout in
+ * the future means it was delayed, otherwise it is ready.
+ */
+
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <sys/file.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include "global.h"
+
+#define MX_ARENA_MAGIC     "MXARENA1"
+#define MX_ARENA_VERSION   1
+#define MX_ARENA_DATA      4096    /* blocks start offset */
+#define MX_ARENA_UNIT      64      /* blocks size unit */
+#define MX_ARENA_CLASSES   256     /* free lists for small blocks */
+#define MX_ARENA_SPLIT     4096    /* split big free block if remain more */
+
+enum {
+    mx_arena_free_block = 0x46524545,
+    mx_arena_pending_block = 0x50454e44,
+    mx_arena_job_block = 0x4a4f4221,
+    mx_arena_queue_block = 0x51554555
+};
+
+struct mx_arena_header {
+    char magic[8];
+    int version;
+    int job_size;         /* sizeof(mx_job_t) of the creator */
+    long size;            /* mapping size */
+    long top;             /* never used space begin */
+    int last_recycle_id;
+};
+
+struct mx_arena_block {
+    unsigned int size;    /* include this header */
+    int type;
+    long queue;           /* job's queue record offset */
+    long next;            /* next free block offset */
+    int recycle_id;
+    int reserved;
+};
+
+struct mx_arena_queue {
+    int name_len;
+    char name[0];
+};
+
+
+static char *mx_arena_base = NULL;
+static long mx_arena_size = 0;
+static int mx_arena_closed = 0;
+static struct mx_arena_header *mx_arena_head = NULL;
+static int mx_arena_fd = -1;
+static long mx_arena_free_lists[MX_ARENA_CLASSES + 1];
+static long mx_arena_deferred = 0;  /* freed while background saving */
+
+
+#define mx_arena_block_of(ptr)  \
+    ((struct mx_arena_block *)((char *)(ptr) - sizeof(struct mx_arena_block)))
+
+#define mx_arena_offset(ptr)   ((long)((char *)(ptr) - mx_arena_base))
+
+#define mx_arena_pointer(off)  ((void *)(mx_arena_base + (off)))
+
+
+static int mx_arena_class(unsigned int size)
+{
+    int index = size / MX_ARENA_UNIT;
+
+    return index < MX_ARENA_CLASSES ? index : MX_ARENA_CLASSES;
+}
+
+
+static void mx_arena_push_free(struct mx_arena_block *block)
+{
+    int index = mx_arena_class(block->size);
+
+    block->type = mx_arena_free_block;
+    block->next = mx_arena_free_lists[index];
+    mx_arena_free_lists[index] = mx_arena_offset(block);
+}
+
+
+static struct mx_arena_block *mx_arena_pop_free(unsigned int size)
+{
+    struct mx_arena_block *block, *remain;
+    long *prev;
+    int index = mx_arena_class(size);
+
+    if (index < MX_ARENA_CLASSES) {
+        if (!mx_arena_free_lists[index]) {
+            return NULL;
+        }
+        block = mx_arena_pointer(mx_arena_free_lists[index]);
+        mx_arena_free_lists[index] = block->next;
+        return block;
+    }
+
+    /* big blocks: first fit */
+    for (prev = &mx_arena_free_lists[MX_ARENA_CLASSES]; *prev; prev = &block->next) {
+        block = mx_arena_pointer(*prev);
+        if (block->size < size) {
+            continue;
+        }
+
+        *prev = block->next;
+
+        if (block->size - size > MX_ARENA_SPLIT) {
+            remain = (struct mx_arena_block *)((char *)block + size);
+            remain->size = block->size - size;
+            mx_arena_push_free(remain);
+            block->size = size;
+        }
+        return block;
+    }
+
+    return NULL;
+}
+
+
+int mx_arena_owned(void *ptr)
+{
+    return mx_arena_base &&
+           (char *)ptr > mx_arena_base &&
+           (char *)ptr < mx_arena_base + mx_arena_size;
+}
+
+
+/*
+ * Allocate a block for job or queue record, return NULL if arena was full
+ */
+static void *mx_arena_alloc(int type, unsigned int length)
+{
+    struct mx_arena_block *block;
+    unsigned int size;
+
+    size = sizeof(*block) + length;
+    size = (size + MX_ARENA_UNIT - 1) / MX_ARENA_UNIT * MX_ARENA_UNIT;
+
+    block = mx_arena_pop_free(size);
+    if (!block) {
+        if (mx_arena_head->top + size > mx_arena_head->size) {
+            return NULL;
+        }
+        block = mx_arena_pointer(mx_arena_head->top);
+        block->size = size;
+        mx_arena_head->top += size;
+    }
+
+    block->type = type;
+    block->queue = 0;
+    block->next = 0;
+    block->recycle_id = 0;
+
+    return (char *)block + sizeof(*block);
+}
+
+
+void mx_arena_free(void *ptr)
+{
+    struct mx_arena_block *block;
+
+    /* jobs were freed when server shutdown, keep them in arena */
+    if (mx_arena_closed) {
+        return;
+    }
+
+    block = mx_arena_block_of(ptr);
+
+    /* the mapping is shared with background save process, which
+     * may be reading the job, don't reuse it until the save done */
+    if (mx_global->bgsave_pid != -1) {
+        block->type = mx_arena_free_block;
+        block->next = mx_arena_deferred;
+        mx_arena_deferred = mx_arena_offset(block);
+        return;
+    }
+
+    mx_arena_push_free(block);
+}
+
+
+/*
+ * Background save finished, the blocks freed meanwhile can be reused
+ */
+void mx_arena_release_deferred()
+{
+    struct mx_arena_block *block;
+
+    while (mx_arena_deferred) {
+        block = mx_arena_pointer(mx_arena_deferred);
+        mx_arena_deferred = block->next;
+        mx_arena_push_free(block);
+    }
+}
+
+
+/* the record wasn't allocated if arena was full when queue created */
+static void *mx_arena_queue_record(mx_queue_t *queue)
+{
+    if (!queue->arena) {
+        queue->arena = mx_arena_queue_alloc(queue->name, queue->name_len);
+    }
+
+    return queue->arena;
+}
+
+
+/*
+ * Jobs only live in the arena when it's enabled (a job out of it would
+ * be lost after restart), return NULL if arena was full
+ */
+mx_job_t *mx_arena_job_alloc(mx_queue_t *belong, int length)
+{
+    struct mx_arena_block *block;
+    mx_job_t *job;
+
+    if (!mx_arena_base || mx_arena_closed || !mx_arena_queue_record(belong)) {
+        return NULL;
+    }
+
+    job = mx_arena_alloc(mx_arena_pending_block, sizeof(*job) + length + 2);
+    if (job) {
+        block = mx_arena_block_of(job);
+        block->queue = mx_arena_offset(mx_arena_block_of(belong->arena));
+    }
+
+    return job;
+}
+
+
+/*
+ * The job's body was completed, recovery pass would keep it
+ */
+void mx_arena_job_commit(mx_job_t *job)
+{
+    if (mx_arena_owned(job) && !mx_arena_closed) {
+        mx_arena_block_of(job)->type = mx_arena_job_block;
+    }
+}
+
+
+/*
+ * Remember the recycle id (zero when job leave recycle queue)
+ */
+void mx_arena_job_recycle(mx_job_t *job, int recycle_id)
+{
+    if (mx_arena_owned(job) && !mx_arena_closed) {
+        mx_arena_block_of(job)->recycle_id = recycle_id;
+    }
+}
+
+
+/*
+ * The job was moved to another queue
+ */
+void mx_arena_job_move(mx_job_t *job, mx_queue_t *queue)
+{
+    if (mx_arena_owned(job) && !mx_arena_closed && mx_arena_queue_record(queue)) {
+        mx_arena_block_of(job)->queue = mx_arena_offset(mx_arena_block_of(queue->arena));
+    }
+}
+
+
+void *mx_arena_queue_alloc(char *name, int name_len)
+{
+    struct mx_arena_queue *record;
+
+    if (!mx_arena_base || mx_arena_closed) {
+        return NULL;
+    }
+
+    record = mx_arena_alloc(mx_arena_queue_block, sizeof(*record) + name_len + 1);
+    if (record) {
+        record->name_len = name_len;
+        memcpy(record->name, name, name_len);
+        record->name[name_len] = 0;
+    }
+
+    return record;
+}
+
+
+void mx_arena_sync()
+{
+    if (mx_arena_base && !mx_arena_closed) {
+        mx_arena_head->last_recycle_id = mx_global->last_recycle_id;
+        msync(mx_arena_base, mx_arena_head->top, MS_ASYNC);
+    }
+}
+
+
+static int mx_arena_recover_queue(struct mx_arena_block *block)
+{
+    struct mx_arena_queue *record;
+    mx_queue_t *queue;
+
+    record = (struct mx_arena_queue *)((char *)block + sizeof(*block));
+
+    if (record->name_len <= 0 ||
+        sizeof(*block) + sizeof(*record) + record->name_len >= block->size)
+    {
+        return -1;
+    }
+
+    if (hash_lookup(mx_global->queue_table, record->name, (void **)&queue) == 0) {
+        mx_arena_push_free(block); /* duplicate record */
+        return 0;
+    }
+
+    queue = mx_queue_create(record->name, record->name_len);
+    if (!queue) {
+        return -1;
+    }
+
+    /* use the old record instead of the new one */
+    if (queue->arena) {
+        mx_arena_free(queue->arena);
+    }
+    queue->arena = record;
+
+    if (hash_insert(mx_global->queue_table, record->name, queue) != 0) {
+        mx_queue_free(queue);
+        return -1;
+    }
+
+    return 0;
+}
+
+
+static int mx_arena_recover_job(struct mx_arena_block *block)
+{
+    struct mx_arena_block *qblock;
+    struct mx_arena_queue *record;
+    mx_queue_t *queue;
+    mx_job_t *job;
+    int ret;
+
+    job = (mx_job_t *)((char *)block + sizeof(*block));
+    qblock = mx_arena_pointer(block->queue);
+
+    if (block->queue < MX_ARENA_DATA || block->queue >= mx_arena_head->top ||
+        qblock->type != mx_arena_queue_block ||
+        job->length < 0 || sizeof(*block) + sizeof(*job) + job->length + 2 > block->size)
+    {
+        mx_arena_push_free(block); /* broken job */
+        return 0;
+    }
+
+    record = (struct mx_arena_queue *)((char *)qblock + sizeof(*qblock));
+
+    if (hash_lookup(mx_global->queue_table, record->name, (void **)&queue) == -1) {
+        mx_arena_push_free(block);
+        return 0;
+    }
+
+    job->belong = queue;
+    job->shared = NULL;
+    job->body = job->data;  /* the arena may be mapped elsewhere */
+
+    if (block->recycle_id > 0) {
+        if (job->timeout <= mx_current_time) { /* lease expired */
+            mx_arena_push_free(block);
+            return 0;
+        }
+
+        ret = mx_inflight_add(block->recycle_id, job) == 0 ?
+              SKL_STATUS_OK : SKL_STATUS_MEM_EXHAUSTED;
+
+        if (block->recycle_id >= mx_global->last_recycle_id) {
+            mx_global->last_recycle_id = block->recycle_id + 1;
+        }
+
+    } else if (job->timeout > mx_current_time) {
+        ret = mx_skiplist_insert(mx_global->delay_queue, job->timeout, job);
+
+    } else {
+        job->timeout = 0;
+        ret = mx_skiplist_insert(queue->list, job->prival, job);
+        if (ret == SKL_STATUS_OK) {
+            queue->bytes += job->length;
+        }
+    }
+
+    return ret == SKL_STATUS_OK ? 1 : -1;
+}
+
+
+/*
+ * The recovery pass: rebuild queues and free lists from the blocks,
+ * return the number of recovered jobs
+ */
+static int mx_arena_recover()
+{
+    struct mx_arena_block *block;
+    long off, end = mx_arena_head->top;
+    int count = 0, ret, pass;
+
+    /* first pass for queues, second pass for jobs and free blocks */
+    for (pass = 0; pass < 2; pass++) {
+
+        for (off = MX_ARENA_DATA; off < end; off += block->size) {
+
+            block = mx_arena_pointer(off);
+
+            if (block->size < sizeof(*block) || block->size % MX_ARENA_UNIT ||
+                off + block->size > end)
+            {
+                mx_write_log(mx_log_error, "arena broken at offset %ld, truncated", off);
+                end = mx_arena_head->top = off;
+                break;
+            }
+
+            if (pass == 0) {
+                if (block->type == mx_arena_queue_block &&
+                    mx_arena_recover_queue(block) != 0)
+                {
+                    return -1;
+                }
+                continue;
+            }
+
+            switch (block->type) {
+            case mx_arena_queue_block:
+                break;
+            case mx_arena_job_block:
+                if ((ret = mx_arena_recover_job(block)) == -1) {
+                    return -1;
+                }
+                count += ret;
+                break;
+            default: /* free, pending or unknown */
+                mx_arena_push_free(block);
+                break;
+            }
+        }
+    }
+
+    if (mx_arena_head->last_recycle_id > mx_global->last_recycle_id) {
+        mx_global->last_recycle_id = mx_arena_head->last_recycle_id;
+    }
+
+    return count;
+}
+
+
+/*
+ * Map the arena file, return 1 if attached an used arena,
+ * 0 if the arena was created, -1 on error
+ */
+int mx_arena_init()
+{
+    struct stat st;
+    long size = mx_global->arena_size;
+    int fresh = 0, count;
+
+    memset(mx_arena_free_lists, 0, sizeof(mx_arena_free_lists));
+
+    mx_arena_fd = open(mx_global->arena_path, O_RDWR|O_CREAT, 0644);
+    if (mx_arena_fd == -1) {
+        mx_write_log(mx_log_error, "failed to open arena `%s', message(%s)",
+                     mx_global->arena_path, strerror(errno));
+        return -1;
+    }
+
+    /* only one process could attach the arena */
+    if (flock(mx_arena_fd, LOCK_EX|LOCK_NB) == -1) {
+        mx_write_log(mx_log_error, "arena `%s' was locked by other process",
+                     mx_global->arena_path);
+        goto failed;
+    }
+
+    if (fstat(mx_arena_fd, &st) == -1) {
+        goto failed;
+    }
+
+    if (st.st_size < MX_ARENA_DATA) {
+        fresh = 1;
+    } else if (st.st_size > size) {
+        size = st.st_size; /* never shrink an used arena */
+    }
+
+    if (st.st_size != size && ftruncate(mx_arena_fd, size) == -1) {
+        mx_write_log(mx_log_error, "failed to resize arena, message(%s)", strerror(errno));
+        goto failed;
+    }
+
+    mx_arena_base = mmap(NULL, size, PROT_READ|PROT_WRITE, MAP_SHARED, mx_arena_fd, 0);
+    if (mx_arena_base == MAP_FAILED) {
+        mx_arena_base = NULL;
+        mx_write_log(mx_log_error, "failed to map arena, message(%s)", strerror(errno));
+        goto failed;
+    }
+
+    mx_arena_head = (struct mx_arena_header *)mx_arena_base;
+    mx_arena_size = size;
+
+    if (fresh) {
+        memcpy(mx_arena_head->magic, MX_ARENA_MAGIC, sizeof(mx_arena_head->magic));
+        mx_arena_head->version = MX_ARENA_VERSION;
+        mx_arena_head->job_size = sizeof(mx_job_t);
+        mx_arena_head->top = MX_ARENA_DATA;
+        mx_arena_head->last_recycle_id = 0;
+
+    } else if (memcmp(mx_arena_head->magic, MX_ARENA_MAGIC, sizeof(mx_arena_head->magic)) ||
+               mx_arena_head->version != MX_ARENA_VERSION ||
+               mx_arena_head->job_size != sizeof(mx_job_t) ||
+               mx_arena_head->top < MX_ARENA_DATA || mx_arena_head->top > size)
+    {
+        /* refuse to overwrite an arena we don't understand */
+        mx_write_log(mx_log_error, "`%s' was not a compatible arena file",
+                     mx_global->arena_path);
+        goto failed;
+    }
+
+    mx_arena_head->size = size;
+
+    if (fresh) {
+        return 0;
+    }
+
+    count = mx_arena_recover();
+    if (count == -1) {
+        mx_write_log(mx_log_error, "failed to recover jobs from arena");
+        goto failed;
+    }
+
+    mx_write_log(mx_log_notice, "attached arena `%s', (%d)jobs recovered",
+                 mx_global->arena_path, count);
+
+    return 1;
+
+failed:
+    if (mx_arena_base) {
+        munmap(mx_arena_base, size);
+        mx_arena_base = NULL;
+        mx_arena_size = 0;
+    }
+    close(mx_arena_fd);
+    mx_arena_fd = -1;
+    return -1;
+}
+
+
+/*
+ * Flush the arena, jobs freed after here are kept in the file
+ * (the mapping is left in place until process exit)
+ */
+void mx_arena_close()
+{
+    if (mx_arena_base && !mx_arena_closed) {
+        mx_arena_sync();
+        msync(mx_arena_base, mx_arena_head->top, MS_SYNC);
+        mx_arena_closed = 1;
+    }
+
+    if (mx_arena_fd != -1) {
+        close(mx_arena_fd);
+        mx_arena_fd = -1;
+    }
+}
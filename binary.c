@@ -0,0 +1,189 @@
+/*
+ * Copyright (c) 2012 - 2013, YukChung Lee <liexusong@qq.com>
+ * All rights reserved.
+ *  __   __  __   __         _______  __   __  _______  __   __  _______  ______
+ * |  |_|  ||  |_|  |       |       ||  | |  ||       ||  | |  ||       ||      |
+ * |       ||       | ____  |   _   ||  | |  ||    ___||  | |  ||    ___||  _    |
+ * |       ||       ||____| |  | |  ||  |_|  ||   |___ |  |_|  ||   |___ | | |   |
+ * |       | |     |        |  |_|  ||       ||    ___||       ||    ___|| |_|   |
+ * | ||_|| ||   _   |       |      | |       ||   |___ |       ||   |___ |       |
+ * |_|   |_||__| |__|       |____||_||_______||_______||_______||_______||______|
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/*
+ * Binary protocol.
+ *
+ * A connection whose request starts with the byte 0x80 speaks the binary
+ * protocol for the rest of its life. Every request is a frame:
+ *
+ *   magic(1) opcode(1) nargs(2) request_id(4) body_len(4) body
+ *
+ * The opcode is the index of the command in mx_commands, and the body holds
+ * nargs arguments, each one is a 4 bytes length, the payload and a zero byte.
+ * If the high bit of the length is set, the payload is a 4 bytes integer.
+ * The arguments point into the receive buffer, so the handlers of the text
+ * protocol are used without any copy or tokenizing.
+ *
+ * Every reply is a frame too, carry the request_id of its request:
+ *
+ *   magic(1) status(1) type(1) reserved(1) request_id(4) body_len(4) body
+ *
+ * All the integers are little-endian.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include "global.h"
+
+
+static unsigned int mx_binary_get16(unsigned char *p)
+{
+    return p[0] | (p[1] << 8);
+}
+
+
+static unsigned int mx_binary_get32(unsigned char *p)
+{
+    return p[0] | (p[1] << 8) | (p[2] << 16) | ((unsigned int)p[3] << 24);
+}
+
+
+char *mx_binary_put32(char *buf, unsigned int value)
+{
+    unsigned char *p = (unsigned char *)buf;
+
+    p[0] = value & 0xff;
+    p[1] = (value >> 8) & 0xff;
+    p[2] = (value >> 16) & 0xff;
+    p[3] = (value >> 24) & 0xff;
+
+    return buf + 4;
+}
+
+
+/*
+ * Parse a request frame in the receive buffer, the arguments are stored
+ * from tokens[first]. Return the number of tokens (first + nargs),
+ * 0 if the frame isn't complete, or -1 if it's broken.
+ */
+int mx_binary_parse(mx_connection_t *c, mx_token_t *tokens, int first,
+    int *opcode, unsigned int *request_id)
+{
+    unsigned char *pos = (unsigned char *)c->recvpos;
+    unsigned char *end;
+    unsigned int length, size;
+    int nargs, i;
+
+    if (c->recvlast - c->recvpos < MX_BINARY_HEADER_SIZE) {
+        return 0;
+    }
+
+    if (pos[0] != MX_BINARY_REQUEST_MAGIC) {
+        return -1;
+    }
+
+    nargs = mx_binary_get16(pos + 2);
+    length = mx_binary_get32(pos + 8);
+
+    /* a frame carries the command or some arguments at least */
+    if (first + nargs == 0 || first + nargs >= MX_MAX_TOKENS ||
+        length > MX_RECVBUF_SIZE - MX_BINARY_HEADER_SIZE)
+    {
+        return -1;
+    }
+
+    if (c->recvlast - c->recvpos < MX_BINARY_HEADER_SIZE + length) {
+        return 0;
+    }
+
+    *opcode = pos[1];
+    *request_id = mx_binary_get32(pos + 4);
+
+    pos += MX_BINARY_HEADER_SIZE;
+    end = pos + length;
+
+    for (i = first; i < first + nargs; i++) {
+
+        if (end - pos < 4) {
+            return -1;
+        }
+
+        size = mx_binary_get32(pos);
+        pos += 4;
+
+        tokens[i].is_integer = 0;
+
+        if (size & MX_BINARY_INTEGER) {
+            size = 4;
+            if (end - pos >= 4) {
+                tokens[i].integer = (int)mx_binary_get32(pos);
+                tokens[i].is_integer = 1;
+            }
+        }
+
+        /* payload must be followed by zero byte */
+        if ((unsigned int)(end - pos) < size + 1 || pos[size] != 0) {
+            return -1;
+        }
+
+        tokens[i].value = (char *)pos;
+        tokens[i].length = size;
+
+        pos += size + 1;
+    }
+
+    tokens[i].value = NULL;
+
+    c->recvpos = (char *)end;
+
+    return i;
+}
+
+
+/*
+ * Write a reply frame header, return the position of the body
+ */
+char *mx_binary_header(char *buf, int status, mx_binary_type type,
+    unsigned int request_id, int length)
+{
+    unsigned char *p = (unsigned char *)buf;
+
+    p[0] = MX_BINARY_REPLY_MAGIC;
+    p[1] = status;
+    p[2] = type;
+    p[3] = 0;
+
+    mx_binary_put32(buf + 4, request_id);
+    mx_binary_put32(buf + 8, length);
+
+    return buf + MX_BINARY_HEADER_SIZE;
+}
+
+
+/*
+ * Get integer from token, binary integer arguments needn't to convert
+ */
+int mx_token_int(mx_token_t *token, int *retval)
+{
+    if (token->is_integer) {
+        *retval = token->integer;
+        return 0;
+    }
+
+    return mx_atoi(token->value, retval);
+}
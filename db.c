@@ -27,42 +27,62 @@
 
 #include <sys/types.h>
 #include <sys/wait.h>
+#include <sys/time.h>
+#include <signal.h>
 #include <stdlib.h>
 #include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <time.h>
 #include <errno.h>
 #include "global.h"
+#include "dbfile.h"
 
-/* background save queues feature support */
-
-#define MX_BGSAVE_HEADER "MXQUEUED/0.7"
+#if MX_QUEUE_NAME_MAX > MX_DBFILE_NAME_MAX
+#error "queue name may be too long for database file"
+#endif
 
-struct mx_job_header {
-    int prival;
-    int timeout;
-    int qlen;  /* queue name's length */
-    int jlen;  /* job body's length */
-};
+/* background save queues feature support */
 
+#define MX_BGSAVE_BUFFER_SIZE  (4 * 1024 * 1024)
 
 static FILE *mx_dbfp = NULL;
-static struct mx_job_header mx_null_header = {0, 0, 0, 0};
+static int mx_save_generation = 0;  /* marks shared bodies written */
+static int mx_save_bodies = 0;      /* last shared body id */
 
 
-int mx_save_job(mx_job_t *job)
+int mx_save_job(mx_job_t *job, int recycle_id)
 {
     struct mx_job_header header;
     mx_queue_t *queue = job->belong;
+    mx_body_t *body = job->shared;
 
     header.prival = job->prival;
     header.timeout = job->timeout;
+    header.recycle_id = recycle_id;
     header.qlen = queue->name_len;
     header.jlen = job->length;
+    header.body_id = 0;
+
+    /* shared body is written with its first job only */
+    if (body && body->refcount > 1) {
+        if (body->save_gen != mx_save_generation) {
+            body->save_gen = mx_save_generation;
+            body->save_id = ++mx_save_bodies;
+            header.body_id = body->save_id;
+        } else {
+            header.body_id = -body->save_id;
+        }
+    }
 
-    if (fwrite(&header, sizeof(header), 1, mx_dbfp) != 1) return -1;      /* write job header */
-    if (fwrite(queue->name, queue->name_len, 1, mx_dbfp) != 1) return -1; /* write queue name */
-    if (fwrite(job->body, job->length, 1, mx_dbfp) != 1) return -1;       /* write queue data */
+    return mx_dbfile_write_record(mx_dbfp, MX_DBFILE_VERSION, &header,
+                                  queue->name, job->body);
+}
 
-    return 0;
+
+static int mx_save_spill_job(mx_job_t *job)
+{
+    return mx_save_job(job, 0);
 }
 
 
@@ -74,11 +94,13 @@ int mx_save_ready_queue(char *queue_name, int name_length, void *data)
     root = node = queue->list->root;
     while (node->forward[0] != root) {
         node = node->forward[0];
-        if (mx_save_job(node->rec) != 0) {
+        if (mx_save_job(node->rec, 0) != 0) {
             return -1;
         }
     }
-    return 0;
+
+    /* spilled jobs were behind the memory part */
+    return mx_spill_foreach(queue, mx_save_spill_job);
 }
 
 
@@ -90,7 +112,7 @@ int mx_save_delay_queue()
 
     while (node->forward[0] != root) {
         node = node->forward[0];
-        if (mx_save_job(node->rec) != 0) {
+        if (mx_save_job(node->rec, 0) != 0) {
             return -1;
         }
     }
@@ -98,22 +120,17 @@ int mx_save_delay_queue()
 }
 
 
-int mx_save_recycle_queue()
+static int mx_save_recycle_job(int recycle_id, mx_job_t *job)
 {
-    mx_skiplist_node_t *root, *node;
-    mx_job_t *job;
+    return mx_save_job(job, recycle_id);
+}
 
-    node = root = mx_global->recycle_queue->root;
 
-    while (node->forward[0] != root) {
-        node = node->forward[0];
-        job = node->rec;
-        job->timeout = 0; /* set timeout to zero */
-        if (mx_save_job(job) != 0) {
-            return -1;
-        }
-    }
-    return 0;
+int mx_save_recycle_queue()
+{
+    /* keep recycle id and lease deadline, so touched jobs
+     * would not be redelivered all at once after restart */
+    return mx_inflight_foreach(mx_save_recycle_job);
 }
 
 
@@ -130,7 +147,15 @@ static int mx_do_bgsave_queue()
         return -1;
     }
 
-    if (fwrite(MX_BGSAVE_HEADER, sizeof(MX_BGSAVE_HEADER) - 1, 1, mx_dbfp) != 1) {
+    /* jobs are written sequentially, use a large buffer */
+    setvbuf(mx_dbfp, NULL, _IOFBF, MX_BGSAVE_BUFFER_SIZE);
+
+    mx_save_generation++;
+    mx_save_bodies = 0;
+
+    if (mx_dbfile_write_header(mx_dbfp, MX_DBFILE_VERSION,
+                               mx_global->last_recycle_id) != 0)
+    {
         goto failed;
     }
 
@@ -141,8 +166,8 @@ static int mx_do_bgsave_queue()
         goto failed;
     }
 
-    /* save delay queue */
-    if (fwrite(&mx_null_header, sizeof(mx_null_header), 1, mx_dbfp) != 1) {
+    /* end of database */
+    if (mx_dbfile_write_end(mx_dbfp, MX_DBFILE_VERSION) != 0) {
         goto failed;
     }
 
@@ -189,6 +214,7 @@ static int mx_bgsave_queues()
         exit(0);
     default: /* parent */
         mx_global->bgsave_pid = pid; /* save the background save process ID */
+        mx_global->bgsave_start = mx_clock_usec();
         mx_global->dirty = 0; /* clean dirty */
         break;
     }
@@ -215,20 +241,26 @@ int mx_try_bgsave_queues()
             if (!bysignal && exitcode == 0) {
                 mx_write_log(mx_log_debug, "background saving terminated with success");
                 mx_global->last_bgsave_time = mx_current_time;
+                mx_global->last_bgsave_status = 0;
 
             } else if (!bysignal && exitcode != 0) {
                 mx_write_log(mx_log_notice, "background saving failed");
+                mx_global->last_bgsave_status = -1;
 
             } else {
                 mx_write_log(mx_log_notice, "background saving terminated by signal");
                 sprintf(tbuf, "%s.%d", mx_global->bgsave_filepath, mx_global->bgsave_pid);
                 unlink(tbuf);
+                mx_global->last_bgsave_status = -1;
             }
 
+            mx_global->last_bgsave_duration = mx_clock_usec() - mx_global->bgsave_start;
             mx_global->bgsave_pid = -1;
+            mx_arena_release_deferred();
+            mx_spill_release_deferred();
         }
 
-    } else {
+    } else if (!mx_global->shutdown) { /* final save would be done when exiting */
         if (((mx_current_time - mx_global->last_bgsave_time) > mx_global->bgsave_times && 
              mx_global->dirty > 0) || mx_global->dirty >= mx_global->bgsave_changes)
         {
@@ -241,14 +273,148 @@ int mx_try_bgsave_queues()
 }
 
 
+/*
+ * Kill the background save process, the final save
+ * would be done by ourself
+ */
+void mx_bgsave_cancel()
+{
+    char tbuf[2048];
+
+    if (mx_global->bgsave_pid == -1) {
+        return;
+    }
+
+    kill(mx_global->bgsave_pid, SIGKILL);
+    waitpid(mx_global->bgsave_pid, NULL, 0);
+
+    sprintf(tbuf, "%s.%d", mx_global->bgsave_filepath, mx_global->bgsave_pid);
+    unlink(tbuf);
+
+    mx_write_log(mx_log_notice, "background saving was canceled");
+
+    mx_global->bgsave_pid = -1;
+    mx_arena_release_deferred();
+    mx_spill_release_deferred();
+}
+
+
+/*
+ * Save queues in the server process when it's exiting,
+ * don't need to fork because nobody would change the queues
+ */
+int mx_save_queues()
+{
+    struct timeval begin, end;
+    long elapsed;
+
+    mx_bgsave_cancel();
+
+    gettimeofday(&begin, NULL);
+
+    if (mx_do_bgsave_queue() != 0) {
+        mx_write_log(mx_log_error, "failed to save queues before exit");
+        return -1;
+    }
+
+    gettimeofday(&end, NULL);
+
+    elapsed = (end.tv_sec - begin.tv_sec) * 1000 +
+              (end.tv_usec - begin.tv_usec) / 1000;
+
+    mx_write_log(mx_log_notice, "saved queues to (%s) before exit in %ld ms",
+                 mx_global->bgsave_filepath, elapsed);
+
+    mx_global->dirty = 0;
+
+    return 0;
+}
+
+
+/*
+ * Shared bodies of the file being loaded, the index is body id - 1,
+ * each one holds a reference until loading finished
+ */
+static mx_body_t **mx_load_bodies = NULL;
+static int mx_load_bodies_count = 0;
+static int mx_load_bodies_size = 0;
+
+
+static mx_body_t *mx_load_body(FILE *fp, struct mx_job_header *header)
+{
+    mx_body_t *body, **bodies;
+    int size;
+
+    /* references a body read before */
+    if (header->body_id < 0) {
+        if (-header->body_id > mx_load_bodies_count ||
+            mx_load_bodies[-header->body_id-1]->length != header->jlen)
+        {
+            errno = EINVAL;
+            return NULL;
+        }
+        return mx_load_bodies[-header->body_id-1];
+    }
+
+    if (header->body_id != mx_load_bodies_count + 1) {
+        errno = EINVAL;
+        return NULL;
+    }
+
+    if (mx_load_bodies_count >= mx_load_bodies_size) {
+        size = mx_load_bodies_size ? mx_load_bodies_size * 2 : 64;
+        bodies = realloc(mx_load_bodies, sizeof(*bodies) * size);
+        if (!bodies) {
+            return NULL;
+        }
+        mx_load_bodies = bodies;
+        mx_load_bodies_size = size;
+    }
+
+    body = mx_body_create(header->jlen);
+    if (!body) {
+        return NULL;
+    }
+
+    if (mx_dbfile_read_body(fp, header, body->data) != MX_DBFILE_OK) {
+        mx_body_release(body);
+        return NULL;
+    }
+
+    body->data[body->length] = CR_CHR;
+    body->data[body->length+1] = LF_CHR;
+
+    mx_load_bodies[mx_load_bodies_count++] = body;
+
+    return body;
+}
+
+
+static void mx_load_bodies_free()
+{
+    int i;
+
+    for (i = 0; i < mx_load_bodies_count; i++) {
+        mx_body_release(mx_load_bodies[i]);
+    }
+
+    free(mx_load_bodies);
+    mx_load_bodies = NULL;
+    mx_load_bodies_count = 0;
+    mx_load_bodies_size = 0;
+}
+
+
 int mx_load_queues()
 {
     struct mx_job_header header;
     mx_queue_t *queue;
+    mx_body_t *body;
     mx_job_t *job;
     time_t current_time = time(NULL);
-    int count = 0;
-    char tbuf[128];
+    int count = 0, recycles = 0;
+    int last_recycle_id = 0, version;
+    char tbuf[MX_DBFILE_NAME_MAX + 1];
     FILE *fp;
     int retval;
 
@@ -258,33 +424,30 @@ int mx_load_queues()
         return 0;
     }
 
-    if (fread(tbuf, sizeof(MX_BGSAVE_HEADER) - 1, 1, fp) != 1) {
-        goto failed;
-    }
-
-    if (strncmp(tbuf, MX_BGSAVE_HEADER, sizeof(MX_BGSAVE_HEADER) - 1) != 0) {
+    retval = mx_dbfile_read_header(fp, &version, &last_recycle_id);
+    if (retval == MX_DBFILE_BAD_FORMAT) {
         mx_write_log(mx_log_debug, "(%s) was a invaild database file", mx_global->bgsave_filepath);
         fclose(fp);
         return -1;
+
+    } else if (retval != MX_DBFILE_OK) {
+        goto failed;
     }
 
     while (1)
     {
-        if (fread(&header, sizeof(header), 1, fp) != 1) {
-            goto failed;
-        }
-
-        /* finish and break */
-        if (header.qlen == 0 || header.jlen == 0) {
+        retval = mx_dbfile_read_record(fp, version, &header, tbuf);
+        if (retval == MX_DBFILE_END) {
             break;
         }
 
-        if (fread(tbuf, header.qlen, 1, fp) != 1) {
+        if (retval != MX_DBFILE_OK) {
+            if (retval == MX_DBFILE_BAD_FORMAT) {
+                errno = EINVAL;
+            }
             goto failed;
         }
 
-        tbuf[header.qlen] = 0;
-
         /* find the queue from queue table */
         if (hash_lookup(mx_global->queue_table, tbuf, (void **)&queue) == -1)
         {
@@ -298,40 +461,86 @@ int mx_load_queues()
             }
         }
 
-        job = mx_job_create(queue, header.prival, header.timeout, header.jlen);
-        if (!job) {
-            goto failed;
-        }
+        if (header.body_id != 0) {
+            if (!(body = mx_load_body(fp, &header))) {
+                goto failed;
+            }
 
-        if (fread(job->body, job->length, 1, fp) != 1) {
-            goto failed;
+            job = mx_job_create_shared(queue, header.prival, 0, body);
+            if (!job) {
+                goto create_failed;
+            }
+
+        } else {
+            job = mx_job_create(queue, header.prival, 0, header.jlen);
+            if (!job) {
+                goto create_failed;
+            }
+
+            if (mx_dbfile_read_body(fp, &header, job->body) != MX_DBFILE_OK) {
+                mx_job_free(job);
+                goto failed;
+            }
+
+            job->body[job->length] = CR_CHR;
+            job->body[job->length+1] = LF_CHR;
         }
 
-        job->body[job->length] = CR_CHR;
-        job->body[job->length+1] = LF_CHR;
+        job->timeout = header.timeout;
+
+        mx_arena_job_commit(job);
+
+        if (header.recycle_id > 0) {
 
-        if (job->timeout > 0 && job->timeout > current_time) {
+            /* lease expired, the job would be freed by core timer */
+            if (job->timeout <= current_time) {
+                mx_job_free(job);
+                continue;
+            }
+
+            mx_arena_job_recycle(job, header.recycle_id);
+            retval = mx_inflight_add(header.recycle_id, job);
+
+            if (header.recycle_id >= last_recycle_id) {
+                last_recycle_id = header.recycle_id + 1;
+            }
+
+            recycles++;
+
+        } else if (job->timeout > 0 && job->timeout > current_time) {
             retval = mx_skiplist_insert(mx_global->delay_queue, job->timeout, job);
 
         } else {
             job->timeout = 0;
-            retval = mx_skiplist_insert(queue->list, job->prival, job);
+            retval = mx_queue_insert(queue, job);
         }
 
         if (retval != 0) {
+            mx_job_free(job);
             goto failed;
         }
 
         count++;
     }
 
-    mx_write_log(mx_log_debug, "finish load (%d)jobs from disk", count);
+    if (last_recycle_id > mx_global->last_recycle_id) {
+        mx_global->last_recycle_id = last_recycle_id;
+    }
+
+    mx_write_log(mx_log_debug, "finish load (%d)jobs (%d shared bodies) from disk, "
+                 "(%d)jobs were touched", count, mx_load_bodies_count, recycles);
+    mx_load_bodies_free();
     fclose(fp);
     return 0;
 
+create_failed:
+    if (mx_global->arena_enable) {
+        errno = ENOSPC; /* jobs can't be out of arena */
+    }
+
 failed:
     mx_write_log(mx_log_error, "failed to read jobs from disk, message(%s)", strerror(errno));
+    mx_load_bodies_free();
     fclose(fp);
     return -1;
 }
-
@@ -0,0 +1,296 @@
+/*
+ * Copyright (c) 2012 - 2013, Jackson Lie <liexusong@qq.com>
+ * All rights reserved.
+ *  __   __  __   __         _______  __   __  _______  __   __  _______  ______  
+ * |  |_|  ||  |_|  |       |       ||  | |  ||       ||  | |  ||       ||      | 
+ * |       ||       | ____  |   _   ||  | |  ||    ___||  | |  ||    ___||  _    |
+ * |       ||       ||____| |  | |  ||  |_|  ||   |___ |  |_|  ||   |___ | | |   |
+ * |       | |     |        |  |_|  ||       ||    ___||       ||    ___|| |_|   |
+ * | ||_|| ||   _   |       |      | |       ||   |___ |       ||   |___ |       |
+ * |_|   |_||__| |__|       |____||_||_______||_______||_______||_______||______|
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/*
+ * Database file layout:
+ *
+ *   "MXQUEUED/0.9" last_recycle_id
+ *   header queue_name job_body
+ *   ...
+ *   header (with zero queue name length)
+ *
+ * A body shared by jobs (fanout) is written once: the first job with
+ * it has a positive body_id and the body, the others have the negated
+ * body_id and no body. Ids are numbered from 1 in writing order.
+ *
+ * 0.8 files have no body_id, 0.7 files have neither last_recycle_id
+ * nor the recycle id of header.
+ */
+
+#include <string.h>
+#include <errno.h>
+#include "dbfile.h"
+
+#define MX_DBFILE_MAGIC_V07  "MXQUEUED/0.7"
+#define MX_DBFILE_MAGIC_V08  "MXQUEUED/0.8"
+#define MX_DBFILE_MAGIC_V09  "MXQUEUED/0.9"
+#define MX_DBFILE_MAGIC_LEN  (sizeof(MX_DBFILE_MAGIC_V09) - 1)
+
+/* 0.7 database file haven't recycle id field */
+struct mx_job_header_v07 {
+    int prival;
+    int timeout;
+    int qlen;
+    int jlen;
+};
+
+/* 0.8 database file haven't body id field */
+struct mx_job_header_v08 {
+    int prival;
+    int timeout;
+    int recycle_id;
+    int qlen;
+    int jlen;
+};
+
+
+char *mx_dbfile_version_name(int version)
+{
+    switch (version) {
+    case MX_DBFILE_V07:
+        return "0.7";
+    case MX_DBFILE_V08:
+        return "0.8";
+    case MX_DBFILE_V09:
+        return "0.9";
+    }
+    return "unknown";
+}
+
+
+int mx_dbfile_read_header(FILE *fp, int *version, int *last_recycle_id)
+{
+    char magic[MX_DBFILE_MAGIC_LEN];
+
+    *last_recycle_id = 0;
+
+    if (fread(magic, sizeof(magic), 1, fp) != 1) {
+        return feof(fp) ? MX_DBFILE_BAD_FORMAT : MX_DBFILE_IO_ERROR;
+    }
+
+    if (memcmp(magic, MX_DBFILE_MAGIC_V07, sizeof(magic)) == 0) {
+        *version = MX_DBFILE_V07;
+        return MX_DBFILE_OK;
+    }
+
+    if (memcmp(magic, MX_DBFILE_MAGIC_V08, sizeof(magic)) == 0) {
+        *version = MX_DBFILE_V08;
+    } else if (memcmp(magic, MX_DBFILE_MAGIC_V09, sizeof(magic)) == 0) {
+        *version = MX_DBFILE_V09;
+    } else {
+        return MX_DBFILE_BAD_FORMAT;
+    }
+
+    if (fread(last_recycle_id, sizeof(int), 1, fp) != 1) {
+        return feof(fp) ? MX_DBFILE_BAD_FORMAT : MX_DBFILE_IO_ERROR;
+    }
+
+    return MX_DBFILE_OK;
+}
+
+
+/*
+ * Read a job header and its queue name (name must have
+ * MX_DBFILE_NAME_MAX + 1 bytes), the body is left in file
+ */
+int mx_dbfile_read_record(FILE *fp, int version, struct mx_job_header *header, char *name)
+{
+    struct mx_job_header_v07 header_v07;
+    struct mx_job_header_v08 header_v08;
+
+    if (version == MX_DBFILE_V07) {
+        if (fread(&header_v07, sizeof(header_v07), 1, fp) != 1) {
+            goto read_failed;
+        }
+
+        header->prival = header_v07.prival;
+        header->timeout = header_v07.timeout;
+        header->recycle_id = 0;
+        header->qlen = header_v07.qlen;
+        header->jlen = header_v07.jlen;
+        header->body_id = 0;
+
+    } else if (version == MX_DBFILE_V08) {
+        if (fread(&header_v08, sizeof(header_v08), 1, fp) != 1) {
+            goto read_failed;
+        }
+
+        header->prival = header_v08.prival;
+        header->timeout = header_v08.timeout;
+        header->recycle_id = header_v08.recycle_id;
+        header->qlen = header_v08.qlen;
+        header->jlen = header_v08.jlen;
+        header->body_id = 0;
+
+    } else if (fread(header, sizeof(*header), 1, fp) != 1) {
+        goto read_failed;
+    }
+
+    /* finish (queue name never be empty) */
+    if (header->qlen == 0) {
+        return MX_DBFILE_END;
+    }
+
+    if (header->qlen < 0 || header->qlen > MX_DBFILE_NAME_MAX ||
+        header->jlen < 0 || header->recycle_id < 0)
+    {
+        return MX_DBFILE_BAD_FORMAT;
+    }
+
+    if (fread(name, header->qlen, 1, fp) != 1) {
+        goto read_failed;
+    }
+
+    name[header->qlen] = 0;
+
+    return MX_DBFILE_OK;
+
+read_failed:
+    return feof(fp) ? MX_DBFILE_BAD_FORMAT : MX_DBFILE_IO_ERROR;
+}
+
+
+/*
+ * Read the job body, body is NULL means skip it. Nothing to read
+ * if the job references a shared body written before
+ */
+int mx_dbfile_read_body(FILE *fp, struct mx_job_header *header, char *body)
+{
+    if (header->jlen == 0 || header->body_id < 0) {
+        return MX_DBFILE_OK;
+    }
+
+    if (body == NULL) {
+        if (fseeko(fp, header->jlen, SEEK_CUR) != 0) {
+            return MX_DBFILE_IO_ERROR;
+        }
+        return MX_DBFILE_OK;
+    }
+
+    if (fread(body, header->jlen, 1, fp) != 1) {
+        return feof(fp) ? MX_DBFILE_BAD_FORMAT : MX_DBFILE_IO_ERROR;
+    }
+
+    return MX_DBFILE_OK;
+}
+
+
+int mx_dbfile_write_header(FILE *fp, int version, int last_recycle_id)
+{
+    char *magic;
+
+    switch (version) {
+    case MX_DBFILE_V07:
+        magic = MX_DBFILE_MAGIC_V07;
+        break;
+    case MX_DBFILE_V08:
+        magic = MX_DBFILE_MAGIC_V08;
+        break;
+    case MX_DBFILE_V09:
+        magic = MX_DBFILE_MAGIC_V09;
+        break;
+    default:
+        errno = EINVAL;
+        return -1;
+    }
+
+    if (fwrite(magic, MX_DBFILE_MAGIC_LEN, 1, fp) != 1) {
+        return -1;
+    }
+
+    if (version >= MX_DBFILE_V08 &&
+        fwrite(&last_recycle_id, sizeof(int), 1, fp) != 1)
+    {
+        return -1;
+    }
+
+    return 0;
+}
+
+
+/*
+ * Write a job record, 0.7 files can't keep touched jobs,
+ * they are written as ready jobs. Before 0.9 the body is
+ * always written, so body must be given even if body_id < 0
+ */
+int mx_dbfile_write_record(FILE *fp, int version, struct mx_job_header *header,
+    char *name, char *body)
+{
+    struct mx_job_header_v07 header_v07;
+    struct mx_job_header_v08 header_v08;
+    int skip_body = 0;
+
+    if (version == MX_DBFILE_V07) {
+        header_v07.prival = header->prival;
+        header_v07.timeout = header->recycle_id ? 0 : header->timeout;
+        header_v07.qlen = header->qlen;
+        header_v07.jlen = header->jlen;
+
+        if (fwrite(&header_v07, sizeof(header_v07), 1, fp) != 1) return -1;
+
+    } else if (version == MX_DBFILE_V08) {
+        header_v08.prival = header->prival;
+        header_v08.timeout = header->timeout;
+        header_v08.recycle_id = header->recycle_id;
+        header_v08.qlen = header->qlen;
+        header_v08.jlen = header->jlen;
+
+        if (fwrite(&header_v08, sizeof(header_v08), 1, fp) != 1) return -1;
+
+    } else {
+        if (fwrite(header, sizeof(*header), 1, fp) != 1) return -1;
+        skip_body = header->body_id < 0;
+    }
+
+    if (fwrite(name, header->qlen, 1, fp) != 1) return -1; /* write queue name */
+
+    if (!skip_body && header->jlen > 0 &&
+        fwrite(body, header->jlen, 1, fp) != 1) /* write job body */
+    {
+        return -1;
+    }
+
+    return 0;
+}
+
+
+int mx_dbfile_write_end(FILE *fp, int version)
+{
+    struct mx_job_header header;
+
+    memset(&header, 0, sizeof(header));
+
+    if (version == MX_DBFILE_V07) {
+        return fwrite(&header, sizeof(struct mx_job_header_v07), 1, fp) == 1 ? 0 : -1;
+    }
+
+    if (version == MX_DBFILE_V08) {
+        return fwrite(&header, sizeof(struct mx_job_header_v08), 1, fp) == 1 ? 0 : -1;
+    }
+
+    return fwrite(&header, sizeof(header), 1, fp) == 1 ? 0 : -1;
+}
@@ -0,0 +1,44 @@
+/*
+ * Copyright (C) YukChung Lee
+ */
+
+#ifndef __MX_DBFILE_H
+#define __MX_DBFILE_H
+
+#include <stdio.h>
+
+/* database file format shared by server and mx-dbtool */
+
+#define MX_DBFILE_V07      7
+#define MX_DBFILE_V08      8
+#define MX_DBFILE_V09      9
+#define MX_DBFILE_VERSION  MX_DBFILE_V09
+
+#define MX_DBFILE_NAME_MAX  127
+
+enum MX_DBFILE_STATUS {
+    MX_DBFILE_OK = 0,
+    MX_DBFILE_END,        /* end of database */
+    MX_DBFILE_IO_ERROR,
+    MX_DBFILE_BAD_FORMAT
+};
+
+struct mx_job_header {
+    int prival;
+    int timeout;     /* delay time or recycle lease deadline */
+    int recycle_id;  /* not zero when the job was touched */
+    int qlen;        /* queue name's length */
+    int jlen;        /* job body's length */
+    int body_id;     /* shared body: >0 defines it, <0 references it */
+};
+
+int mx_dbfile_read_header(FILE *fp, int *version, int *last_recycle_id);
+int mx_dbfile_read_record(FILE *fp, int version, struct mx_job_header *header, char *name);
+int mx_dbfile_read_body(FILE *fp, struct mx_job_header *header, char *body);
+int mx_dbfile_write_header(FILE *fp, int version, int last_recycle_id);
+int mx_dbfile_write_record(FILE *fp, int version, struct mx_job_header *header,
+    char *name, char *body);
+int mx_dbfile_write_end(FILE *fp, int version);
+char *mx_dbfile_version_name(int version);
+
+#endif
@@ -0,0 +1,760 @@
+/*
+ * Copyright (c) 2012 - 2013, YukChung Lee <liexusong@qq.com>
+ * All rights reserved.
+ *  __   __  __   __         _______  __   __  _______  __   __  _______  ______
+ * |  |_|  ||  |_|  |       |       ||  | |  ||       ||  | |  ||       ||      |
+ * |       ||       | ____  |   _   ||  | |  ||    ___||  | |  ||    ___||  _    |
+ * |       ||       ||____| |  | |  ||  |_|  ||   |___ |  |_|  ||   |___ | | |   |
+ * |       | |     |        |  |_|  ||       ||    ___||       ||    ___|| |_|   |
+ * | ||_|| ||   _   |       |      | |       ||   |___ |       ||   |___ |       |
+ * |_|   |_||__| |__|       |____||_||_______||_______||_______||_______||______|
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/*
+ * mx-dbtool: offline tool for mx-queued database files
+ */
+
+#include <sys/types.h>
+#include <sys/time.h>
+#include <unistd.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <getopt.h>
+
+#include "hash.h"
+#include "skiplist.h"
+#include "dbfile.h"
+
+#define MX_DBTOOL_BUFFER_SIZE  (4 * 1024 * 1024)
+
+typedef int (*mx_dbtool_handler_t)(struct mx_job_header *header,
+    char *name, char *body, void *data);
+
+struct mx_dbtool_stats {
+    long ready;
+    long delayed;
+    long touched;
+    long bytes;
+};
+
+struct mx_dbtool_job {
+    int prival;
+    int timeout;
+    int length;
+    char body[0];
+};
+
+struct mx_dbtool_writer {
+    FILE *fp;
+    int version;
+    int compact;
+    long written;
+    long dropped;
+    int *body_ids;   /* input shared body id to output one */
+    int body_ids_size;
+    int bodies;      /* shared bodies written */
+};
+
+/* shared bodies of the file being scanned */
+struct mx_dbtool_body {
+    int length;
+    char *data;  /* NULL if body isn't needed */
+};
+
+
+static HashTable *mx_dbtool_include = NULL;
+static HashTable *mx_dbtool_exclude = NULL;
+static int mx_dbtool_version = MX_DBFILE_VERSION;
+static time_t mx_dbtool_now;
+
+
+static double mx_dbtool_elapsed(struct timeval *begin)
+{
+    struct timeval end;
+
+    gettimeofday(&end, NULL);
+
+    return (end.tv_sec - begin->tv_sec) +
+           (end.tv_usec - begin->tv_usec) / 1000000.0;
+}
+
+
+static int mx_dbtool_selected(char *name)
+{
+    void *value;
+
+    if (mx_dbtool_include && hash_lookup(mx_dbtool_include, name, &value) == -1) {
+        return 0;
+    }
+
+    if (mx_dbtool_exclude && hash_lookup(mx_dbtool_exclude, name, &value) == 0) {
+        return 0;
+    }
+
+    return 1;
+}
+
+
+/*
+ * Read a shared body, or find the one it references. Return NULL
+ * and set *ret on failed, the body is NULL too if need_body is zero
+ */
+static char *mx_dbtool_shared_body(FILE *fp, struct mx_job_header *header,
+    int need_body, struct mx_dbtool_body **bodies, int *count, int *size, int *ret)
+{
+    struct mx_dbtool_body *shared;
+    int id;
+
+    *ret = MX_DBFILE_BAD_FORMAT;
+
+    if (header->body_id < 0) {
+        id = -header->body_id;
+        if (id > *count || (*bodies)[id-1].length != header->jlen) {
+            return NULL;
+        }
+        *ret = MX_DBFILE_OK;
+        return (*bodies)[id-1].data;
+    }
+
+    if (header->body_id != *count + 1) { /* ids are in writing order */
+        return NULL;
+    }
+
+    if (*count >= *size) {
+        id = *size ? *size * 2 : 64;
+        shared = realloc(*bodies, sizeof(*shared) * id);
+        if (!shared) {
+            fprintf(stderr, "[error] not enough memory for shared bodies\n");
+            *ret = MX_DBFILE_IO_ERROR;
+            return NULL;
+        }
+        *bodies = shared;
+        *size = id;
+    }
+
+    shared = &(*bodies)[*count];
+    shared->length = header->jlen;
+    shared->data = NULL;
+
+    if (need_body) {
+        shared->data = malloc(header->jlen + 1);
+        if (!shared->data) {
+            fprintf(stderr, "[error] not enough memory for a %d bytes job\n", header->jlen);
+            *ret = MX_DBFILE_IO_ERROR;
+            return NULL;
+        }
+    }
+
+    (*count)++;
+
+    *ret = mx_dbfile_read_body(fp, header, shared->data);
+
+    return shared->data;
+}
+
+
+/*
+ * Walk all records of database file, body would be skipped if
+ * need_body is zero. Return 0 on success, print the position of
+ * the broken record and return -1 on failed
+ */
+static int mx_dbtool_scan(char *path, int need_body, mx_dbtool_handler_t handler,
+    void *data, int *version, int *last_recycle_id)
+{
+    struct mx_job_header header;
+    char name[MX_DBFILE_NAME_MAX + 1];
+    struct mx_dbtool_body *bodies = NULL;
+    int bodies_count = 0, bodies_size = 0;
+    char *body = NULL, *job_body;
+    int capacity = 0;
+    off_t offset = 0;
+    FILE *fp;
+    int ret, i;
+
+    fp = fopen(path, "rb");
+    if (!fp) {
+        fprintf(stderr, "[error] can not open `%s': %s\n", path, strerror(errno));
+        return -1;
+    }
+
+    setvbuf(fp, NULL, _IOFBF, MX_DBTOOL_BUFFER_SIZE);
+
+    ret = mx_dbfile_read_header(fp, version, last_recycle_id);
+    if (ret != MX_DBFILE_OK) {
+        fprintf(stderr, "[error] `%s' was not a database file\n", path);
+        goto failed;
+    }
+
+    while (1) {
+        offset = ftello(fp);
+
+        ret = mx_dbfile_read_record(fp, *version, &header, name);
+        if (ret == MX_DBFILE_END) {
+            break;
+        }
+
+        if (ret == MX_DBFILE_OK && header.body_id != 0) {
+            job_body = mx_dbtool_shared_body(fp, &header, need_body, &bodies,
+                                             &bodies_count, &bodies_size, &ret);
+            goto check;
+        }
+
+        job_body = body;
+
+        if (ret == MX_DBFILE_OK && need_body && header.jlen + 1 > capacity) {
+            free(body);
+            capacity = header.jlen + 1;
+            body = job_body = malloc(capacity);
+            if (!body) {
+                fprintf(stderr, "[error] not enough memory for a %d bytes job\n", header.jlen);
+                goto failed;
+            }
+        }
+
+        if (ret == MX_DBFILE_OK) {
+            ret = mx_dbfile_read_body(fp, &header, need_body ? body : NULL);
+        }
+
+check:
+        if (ret != MX_DBFILE_OK) {
+            fprintf(stderr, "[error] %s record at offset %lld\n",
+                    ret == MX_DBFILE_IO_ERROR ? "failed to read" : "broken",
+                    (long long)offset);
+            goto failed;
+        }
+
+        if (handler && handler(&header, name, job_body, data) != 0) {
+            goto failed;
+        }
+    }
+
+    if (fgetc(fp) != EOF) {
+        fprintf(stderr, "[warning] trailing data after end of database at offset %lld\n",
+                (long long)ftello(fp) - 1);
+    }
+
+    ret = 0;
+    goto done;
+
+failed:
+    ret = -1;
+
+done:
+    for (i = 0; i < bodies_count; i++) {
+        free(bodies[i].data);
+    }
+    free(bodies);
+    free(body);
+    fclose(fp);
+    return ret;
+}
+
+
+/* verify command */
+
+static int mx_dbtool_count_handler(struct mx_job_header *header,
+    char *name, char *body, void *data)
+{
+    long *count = data;
+
+    (void)name;
+    (void)body;
+
+    count[0]++;
+    if (header->body_id > 0) {
+        count[1]++; /* shared bodies */
+    }
+    return 0;
+}
+
+
+static int mx_dbtool_verify(char *path)
+{
+    int version, last_recycle_id;
+    long count[2] = {0, 0};
+
+    if (mx_dbtool_scan(path, 0, mx_dbtool_count_handler, count,
+                       &version, &last_recycle_id) != 0)
+    {
+        printf("%s: BROKEN\n", path);
+        return -1;
+    }
+
+    printf("%s: OK, version %s, %ld jobs, %ld shared bodies\n", path,
+           mx_dbfile_version_name(version), count[0], count[1]);
+    return 0;
+}
+
+
+/* stats command */
+
+static int mx_dbtool_stats_handler(struct mx_job_header *header,
+    char *name, char *body, void *data)
+{
+    HashTable *table = data;
+    struct mx_dbtool_stats *stats;
+
+    (void)body;
+
+    if (hash_lookup(table, name, (void **)&stats) == -1) {
+        stats = calloc(1, sizeof(*stats));
+        if (!stats || hash_insert(table, name, stats) == -1) {
+            fprintf(stderr, "[error] not enough memory\n");
+            return -1;
+        }
+    }
+
+    if (header->recycle_id > 0) {
+        stats->touched++;
+    } else if (header->timeout > mx_dbtool_now) {
+        stats->delayed++;
+    } else {
+        stats->ready++;
+    }
+
+    stats->bytes += header->jlen;
+
+    return 0;
+}
+
+
+static struct mx_dbtool_stats mx_dbtool_total;
+
+static int mx_dbtool_print_stats(char *name, int name_len, void *data)
+{
+    struct mx_dbtool_stats *stats = data;
+
+    (void)name_len;
+
+    printf("%-32s %10ld %10ld %10ld %14ld\n", name,
+           stats->ready, stats->delayed, stats->touched, stats->bytes);
+
+    mx_dbtool_total.ready += stats->ready;
+    mx_dbtool_total.delayed += stats->delayed;
+    mx_dbtool_total.touched += stats->touched;
+    mx_dbtool_total.bytes += stats->bytes;
+
+    return 0;
+}
+
+
+static int mx_dbtool_stats(char *path)
+{
+    HashTable *table;
+    int version, last_recycle_id;
+
+    table = hash_alloc(32);
+    if (!table) {
+        return -1;
+    }
+
+    if (mx_dbtool_scan(path, 0, mx_dbtool_stats_handler, table,
+                       &version, &last_recycle_id) != 0)
+    {
+        hash_destroy(table, free);
+        return -1;
+    }
+
+    printf("version: %s\n", mx_dbfile_version_name(version));
+    printf("last recycle id: %d\n\n", last_recycle_id);
+    printf("%-32s %10s %10s %10s %14s\n", "queue", "ready", "delayed", "touched", "bytes");
+
+    memset(&mx_dbtool_total, 0, sizeof(mx_dbtool_total));
+    hash_foreach(table, mx_dbtool_print_stats);
+
+    printf("%-32s %10ld %10ld %10ld %14ld\n", "(total)",
+           mx_dbtool_total.ready, mx_dbtool_total.delayed,
+           mx_dbtool_total.touched, mx_dbtool_total.bytes);
+
+    hash_destroy(table, free);
+    return 0;
+}
+
+
+/* convert and compact commands */
+
+static int mx_dbtool_body_id(struct mx_dbtool_writer *writer,
+    struct mx_job_header *header)
+{
+    int id = header->body_id > 0 ? header->body_id : -header->body_id;
+    int *ids, size;
+
+    if (id >= writer->body_ids_size) {
+        size = writer->body_ids_size ? writer->body_ids_size * 2 : 64;
+        while (size <= id) {
+            size *= 2;
+        }
+
+        ids = realloc(writer->body_ids, sizeof(int) * size);
+        if (!ids) {
+            fprintf(stderr, "[error] not enough memory for shared bodies\n");
+            return -1;
+        }
+
+        memset(ids + writer->body_ids_size, 0,
+               sizeof(int) * (size - writer->body_ids_size));
+
+        writer->body_ids = ids;
+        writer->body_ids_size = size;
+    }
+
+    if (writer->body_ids[id] == 0) { /* its first job may be dropped */
+        writer->body_ids[id] = ++writer->bodies;
+        header->body_id = writer->body_ids[id];
+    } else {
+        header->body_id = -writer->body_ids[id];
+    }
+
+    return 0;
+}
+
+
+static int mx_dbtool_write_handler(struct mx_job_header *header,
+    char *name, char *body, void *data)
+{
+    struct mx_dbtool_writer *writer = data;
+
+    if (!mx_dbtool_selected(name)) {
+        writer->dropped++;
+        return 0;
+    }
+
+    if (writer->compact) {
+        if (header->recycle_id > 0 && header->timeout <= mx_dbtool_now) {
+            writer->dropped++; /* lease expired */
+            return 0;
+        }
+
+        if (header->recycle_id == 0 && header->timeout <= mx_dbtool_now) {
+            header->timeout = 0; /* delay was over */
+        }
+    }
+
+    /* renumber shared bodies, the first written job defines it */
+    if (header->body_id != 0) {
+        if (mx_dbtool_body_id(writer, header) != 0) {
+            return -1;
+        }
+    }
+
+    if (mx_dbfile_write_record(writer->fp, writer->version, header, name, body) != 0) {
+        fprintf(stderr, "[error] failed to write record: %s\n", strerror(errno));
+        return -1;
+    }
+
+    writer->written++;
+
+    return 0;
+}
+
+
+static int mx_dbtool_rewrite(char *input, char *output, int compact)
+{
+    struct mx_dbtool_writer writer;
+    int version, last_recycle_id;
+    char tmpfile[2048];
+
+    snprintf(tmpfile, sizeof(tmpfile), "%s.%d", output, getpid());
+
+    writer.fp = fopen(tmpfile, "wb");
+    if (!writer.fp) {
+        fprintf(stderr, "[error] can not open `%s': %s\n", tmpfile, strerror(errno));
+        return -1;
+    }
+
+    setvbuf(writer.fp, NULL, _IOFBF, MX_DBTOOL_BUFFER_SIZE);
+
+    writer.version = mx_dbtool_version;
+    writer.compact = compact;
+    writer.written = 0;
+    writer.dropped = 0;
+    writer.body_ids = NULL;
+    writer.body_ids_size = 0;
+    writer.bodies = 0;
+
+    /* last recycle id is in the input header, write it after scan */
+    if (mx_dbfile_write_header(writer.fp, writer.version, 0) != 0 ||
+        mx_dbtool_scan(input, 1, mx_dbtool_write_handler, &writer,
+                       &version, &last_recycle_id) != 0 ||
+        mx_dbfile_write_end(writer.fp, writer.version) != 0)
+    {
+        goto failed;
+    }
+
+    if (writer.version >= MX_DBFILE_V08) {
+        if (fflush(writer.fp) != 0 || fseeko(writer.fp, 0, SEEK_SET) != 0 ||
+            mx_dbfile_write_header(writer.fp, writer.version, last_recycle_id) != 0)
+        {
+            goto failed;
+        }
+    }
+
+    if (fflush(writer.fp) != 0 || fsync(fileno(writer.fp)) != 0) {
+        goto failed;
+    }
+
+    fclose(writer.fp);
+    free(writer.body_ids);
+
+    if (rename(tmpfile, output) == -1) {
+        fprintf(stderr, "[error] can not rename `%s': %s\n", tmpfile, strerror(errno));
+        unlink(tmpfile);
+        return -1;
+    }
+
+    printf("%s (%s) -> %s (%s): %ld jobs written, %ld jobs dropped\n",
+           input, mx_dbfile_version_name(version),
+           output, mx_dbfile_version_name(writer.version),
+           writer.written, writer.dropped);
+
+    if (writer.version == MX_DBFILE_V07 && version != MX_DBFILE_V07) {
+        printf("[notice] touched jobs were written as ready jobs (0.7 format)\n");
+    }
+
+    return 0;
+
+failed:
+    fprintf(stderr, "[error] failed to rewrite `%s'\n", input);
+    fclose(writer.fp);
+    free(writer.body_ids);
+    unlink(tmpfile);
+    return -1;
+}
+
+
+/* bench command, load the file into the same structures as the server */
+
+struct mx_dbtool_loader {
+    HashTable *queues;
+    mx_skiplist_t *delay_queue;
+    mx_skiplist_t *recycle_queue;
+    long jobs;
+    long bytes;
+};
+
+
+static void mx_dbtool_queue_free(void *data)
+{
+    mx_skiplist_destroy(data, free);
+}
+
+
+static int mx_dbtool_load_handler(struct mx_job_header *header,
+    char *name, char *body, void *data)
+{
+    struct mx_dbtool_loader *loader = data;
+    struct mx_dbtool_job *job;
+    mx_skiplist_t *list;
+    int ret;
+
+    if (hash_lookup(loader->queues, name, (void **)&list) == -1) {
+        list = mx_skiplist_create(MX_SKIPLIST_MAX_TYPE);
+        if (!list || hash_insert(loader->queues, name, list) == -1) {
+            return -1;
+        }
+    }
+
+    job = malloc(sizeof(*job) + header->jlen + 2);
+    if (!job) {
+        return -1;
+    }
+
+    job->prival = header->prival;
+    job->timeout = header->timeout;
+    job->length = header->jlen;
+    memcpy(job->body, body, header->jlen);
+
+    if (header->recycle_id > 0) {
+        ret = mx_skiplist_insert(loader->recycle_queue, header->recycle_id, job);
+    } else if (header->timeout > mx_dbtool_now) {
+        ret = mx_skiplist_insert(loader->delay_queue, header->timeout, job);
+    } else {
+        ret = mx_skiplist_insert(list, header->prival, job);
+    }
+
+    if (ret != SKL_STATUS_OK) {
+        free(job);
+        return -1;
+    }
+
+    loader->jobs++;
+    loader->bytes += header->jlen;
+
+    return 0;
+}
+
+
+static int mx_dbtool_bench(char *path)
+{
+    struct mx_dbtool_loader loader;
+    struct timeval begin;
+    int version, last_recycle_id;
+    double elapsed, freed;
+    int ret;
+
+    loader.queues = hash_alloc(32);
+    loader.delay_queue = mx_skiplist_create(MX_SKIPLIST_MIN_TYPE);
+    loader.recycle_queue = mx_skiplist_create(MX_SKIPLIST_MIN_TYPE);
+    loader.jobs = 0;
+    loader.bytes = 0;
+
+    if (!loader.queues || !loader.delay_queue || !loader.recycle_queue) {
+        fprintf(stderr, "[error] not enough memory\n");
+        return -1;
+    }
+
+    gettimeofday(&begin, NULL);
+    ret = mx_dbtool_scan(path, 1, mx_dbtool_load_handler, &loader,
+                         &version, &last_recycle_id);
+    elapsed = mx_dbtool_elapsed(&begin);
+
+    gettimeofday(&begin, NULL);
+    hash_destroy(loader.queues, mx_dbtool_queue_free);
+    mx_skiplist_destroy(loader.delay_queue, free);
+    mx_skiplist_destroy(loader.recycle_queue, free);
+    freed = mx_dbtool_elapsed(&begin);
+
+    if (ret != 0) {
+        return -1;
+    }
+
+    printf("loaded %ld jobs (%ld bytes) in %.3f seconds\n",
+           loader.jobs, loader.bytes, elapsed);
+
+    if (elapsed > 0) {
+        printf("%.0f jobs/sec, %.2f MB/sec\n", loader.jobs / elapsed,
+               loader.bytes / elapsed / (1024 * 1024));
+    }
+
+    printf("free all jobs in %.3f seconds\n", freed);
+
+    return 0;
+}
+
+
+static int mx_dbtool_add_name(HashTable **table, char *name)
+{
+    if (strlen(name) > MX_DBFILE_NAME_MAX) {
+        fprintf(stderr, "[error] queue name `%s' longer than %d bytes\n",
+                name, MX_DBFILE_NAME_MAX);
+        return -1;
+    }
+
+    if (!*table && !(*table = hash_alloc(16))) {
+        return -1;
+    }
+
+    return hash_insert(*table, name, NULL) == -1 ? -1 : 0;
+}
+
+
+static void mx_dbtool_usage(void)
+{
+    printf("\n mx-dbtool usage:\n");
+    printf("    mx-dbtool verify <file>                   check the database file.\n");
+    printf("    mx-dbtool stats <file>                    print jobs and bytes of every queue.\n");
+    printf("    mx-dbtool convert <input> <output>        rewrite the file with other format version.\n");
+    printf("    mx-dbtool compact <input> <output>        drop expired touched jobs and rewrite the file.\n");
+    printf("    mx-dbtool bench <file>                    time loading the file into queues.\n");
+    printf("\n options of convert and compact:\n");
+    printf("    --to <version>                output format version (0.7|0.8|0.9), default 0.9.\n");
+    printf("    --queue <name>                keep the queue only (can be repeated).\n");
+    printf("    --exclude <name>              drop the queue (can be repeated).\n");
+    printf("    --help                        print this help and exit.\n");
+}
+
+
+static const struct option mx_dbtool_options[] = {
+    {"to",      1, NULL, 't'},
+    {"queue",   1, NULL, 'q'},
+    {"exclude", 1, NULL, 'x'},
+    {"help",    0, NULL, 'h'},
+    {NULL,      0, NULL, 0  }
+};
+
+
+int main(int argc, char *argv[])
+{
+    char *command;
+    int c, ret;
+
+    while ((c = getopt_long(argc, argv, "", mx_dbtool_options, NULL)) != -1) {
+        switch (c) {
+        case 't':
+            if (strcmp(optarg, "0.7") == 0) {
+                mx_dbtool_version = MX_DBFILE_V07;
+            } else if (strcmp(optarg, "0.8") == 0) {
+                mx_dbtool_version = MX_DBFILE_V08;
+            } else if (strcmp(optarg, "0.9") == 0) {
+                mx_dbtool_version = MX_DBFILE_V09;
+            } else {
+                fprintf(stderr, "[error] unknown format version `%s'.\n", optarg);
+                exit(-1);
+            }
+            break;
+        case 'q':
+            if (mx_dbtool_add_name(&mx_dbtool_include, optarg) != 0) {
+                exit(-1);
+            }
+            break;
+        case 'x':
+            if (mx_dbtool_add_name(&mx_dbtool_exclude, optarg) != 0) {
+                exit(-1);
+            }
+            break;
+        case 'h':
+            mx_dbtool_usage();
+            exit(0);
+        default:
+            exit(-1);
+        }
+    }
+
+    if (argc - optind < 2) {
+        mx_dbtool_usage();
+        exit(-1);
+    }
+
+    mx_dbtool_now = time(NULL);
+    command = argv[optind];
+
+    if (strcmp(command, "verify") == 0) {
+        ret = mx_dbtool_verify(argv[optind + 1]);
+
+    } else if (strcmp(command, "stats") == 0) {
+        ret = mx_dbtool_stats(argv[optind + 1]);
+
+    } else if (strcmp(command, "bench") == 0) {
+        ret = mx_dbtool_bench(argv[optind + 1]);
+
+    } else if ((strcmp(command, "convert") == 0 || strcmp(command, "compact") == 0) &&
+               argc - optind >= 3)
+    {
+        ret = mx_dbtool_rewrite(argv[optind + 1], argv[optind + 2],
+                                strcmp(command, "compact") == 0);
+
+    } else {
+        mx_dbtool_usage();
+        exit(-1);
+    }
+
+    return ret == 0 ? 0 : 1;
+}
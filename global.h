@@ -1,6 +1,8 @@
 #ifndef __MX_GLOBAL_H
 #define __MX_GLOBAL_H
 
+#include <sys/uio.h>
+
 #include "ae.h"
 #include "list.h"
 #include "skiplist.h"
@@ -20,8 +22,25 @@
 #define MX_RECVBUF_SIZE  2048
 #define MX_SENDBUF_SIZE  2048
 #define MX_MAX_TOKENS    100
+#define MX_MAX_BATCH_JOBS  1000  /* jobs of mdequeue/mtouch */
+#define MX_JOB_HEADER_SIZE 32
 #define MX_FREE_CONNECTIONS_MAX_SIZE  1000
 #define MX_RECYCLE_TIMEOUT  60
+#define MX_SHUTDOWN_TIMEOUT  5  /* seconds to drain connections */
+#define MX_DEFAULT_LUA_WORKERS  4
+#define MX_DEFAULT_LUA_TIMEOUT  5000  /* ms of a lua call */
+#define MX_DEFAULT_SLOWLOG_THRESHOLD  10000  /* microseconds */
+#define MX_DEFAULT_SLOWLOG_SIZE       128
+#define MX_SLOWLOG_NAME_SIZE          64    /* queue name kept in entry */
+#define MX_QUEUE_NAME_MAX  127  /* MX_DBFILE_NAME_MAX of database file */
+
+#define MX_BINARY_REQUEST_MAGIC  0x80
+#define MX_BINARY_REPLY_MAGIC    0x81
+#define MX_BINARY_HEADER_SIZE    12
+#define MX_BINARY_INTEGER        0x80000000U  /* argument is an integer */
+
+#define MX_DEFAULT_SPILL_THRESHOLD  64    /* MB */
+#define MX_DEFAULT_ARENA_SIZE       1024  /* MB */
 
 #define MX_DEFAULT_BGSAVE_PATH  "mx-queued.db"
 #define MX_DEFAULT_LOG_PATH     "mx-queued.log"
@@ -34,7 +53,11 @@ typedef enum mx_event_state_e mx_event_state_t;
 typedef struct mx_token_s mx_token_t;
 typedef struct mx_queue_s mx_queue_t;
 typedef struct mx_job_s mx_job_t;
+typedef struct mx_body_s mx_body_t;
 typedef struct mx_command_s mx_command_t;
+typedef struct mx_spill_s mx_spill_t;
+typedef struct mx_waiter_s mx_waiter_t;
+typedef struct mx_lua_task_s mx_lua_task_t;
 
 typedef void (*mx_event_handler_t)(mx_connection_t *c);
 typedef void (*mx_command_handler_t)(mx_connection_t *c, mx_token_t *tokens);
@@ -67,15 +90,74 @@ typedef enum {
 } mx_reply_type;
 
 
+/* result of exec */
+typedef enum {
+    mx_lua_failed,
+    mx_lua_done,
+    mx_lua_exceeded,  /* aborted by instruction or time budget */
+    mx_lua_number,    /* text is the number */
+    mx_lua_string,
+    mx_lua_array      /* jobs hold the elements */
+} mx_lua_status;
+
+typedef struct {
+    mx_lua_status status;
+    char *text;
+    int length;
+    mx_job_t **jobs;
+    int count;
+} mx_lua_result_t;
+
+
+/* command's opcodes, the indexes of mx_commands */
+typedef enum {
+    mx_op_ping,
+    mx_op_auth,
+    mx_op_enqueue,
+    mx_op_menqueue,
+    mx_op_dequeue,
+    mx_op_touch,
+    mx_op_mdequeue,
+    mx_op_mtouch,
+    mx_op_bdequeue,
+    mx_op_btouch,
+    mx_op_dequeue_any,
+    mx_op_touch_any,
+    mx_op_recycle,
+    mx_op_remove,
+    mx_op_size,
+    mx_op_exec,
+    mx_op_ack,
+    mx_op_nack,
+    mx_op_extend,
+    mx_op_move,
+    mx_op_fanout,
+    mx_op_subscribe,
+    mx_op_unsubscribe,
+    mx_op_credit,
+    mx_op_async,
+    mx_op_script,
+    mx_op_result,
+    mx_op_slowlog,
+    mx_op_info,
+    mx_op_count
+} mx_opcode;
+
+
+typedef enum {
+    mx_binary_string,
+    mx_binary_job,
+    mx_binary_jobs
+} mx_binary_type;
+
+
 struct mx_global_s {
     int sock;
     int daemon_mode;
     short port;
     struct aeEventLoop *event;
-    HashTable *cmd_table;         /* command's table */
     HashTable *queue_table;       /* queue's table */
     mx_skiplist_t *delay_queue;   /* delay queue */
-    mx_skiplist_t *recycle_queue; /* recycle queue */
 
     /* background save fields */
     int bgsave_enable;
@@ -84,12 +166,35 @@ struct mx_global_s {
     char *bgsave_filepath;
     pid_t bgsave_pid;
     time_t last_bgsave_time;
+    long long bgsave_start;         /* microseconds, of the save running */
+    long long last_bgsave_duration; /* microseconds */
+    int last_bgsave_status;         /* 0 is success, -1 is failed */
     int dirty;
     int outof_memory;
 
     int last_recycle_id;
     int recycle_timeout;
 
+    /* spill-over storage */
+    int spill_enable;
+    char *spill_path;
+    long spill_threshold;
+
+    /* persistent job arena */
+    int arena_enable;
+    char *arena_path;
+    long arena_size;
+    int arena_attached;  /* arena was used before */
+
+    /* graceful shutdown */
+    int shutdown;
+    time_t shutdown_deadline;
+
+    /* client connections */
+    struct list_head connections;
+    int clients;
+    struct list_head blocked;  /* connections waiting for jobs */
+
     /* authentication */
     HashTable *auth_table;
     int auth_enable;
@@ -98,9 +203,21 @@ struct mx_global_s {
     /* lua support */
     int lua_enable;
     char *lualib_file;
-    lua_State *lvm;
-    pthread_mutex_t lvm_lock;
-    int lvm_pipe[2];
+    int lua_workers;   /* threads running Lua calls */
+    int lua_max_steps; /* instructions of a call, zero means no limit */
+    int lua_timeout;   /* ms of a call, zero means no limit */
+    char *lua_enqueue_hook; /* function called before insertion */
+    int lvm_pipe[2];   /* wake up event loop for workers */
+
+    /* slow log */
+    int slowlog_threshold;  /* microseconds, negative disables */
+    int slowlog_size;       /* entries kept */
+
+    /* statistics of info command */
+    time_t start_time;
+    long long stat_commands[mx_op_count];  /* calls of each command */
+    long long stat_bytes_in;
+    long long stat_bytes_out;
 
     FILE *log;
     char *log_path;
@@ -108,6 +225,12 @@ struct mx_global_s {
 };
 
 
+struct mx_waiter_s {
+    struct list_head link;  /* in queue's waiters */
+    mx_connection_t *conn;
+};
+
+
 struct mx_connection_s {
     int sock;
     mx_event_state_t state;
@@ -127,17 +250,71 @@ struct mx_connection_s {
     mx_event_handler_t revent_handler;
     mx_event_handler_t wevent_handler;
     int recycle_id;
+    int batch_remain;  /* jobs haven't been read of menqueue */
+    int batch_ok;      /* jobs enqueued of menqueue */
+    mx_job_t **jobs;   /* jobs of mdequeue/mtouch being sent */
+    int jobs_count;
+    int jobs_size;
+    int jobs_touch;
+    int jobs_lease;
+    int jobs_recycle_id;  /* recycle id of the first job */
+    struct iovec *iov;
+    char *iov_hdr;        /* job headers */
+    int iov_pos;
+    int iov_count;
+    mx_waiter_t *waiters; /* blocking dequeue */
+    int waiters_count;
+    int waiters_size;
+    time_t block_deadline;  /* zero means forever */
+    struct list_head block_link;
+    unsigned int blocked:1;
+    unsigned int block_touch:1;
+    unsigned int send_name:1;  /* reply with queue name */
+    unsigned int moving:1;     /* job goes to its queue after sent */
+    unsigned int bulk:1;       /* job is the text of bulk reply */
+    unsigned int fanout:1;     /* enqueue job to fanout_queues too */
+    unsigned int binary:1;     /* speak binary protocol */
+    unsigned int request_id;   /* of the binary request being processed */
+    mx_queue_t *fanout_queues[MX_MAX_TOKENS];  /* other queues of fanout */
+    int fanout_count;
+    char *subscribe_name;      /* queue subscribed, NULL if haven't */
+    int subscribe_len;
+    unsigned int subscribe_id; /* request id of subscribe command */
+    mx_waiter_t subscribe_waiter;  /* parked while idle */
+    int credits;               /* jobs can be pushed */
+    int prefetch;
+    unsigned int subscribe_touch:1;
+    unsigned int subscribe_parked:1;
+    unsigned int push:1;       /* job being sent was pushed */
+    mx_lua_task_t *lua_task;   /* exec call waiting for result */
+    char *script;              /* chunk of script load being read */
+    int script_len;
+    char *any_key;             /* queues of last dequeue_any */
+    int *any_current;          /* round-robin current weights */
+    long long slow_start;      /* command being timed, zero if none */
+    long long slow_mark;       /* last execution step ended */
+    long long slow_parse;
+    long long slow_exec;
+    int slow_opcode;
+    int slow_bytes;            /* job bytes received or sent */
+    char slow_queue[MX_SLOWLOG_NAME_SIZE];
+    unsigned int slow_running:1;  /* inside an execution step */
     unsigned int revent_set:1;
     unsigned int wevent_set:1;
     unsigned int recycle:1;
     unsigned int reliable:1;
     unsigned int flags:4;
     mx_connection_t *next;
+    struct list_head link;  /* in connections list */
 };
 
 
 struct mx_queue_s {
     mx_skiplist_t *list;
+    long bytes;         /* job bytes in memory */
+    mx_spill_t *spill;  /* spilled jobs, NULL if haven't */
+    void *arena;        /* queue record in arena */
+    struct list_head waiters;  /* blocked connections */
     int name_len;
     char name[0];
 };
@@ -148,13 +325,40 @@ struct mx_job_s {
     int timeout;
     mx_queue_t *belong;
     int length;
-    char body[0];
+    mx_body_t *shared;  /* NULL if the body is data */
+    char *body;
+    char data[0];
+};
+
+#ifdef MX_LUAJIT
+/* mx_job_t for LuaJIT FFI, keep it the same as struct mx_job_s */
+#define MX_LUA_JOB_CDEF                  \
+    "typedef struct mx_job_s {\n"        \
+    "    const int prival;\n"            \
+    "    const int timeout;\n"           \
+    "    const void *belong;\n"          \
+    "    const int length;\n"            \
+    "    const void *shared;\n"          \
+    "    const uint8_t *body;\n"         \
+    "} mx_job_t;\n"
+#endif
+
+
+/* job body shared by the jobs of fanout */
+struct mx_body_s {
+    int refcount;
+    int length;
+    int save_gen;  /* snapshot that wrote the body */
+    int save_id;
+    char data[0];
 };
 
 
 struct mx_token_s {
     char  *value;
     size_t length;
+    int integer;  /* binary integer argument */
+    unsigned int is_integer:1;
 };
 
 
@@ -169,12 +373,86 @@ extern mx_global_t *mx_global;
 extern time_t mx_current_time;
 
 void mx_write_log(mx_log_level level, const char *fmt, ...);
+int mx_log_init();
+void mx_log_close();
+void mx_log_stats(long *lines, long *dropped);
+void mx_send_bulk_reply(mx_connection_t *c, char *data, int length);
 mx_job_t *mx_job_create(mx_queue_t *belong, int prival, int delay, int length);
 void mx_job_free(void *job);
+mx_body_t *mx_body_create(int length);
+void mx_body_release(mx_body_t *body);
+mx_job_t *mx_job_create_shared(mx_queue_t *belong, int prival, int delay,
+    mx_body_t *body);
 mx_queue_t *mx_queue_create(char *name, int name_len);
+void mx_queue_free(void *arg);
+mx_queue_t *mx_queue_get(char *name, int name_len);
+int mx_queue_insert(mx_queue_t *queue, mx_job_t *job);
+mx_job_t *mx_queue_top(mx_queue_t *queue);
+mx_job_t *mx_queue_pop(mx_queue_t *queue);
+mx_job_t *mx_queue_take(mx_queue_t *queue, int min, int max);
+int mx_queue_size(mx_queue_t *queue);
 int mx_try_bgsave_queues();
+void mx_bgsave_cancel();
+int mx_save_queues();
 int mx_load_queues();
 int mx_lua_init(char *lua_file);
 void mx_lua_close();
+int mx_lua_submit(mx_connection_t *c, mx_token_t *tokens, int params, int async);
+void mx_lua_cancel(mx_connection_t *c);
+int mx_lua_busy();
+int mx_lua_script_load(char *source, int length, char *sha);
+void mx_lua_script_flush();
+int mx_lua_script_reload();
+char *mx_lua_stats(int *length);
+void mx_lua_stats_reset();
+int mx_lua_hook_set(char *name);
+int mx_lua_enqueue_hook(mx_job_t *job);
+void mx_exec_done(mx_connection_t *c, mx_lua_result_t *result);
+void mx_send_lua_result(mx_connection_t *c, mx_lua_result_t *result);
+int mx_lua_fetch(int handle, mx_lua_result_t *result);
+void mx_lua_expire(time_t now);
+int mx_spill_init();
+int mx_spill_need(mx_queue_t *queue, mx_job_t *job);
+int mx_spill_push(mx_queue_t *queue, mx_job_t *job);
+int mx_spill_load(mx_queue_t *queue);
+int mx_spill_foreach(mx_queue_t *queue, int (*handler)(mx_job_t *job));
+int mx_spill_jobs(mx_queue_t *queue);
+long mx_spill_bytes(mx_queue_t *queue);
+void mx_spill_free(mx_spill_t *spill);
+void mx_spill_release_deferred();
+int mx_arena_init();
+void mx_arena_close();
+void mx_arena_sync();
+int mx_arena_owned(void *ptr);
+void mx_arena_free(void *ptr);
+void mx_arena_release_deferred();
+mx_job_t *mx_arena_job_alloc(mx_queue_t *belong, int length);
+void mx_arena_job_commit(mx_job_t *job);
+void mx_arena_job_recycle(mx_job_t *job, int recycle_id);
+void mx_arena_job_move(mx_job_t *job, mx_queue_t *queue);
+void *mx_arena_queue_alloc(char *name, int name_len);
+int mx_inflight_init();
+int mx_inflight_add(int id, mx_job_t *job);
+mx_job_t *mx_inflight_remove(int id);
+int mx_inflight_extend(int id, time_t deadline);
+void mx_inflight_expire(time_t now);
+int mx_inflight_foreach(int (*handler)(int id, mx_job_t *job));
+int mx_inflight_jobs();
+void mx_inflight_destroy(void (*free_job)(void *job));
+int mx_slowlog_init(int size);
+void mx_slowlog_add(const char *command, const char *queue, int bytes,
+    long long parse_us, long long exec_us, long long send_us);
+char *mx_slowlog_get(int count, int *length);
+int mx_slowlog_len();
+void mx_slowlog_reset();
+void mx_slowlog_destroy();
+int mx_command_opcode(char *name, int length);
+int mx_tokenize_command(char **pos, char *end, mx_token_t *tokens, int max);
+int mx_binary_parse(mx_connection_t *c, mx_token_t *tokens, int first,
+    int *opcode, unsigned int *request_id);
+char *mx_binary_header(char *buf, int status, mx_binary_type type,
+    unsigned int request_id, int length);
+char *mx_binary_put32(char *buf, unsigned int value);
+int mx_token_int(mx_token_t *token, int *retval);
 
 #endif
@@ -0,0 +1,318 @@
+/*
+ * Copyright (c) 2012 - 2013, YukChung Lee <liexusong@qq.com>
+ * All rights reserved.
+ *  __   __  __   __         _______  __   __  _______  __   __  _______  ______
+ * |  |_|  ||  |_|  |       |       ||  | |  ||       ||  | |  ||       ||      |
+ * |       ||       | ____  |   _   ||  | |  ||    ___||  | |  ||    ___||  _    |
+ * |       ||       ||____| |  | |  ||  |_|  ||   |___ |  |_|  ||   |___ | | |   |
+ * |       | |     |        |  |_|  ||       ||    ___||       ||    ___|| |_|   |
+ * | ||_|| ||   _   |       |      | |       ||   |___ |       ||   |___ |       |
+ * |_|   |_||__| |__|       |____||_||_______||_______||_______||_______||______|
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/*
+ * In-flight (touched) jobs.
+ *
+ * The jobs are indexed by recycle id in a hash table, so recycle/ack/nack/
+ * extend are O(1), and their lease deadlines are kept in a timing wheel of
+ * one second slots, so the core timer only visits the slots of passed
+ * seconds. Deadlines farther than the wheel stay in their slot until they
+ * come round.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include "global.h"
+
+#define MX_INFLIGHT_INIT_SIZE  1024  /* must be power of 2 */
+#define MX_WHEEL_SLOTS         4096  /* seconds, must be power of 2 */
+
+typedef struct mx_inflight_s mx_inflight_t;
+
+struct mx_inflight_s {
+    int id;
+    mx_job_t *job;
+    mx_inflight_t *next;    /* in hash bucket */
+    struct list_head link;  /* in wheel slot */
+};
+
+static mx_inflight_t **mx_inflight_buckets;
+static unsigned int mx_inflight_size;
+static int mx_inflight_count;
+
+static struct list_head mx_wheel[MX_WHEEL_SLOTS];
+static time_t mx_wheel_time;  /* the slots before this second were expired */
+
+
+int mx_inflight_init()
+{
+    int i;
+
+    mx_inflight_buckets = calloc(MX_INFLIGHT_INIT_SIZE, sizeof(mx_inflight_t *));
+    if (!mx_inflight_buckets) {
+        return -1;
+    }
+
+    mx_inflight_size = MX_INFLIGHT_INIT_SIZE;
+    mx_inflight_count = 0;
+
+    for (i = 0; i < MX_WHEEL_SLOTS; i++) {
+        INIT_LIST_HEAD(&mx_wheel[i]);
+    }
+
+    mx_wheel_time = 0;
+
+    return 0;
+}
+
+
+static int mx_inflight_resize()
+{
+    mx_inflight_t **buckets, *entry, *next;
+    unsigned int size = mx_inflight_size * 2, i, index;
+
+    buckets = calloc(size, sizeof(mx_inflight_t *));
+    if (!buckets) {
+        return -1;
+    }
+
+    for (i = 0; i < mx_inflight_size; i++) {
+        for (entry = mx_inflight_buckets[i]; entry; entry = next) {
+            next = entry->next;
+            index = (unsigned int)entry->id & (size - 1);
+            entry->next = buckets[index];
+            buckets[index] = entry;
+        }
+    }
+
+    free(mx_inflight_buckets);
+
+    mx_inflight_buckets = buckets;
+    mx_inflight_size = size;
+
+    return 0;
+}
+
+
+static void mx_wheel_link(mx_inflight_t *entry)
+{
+    time_t deadline = entry->job->timeout;
+
+    /* passed slots would not be visited again */
+    if (deadline < mx_wheel_time) {
+        deadline = mx_wheel_time;
+    }
+
+    list_add_tail(&entry->link, &mx_wheel[deadline & (MX_WHEEL_SLOTS - 1)]);
+}
+
+
+static mx_inflight_t **mx_inflight_find(int id)
+{
+    mx_inflight_t **entry;
+
+    entry = &mx_inflight_buckets[(unsigned int)id & (mx_inflight_size - 1)];
+
+    while (*entry && (*entry)->id != id) {
+        entry = &(*entry)->next;
+    }
+
+    return entry;
+}
+
+
+/*
+ * Unlink an entry from its bucket and the wheel, the entry is freed
+ */
+static void mx_inflight_unlink(mx_inflight_t *entry)
+{
+    mx_inflight_t **slot;
+
+    slot = &mx_inflight_buckets[(unsigned int)entry->id & (mx_inflight_size - 1)];
+
+    while (*slot && *slot != entry) {
+        slot = &(*slot)->next;
+    }
+
+    if (*slot) {
+        *slot = entry->next;
+    }
+
+    list_del(&entry->link);
+    free(entry);
+
+    mx_inflight_count--;
+}
+
+
+/*
+ * Track a touched job, job->timeout is its lease deadline.
+ * Return -1 if out of memory or the id is tracked already
+ */
+int mx_inflight_add(int id, mx_job_t *job)
+{
+    mx_inflight_t *entry;
+    unsigned int index;
+
+    if (*mx_inflight_find(id)) {
+        mx_write_log(mx_log_error, "recycle id %d is in use", id);
+        return -1;
+    }
+
+    if ((unsigned int)mx_inflight_count >= mx_inflight_size * 2) {
+        (void)mx_inflight_resize(); /* longer chains if failed */
+    }
+
+    entry = malloc(sizeof(*entry));
+    if (!entry) {
+        return -1;
+    }
+
+    entry->id = id;
+    entry->job = job;
+
+    index = (unsigned int)id & (mx_inflight_size - 1);
+    entry->next = mx_inflight_buckets[index];
+    mx_inflight_buckets[index] = entry;
+
+    mx_wheel_link(entry);
+
+    mx_inflight_count++;
+
+    return 0;
+}
+
+
+/*
+ * Stop tracking a job, return NULL if not found
+ */
+mx_job_t *mx_inflight_remove(int id)
+{
+    mx_inflight_t *entry;
+    mx_job_t *job;
+
+    entry = *mx_inflight_find(id);
+    if (!entry) {
+        return NULL;
+    }
+
+    job = entry->job;
+    mx_inflight_unlink(entry);
+
+    return job;
+}
+
+
+/*
+ * Set the lease deadline of a job, return -1 if not found
+ */
+int mx_inflight_extend(int id, time_t deadline)
+{
+    mx_inflight_t *entry;
+
+    entry = *mx_inflight_find(id);
+    if (!entry) {
+        return -1;
+    }
+
+    entry->job->timeout = deadline;
+
+    list_del(&entry->link);
+    mx_wheel_link(entry);
+
+    return 0;
+}
+
+
+/*
+ * Free the jobs whose lease deadline has passed
+ */
+void mx_inflight_expire(time_t now)
+{
+    struct list_head *pos, *next;
+    mx_inflight_t *entry;
+    time_t t;
+
+    t = mx_wheel_time;
+    if (now - t >= MX_WHEEL_SLOTS) {
+        t = now - MX_WHEEL_SLOTS + 1;
+    }
+
+    for (; t <= now; t++) {
+        list_for_each_safe(pos, next, &mx_wheel[t & (MX_WHEEL_SLOTS - 1)]) {
+            entry = list_entry(pos, mx_inflight_t, link);
+
+            if (entry->job->timeout <= now) {
+                mx_job_free(entry->job);
+                mx_inflight_unlink(entry);
+            }
+        }
+    }
+
+    mx_wheel_time = now + 1;
+}
+
+
+int mx_inflight_foreach(int (*handler)(int id, mx_job_t *job))
+{
+    mx_inflight_t *entry;
+    unsigned int i;
+
+    for (i = 0; i < mx_inflight_size; i++) {
+        for (entry = mx_inflight_buckets[i]; entry; entry = entry->next) {
+            if (handler(entry->id, entry->job) != 0) {
+                return -1;
+            }
+        }
+    }
+
+    return 0;
+}
+
+
+int mx_inflight_jobs()
+{
+    return mx_inflight_count;
+}
+
+
+void mx_inflight_destroy(void (*free_job)(void *job))
+{
+    mx_inflight_t *entry, *next;
+    unsigned int i;
+
+    if (!mx_inflight_buckets) {
+        return;
+    }
+
+    for (i = 0; i < mx_inflight_size; i++) {
+        for (entry = mx_inflight_buckets[i]; entry; entry = next) {
+            next = entry->next;
+            if (free_job) {
+                free_job(entry->job);
+            }
+            free(entry);
+        }
+    }
+
+    free(mx_inflight_buckets);
+
+    mx_inflight_buckets = NULL;
+    mx_inflight_count = 0;
+}
@@ -0,0 +1,339 @@
+/*
+ * Copyright (c) 2012 - 2013, YukChung Lee <liexusong@qq.com>
+ * All rights reserved.
+ *  __   __  __   __         _______  __   __  _______  __   __  _______  ______
+ * |  |_|  ||  |_|  |       |       ||  | |  ||       ||  | |  ||       ||      |
+ * |       ||       | ____  |   _   ||  | |  ||    ___||  | |  ||    ___||  _    |
+ * |       ||       ||____| |  | |  ||  |_|  ||   |___ |  |_|  ||   |___ | | |   |
+ * |       | |     |        |  |_|  ||       ||    ___||       ||    ___|| |_|   |
+ * | ||_|| ||   _   |       |      | |       ||   |___ |       ||   |___ |       |
+ * |_|   |_||__| |__|       |____||_||_______||_______||_______||_______||______|
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/*
+ * Asynchronous logging.
+ *
+ * Every thread formats its lines into the slots of a bounded ring (one
+ * sequence number per slot, so producers only race for the head index),
+ * and a writer thread drains the ring, prefixes the timestamps (formatted
+ * once per second) and writes them out with one write(2) per batch.
+ * When the ring is full the line is dropped and counted, the writer
+ * reports the count in a summary line. Before the writer starts, after it
+ * stops and in forked children the lines are written synchronously.
+ */
+
+#include <sys/types.h>
+#include <unistd.h>
+#include <errno.h>
+#include <time.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <stdarg.h>
+#include <pthread.h>
+
+#include "global.h"
+
+#define MX_LOG_RING_SIZE    4096  /* must be power of 2 */
+#define MX_LOG_LINE_SIZE    512   /* longer lines are truncated */
+#define MX_LOG_BUFFER_SIZE  65536
+#define MX_LOG_IDLE_WAIT    10000 /* microseconds */
+
+typedef struct {
+    volatile unsigned long seq;
+    time_t time;
+    int level;
+    int length;
+    char text[MX_LOG_LINE_SIZE];
+} mx_log_slot_t;
+
+static mx_log_slot_t *mx_log_ring = NULL;
+static volatile unsigned long mx_log_head = 0;
+static unsigned long mx_log_tail = 0;  /* writer thread only */
+static volatile int mx_log_ready = 0;
+static volatile int mx_log_stopping = 0;
+static pthread_t mx_log_tid;
+
+static volatile long mx_log_lines = 0;
+static volatile long mx_log_dropped = 0;
+static long mx_log_reported = 0;       /* writer thread only */
+
+static char *mx_log_levels = "-*+";
+
+
+static FILE *mx_log_output()
+{
+    if (mx_global->daemon_mode) {
+        return mx_global->log;
+    }
+    return stdout; /* interactive model */
+}
+
+
+static void mx_log_write_sync(mx_log_level level, const char *fmt, va_list ap)
+{
+    FILE *fp = mx_log_output();
+    char buf[64];
+    struct tm tm;
+    time_t now;
+
+    if (!fp) {
+        return;
+    }
+
+    now = time(NULL);
+    strftime(buf, 64, "[%d %b %H:%M:%S]", gmtime_r(&now, &tm));
+    fprintf(fp, "%s %c ", buf, mx_log_levels[level]);
+    vfprintf(fp, fmt, ap);
+    fprintf(fp, "\n");
+    fflush(fp);
+
+    __sync_fetch_and_add(&mx_log_lines, 1);
+}
+
+
+void mx_write_log(mx_log_level level, const char *fmt, ...)
+{
+    va_list ap;
+    mx_log_slot_t *slot;
+    unsigned long pos, seq;
+    int length;
+
+    if ((int)level > mx_global->log_level) {
+        return;
+    }
+
+    va_start(ap, fmt);
+
+    if (!mx_log_ready) {
+        mx_log_write_sync(level, fmt, ap);
+        va_end(ap);
+        return;
+    }
+
+    /* claim a free slot, give up when the writer is a whole ring behind */
+    pos = mx_log_head;
+    for (;;) {
+        slot = &mx_log_ring[pos & (MX_LOG_RING_SIZE - 1)];
+        seq = slot->seq;
+        __sync_synchronize();
+
+        if (seq == pos) {
+            if (__sync_bool_compare_and_swap(&mx_log_head, pos, pos + 1)) {
+                break;
+            }
+            pos = mx_log_head;
+
+        } else if ((long)(seq - pos) < 0) {
+            __sync_fetch_and_add(&mx_log_dropped, 1);
+            va_end(ap);
+            return;
+
+        } else {
+            pos = mx_log_head;
+        }
+    }
+
+    length = vsnprintf(slot->text, MX_LOG_LINE_SIZE, fmt, ap);
+    if (length < 0) {
+        length = 0;
+    } else if (length >= MX_LOG_LINE_SIZE) {
+        length = MX_LOG_LINE_SIZE - 1;
+    }
+
+    slot->length = length;
+    slot->level = level;
+    slot->time = mx_current_time ? mx_current_time : time(NULL);
+
+    __sync_synchronize();
+    slot->seq = pos + 1; /* publish to the writer */
+
+    va_end(ap);
+}
+
+
+static void mx_log_flush(char *buf, int size)
+{
+    FILE *fp = mx_log_output();
+    int fd, n;
+
+    if (!fp) {
+        return;
+    }
+
+    fd = fileno(fp);
+
+    while (size > 0) {
+        n = write(fd, buf, size);
+        if (n == -1) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return;
+        }
+        buf += n;
+        size -= n;
+    }
+}
+
+
+static void *mx_log_writer_main(void *arg)
+{
+    static char buf[MX_LOG_BUFFER_SIZE];
+    char stamp[64];
+    time_t last = 0;
+    mx_log_slot_t *slot;
+    long dropped;
+    int size, count;
+    struct tm tm;
+
+    (void)arg;
+
+    stamp[0] = '\0';
+
+    for (;;) {
+        size = 0;
+        count = 0;
+
+        for (;;) {
+            slot = &mx_log_ring[mx_log_tail & (MX_LOG_RING_SIZE - 1)];
+            if (slot->seq != mx_log_tail + 1) { /* empty */
+                break;
+            }
+            __sync_synchronize();
+
+            if (slot->time != last) {
+                last = slot->time;
+                strftime(stamp, 64, "[%d %b %H:%M:%S]", gmtime_r(&last, &tm));
+            }
+
+            if (size + slot->length + 80 > MX_LOG_BUFFER_SIZE) {
+                mx_log_flush(buf, size);
+                size = 0;
+            }
+
+            size += sprintf(buf + size, "%s %c ",
+                            stamp, mx_log_levels[slot->level]);
+            memcpy(buf + size, slot->text, slot->length);
+            size += slot->length;
+            buf[size++] = '\n';
+
+            __sync_synchronize();
+            slot->seq = mx_log_tail + MX_LOG_RING_SIZE; /* free the slot */
+            mx_log_tail++;
+            count++;
+        }
+
+        dropped = mx_log_dropped;
+        if (dropped != mx_log_reported) {
+            if (stamp[0] == '\0') {
+                last = time(NULL);
+                strftime(stamp, 64, "[%d %b %H:%M:%S]", gmtime_r(&last, &tm));
+            }
+            if (size + 128 > MX_LOG_BUFFER_SIZE) {
+                mx_log_flush(buf, size);
+                size = 0;
+            }
+            size += sprintf(buf + size, "%s %c %ld log lines dropped\n",
+                            stamp, mx_log_levels[mx_log_error],
+                            dropped - mx_log_reported);
+            mx_log_reported = dropped;
+        }
+
+        if (size > 0) {
+            mx_log_flush(buf, size);
+        }
+
+        if (count > 0) {
+            __sync_fetch_and_add(&mx_log_lines, count);
+            continue;
+        }
+
+        if (mx_log_stopping) {
+            break;
+        }
+
+        usleep(MX_LOG_IDLE_WAIT);
+    }
+
+    return NULL;
+}
+
+
+static void mx_log_atfork_child()
+{
+    mx_log_ready = 0; /* the writer thread isn't copied */
+}
+
+
+int mx_log_init()
+{
+    unsigned long i;
+
+    mx_log_ring = malloc(sizeof(mx_log_slot_t) * MX_LOG_RING_SIZE);
+    if (!mx_log_ring) {
+        mx_write_log(mx_log_error, "not enough memory to create log ring");
+        return -1;
+    }
+
+    for (i = 0; i < MX_LOG_RING_SIZE; i++) {
+        mx_log_ring[i].seq = i;
+    }
+
+    mx_log_head = 0;
+    mx_log_tail = 0;
+    mx_log_stopping = 0;
+
+    if (pthread_create(&mx_log_tid, NULL, mx_log_writer_main, NULL) != 0) {
+        mx_write_log(mx_log_error, "failed to create log writer thread");
+        free(mx_log_ring);
+        mx_log_ring = NULL;
+        return -1;
+    }
+
+    pthread_atfork(NULL, NULL, mx_log_atfork_child);
+
+    __sync_synchronize();
+    mx_log_ready = 1;
+
+    return 0;
+}
+
+
+void mx_log_close()
+{
+    if (!mx_log_ready) {
+        return;
+    }
+
+    /* the writer drains the ring before exiting */
+    mx_log_stopping = 1;
+    pthread_join(mx_log_tid, NULL);
+
+    mx_log_ready = 0;
+
+    free(mx_log_ring);
+    mx_log_ring = NULL;
+}
+
+
+void mx_log_stats(long *lines, long *dropped)
+{
+    *lines = mx_log_lines;
+    *dropped = mx_log_dropped;
+}
@@ -25,188 +25,2147 @@
  * POSSIBILITY OF SUCH DAMAGE.
  */
 
+/*
+ * Lua scripts run on a pool of worker threads, every worker has its
+ * own Lua state loaded with the lualib file. Scripts never touch the
+ * queues themselves: mx_enqueue/mx_dequeue/mx_queue_size post a
+ * message to a lock-free list and wait, the event loop drains the
+ * list, does the operation and wakes the worker up. Finished exec
+ * and async calls are handed back to the event loop the same way.
+ *
+ * Chunks of `script load' are compiled once by every worker and kept
+ * as registry references, exec by the SHA1 digest calls the reference
+ * without looking up globals or compiling again.
+ *
+ * A call is aborted by a count hook when it runs more instructions
+ * than --lua-max-steps or longer than --lua-timeout. Every finished
+ * call is counted by the event loop for `script stats'.
+ *
+ * A call can return true/false, a number, a string or an array of
+ * strings and job views, the jobs of views are replied without copy.
+ * Results of async calls are kept by handle until fetched or expired.
+ *
+ * Built with LuaJIT (make luajit), job:ffi() of a view returns a
+ * const mx_job_t pointer, its fields and body bytes are read by FFI
+ * without calling into C.
+ * Count hooks don't run in code compiled by LuaJIT, the budgets only
+ * bound the interpreted parts then.
+ *
+ * The enqueue hook runs on the event loop in a Lua state of its own,
+ * under the same budgets, before a new job was inserted. It can only
+ * read queue sizes, the worker functions would wait for the loop.
+ */
+
 #include <stdlib.h>
+#include <stddef.h>
 #include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <time.h>
+#include <errno.h>
+#include <pthread.h>
 #include "global.h"
+#include "sha1.h"
+
+#define MX_LUA_CLOSE_TIMEOUT  5  /* seconds to wait for workers */
+#define MX_LUA_HOOK_STEP   1000   /* instructions between budget checks */
+#define MX_LUA_STATS_MAX   1024   /* functions kept in stats */
+#define MX_LUA_HISTOGRAM_SIZE  6
+#define MX_LUA_RESULT_TIMEOUT  60  /* seconds async results kept */
+
+typedef struct mx_lua_worker_s mx_lua_worker_t;
+typedef struct mx_lua_msg_s mx_lua_msg_t;
+typedef struct mx_lua_script_s mx_lua_script_t;
+typedef struct mx_lua_view_s mx_lua_view_t;
+
+struct mx_lua_worker_s {
+    pthread_t tid;
+    lua_State *lvm;
+    pthread_mutex_t lock;
+    pthread_cond_t cond;  /* signaled when a message was handled */
+    int started;
+    int *refs;            /* registry references of the scripts */
+    int refs_count;
+    int refs_size;
+    int scripts_gen;
+    int lib_gen;
+    mx_job_t **garbage;   /* jobs of dropped views */
+    int garbage_count;
+    int garbage_size;
+    long long steps;      /* instructions of current call */
+    long long deadline;   /* us, zero means no limit */
+    const char *exceeded; /* budget exceeded by current call */
+};
+
+/* chunk of `script load' */
+struct mx_lua_script_s {
+    int index;
+    char sha[MX_SHA1_HEX_SIZE + 1];
+    int length;
+    char source[0];
+};
+
+typedef enum {
+    mx_lua_msg_enqueue,
+    mx_lua_msg_dequeue,
+    mx_lua_msg_move,
+    mx_lua_msg_peek,
+    mx_lua_msg_size
+} mx_lua_msg_type;
+
+/* body to enqueue, job is set if it came from a job view */
+typedef struct {
+    const char *body;
+    int length;
+    mx_job_t *job;
+} mx_lua_item_t;
+
+/* queue operation of a script, lives on the worker's stack */
+struct mx_lua_msg_s {
+    mx_lua_msg_t *next;
+    mx_lua_worker_t *worker;
+    mx_lua_msg_type type;
+    const char *name;
+    const char *dest;       /* queue of mx_move */
+    int prival;
+    int delay;
+    mx_lua_item_t *items;   /* bodies of enqueue */
+    mx_job_t **jobs;        /* jobs taken by dequeue */
+    int count;
+    int result;
+    char *data;  /* body of peeked job, freed by worker */
+    int done;
+};
+
+#define MX_LUA_VIEW  "mx.job"
+
+/* userdata of job view, job is NULL after release or enqueue */
+struct mx_lua_view_s {
+    mx_job_t *job;  /* first field, job:ffi() of LuaJIT reads it */
+    mx_lua_worker_t *worker;
+};
+
+/* exec or async call */
+struct mx_lua_task_s {
+    mx_lua_task_t *next;
+    mx_connection_t *conn;  /* NULL if async or connection closed */
+    mx_lua_result_t result;
+    int handle;             /* of async call, zero if exec */
+    time_t expire;          /* finished async result is dropped */
+    struct list_head link;  /* in finished async results */
+    int script;             /* index of script, -1 if call a function */
+    int script_gen;
+    mx_job_t **garbage;     /* jobs of views dropped by the call */
+    int garbage_count;
+    long long elapsed;      /* us */
+    int nargs;
+    mx_token_t args[0];     /* function name and arguments */
+};
+
+static mx_lua_worker_t *mx_lua_workers = NULL;
+static int mx_lua_workers_count = 0;
+
+/* tasks waiting for worker, protected by mx_lua_lock */
+static pthread_mutex_t mx_lua_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t mx_lua_cond = PTHREAD_COND_INITIALIZER;
+static mx_lua_task_t *mx_lua_head = NULL;
+static mx_lua_task_t *mx_lua_tail = NULL;
+static int mx_lua_stopping = 0;
+static int mx_lua_alive = 0;
+
+/* lock-free lists drained by the event loop */
+static mx_lua_msg_t *volatile mx_lua_msgs = NULL;
+static mx_lua_task_t *volatile mx_lua_finished = NULL;
+
+static int mx_lua_pending = 0;  /* tasks haven't finished, main thread only */
+
+/* async calls by handle, finished ones in order of expire, main thread only */
+static HashTable *mx_lua_handle_table = NULL;
+static LIST_HEAD(mx_lua_results);
+static int mx_lua_last_handle = 0;
+
+/*
+ * Loaded scripts, protected by mx_lua_lock. Workers compile the new
+ * ones when they take a task, flush and reload bump the generations
+ */
+static mx_lua_script_t **mx_lua_scripts = NULL;
+static int mx_lua_scripts_count = 0;
+static int mx_lua_scripts_size = 0;
+static int mx_lua_scripts_gen = 0;
+static int mx_lua_lib_gen = 0;
+
+static HashTable *mx_lua_script_table = NULL;  /* digest => script, main thread only */
+
+/* Lua state of the event loop: enqueue hook and syntax check */
+static mx_lua_worker_t mx_lua_main;
+static int mx_lua_hook_ref = LUA_NOREF;   /* function of enqueue hook */
+static int mx_lua_hook_view = LUA_NOREF;  /* job view passed to hook */
+static char *mx_lua_hook_name = NULL;
+
+static __thread mx_lua_worker_t *mx_lua_current = NULL;  /* of worker thread */
+static int mx_lua_hook_step = MX_LUA_HOOK_STEP;
+
+/* calls of a function or script, updated by the event loop only */
+typedef struct {
+    long long calls;
+    long long failed;
+    long long exceeded;
+    long long total_us;
+    long long max_us;
+    long long histogram[MX_LUA_HISTOGRAM_SIZE];
+    char name[0];
+} mx_lua_stat_t;
+
+static long long mx_lua_histogram_bounds[MX_LUA_HISTOGRAM_SIZE - 1] = {
+    100, 1000, 10000, 100000, 1000000
+};
+
+static char *mx_lua_histogram_names[MX_LUA_HISTOGRAM_SIZE] = {
+    "le100us", "le1ms", "le10ms", "le100ms", "le1s", "gt1s"
+};
+
+static HashTable *mx_lua_stats_table = NULL;
+static mx_lua_stat_t **mx_lua_stats_list = NULL;  /* in order of first call */
+static int mx_lua_stats_count = 0;
+
+
+static void mx_lua_notify()
+{
+    char c = 0;
+
+    /* the pipe is full means the event loop would wake up anyway */
+    (void)write(mx_global->lvm_pipe[1], &c, 1);
+}
+
+
+static void mx_lua_post(mx_lua_worker_t *worker, mx_lua_msg_t *msg)
+{
+    mx_lua_msg_t *head;
+
+    msg->worker = worker;
+    msg->done = 0;
+
+    do {
+        head = mx_lua_msgs;
+        msg->next = head;
+    } while (!__sync_bool_compare_and_swap(&mx_lua_msgs, head, msg));
+
+    mx_lua_notify();
+
+    pthread_mutex_lock(&worker->lock);
+    while (!msg->done) {
+        pthread_cond_wait(&worker->cond, &worker->lock);
+    }
+    pthread_mutex_unlock(&worker->lock);
+}
+
+
+/*
+ * Job view: a job taken by mx_dequeue_many, the body is read in place.
+ * The job goes back to the event loop to be freed when the view was
+ * collected, or was moved to a queue by mx_enqueue/mx_enqueue_many
+ */
+
+/* the value is a job view still holding its job, doesn't raise errors */
+static mx_lua_view_t *mx_lua_view_test(lua_State *lvm, int index)
+{
+    mx_lua_view_t *view = lua_touserdata(lvm, index);
+
+    if (!view || !lua_getmetatable(lvm, index)) {
+        return NULL;
+    }
+
+    luaL_getmetatable(lvm, MX_LUA_VIEW);
+    if (!lua_rawequal(lvm, -1, -2)) {
+        view = NULL;
+    }
+    lua_pop(lvm, 2);
+
+    return view && view->job ? view : NULL;
+}
+
+
+static mx_lua_view_t *mx_lua_view_check(lua_State *lvm, int index)
+{
+    mx_lua_view_t *view = luaL_checkudata(lvm, index, MX_LUA_VIEW);
+
+    if (!view->job) {
+        luaL_error(lvm, "job was released or enqueued");
+    }
+
+    return view;
+}
+
+
+/* called by the worker, the event loop frees it with next message or task */
+static void mx_lua_view_drop(mx_lua_view_t *view)
+{
+    mx_lua_worker_t *worker = view->worker;
+    mx_job_t **garbage;
+    int size;
+
+    if (!view->job) {
+        return;
+    }
+
+    if (!worker) { /* view of enqueue hook, the job isn't its */
+        view->job = NULL;
+        return;
+    }
+
+    if (worker->garbage_count == worker->garbage_size) {
+        size = worker->garbage_size ? worker->garbage_size * 2 : 64;
+        garbage = realloc(worker->garbage, sizeof(*garbage) * size);
+        if (!garbage) {
+            mx_write_log(mx_log_error, "lost a job of lua view, out of memory");
+            view->job = NULL;
+            return;
+        }
+        worker->garbage = garbage;
+        worker->garbage_size = size;
+    }
+
+    worker->garbage[worker->garbage_count++] = view->job;
+    view->job = NULL;
+}
+
+
+static void mx_lua_view_push(lua_State *lvm, mx_lua_worker_t *worker, mx_job_t *job)
+{
+    mx_lua_view_t *view;
+
+    view = lua_newuserdata(lvm, sizeof(*view));
+    view->job = job;
+    view->worker = worker;
+
+    luaL_getmetatable(lvm, MX_LUA_VIEW);
+    lua_setmetatable(lvm, -2);
+}
+
+
+static int mx_lua_view_len(lua_State *lvm)
+{
+    lua_pushinteger(lvm, mx_lua_view_check(lvm, 1)->job->length);
+    return 1;
+}
+
+
+static int mx_lua_view_prival(lua_State *lvm)
+{
+    lua_pushinteger(lvm, mx_lua_view_check(lvm, 1)->job->prival);
+    return 1;
+}
+
+
+static int mx_lua_view_body(lua_State *lvm)
+{
+    mx_job_t *job = mx_lua_view_check(lvm, 1)->job;
+
+    lua_pushlstring(lvm, job->body, job->length);
+    return 1;
+}
+
+
+/* view:sub(i [, j]), like string.sub but copies only the slice */
+static int mx_lua_view_sub(lua_State *lvm)
+{
+    mx_job_t *job = mx_lua_view_check(lvm, 1)->job;
+    int i = luaL_checkint(lvm, 2);
+    int j = luaL_optint(lvm, 3, -1);
+
+    if (i < 0) i += job->length + 1;
+    if (i < 1) i = 1;
+    if (j < 0) j += job->length + 1;
+    if (j > job->length) j = job->length;
+
+    if (i > j) {
+        lua_pushliteral(lvm, "");
+    } else {
+        lua_pushlstring(lvm, job->body + i - 1, j - i + 1);
+    }
+
+    return 1;
+}
+
+
+/* view:byte(i), nil if out of range */
+static int mx_lua_view_byte(lua_State *lvm)
+{
+    mx_job_t *job = mx_lua_view_check(lvm, 1)->job;
+    int i = luaL_checkint(lvm, 2);
+
+    if (i < 0) i += job->length + 1;
+
+    if (i < 1 || i > job->length) {
+        lua_pushnil(lvm);
+    } else {
+        lua_pushinteger(lvm, (unsigned char)job->body[i - 1]);
+    }
+
+    return 1;
+}
+
+
+/* view:find(text [, init]), plain search, return start and end */
+static int mx_lua_view_find(lua_State *lvm)
+{
+    mx_job_t *job = mx_lua_view_check(lvm, 1)->job;
+    size_t size;
+    const char *text = luaL_checklstring(lvm, 2, &size);
+    int init = luaL_optint(lvm, 3, 1);
+    char *pos, *last;
+
+    if (init < 0) init += job->length + 1;
+    if (init < 1) init = 1;
+
+    if (init - 1 + (int)size > job->length) {
+        lua_pushnil(lvm);
+        return 1;
+    }
+
+    pos = job->body + init - 1;
+    last = job->body + job->length - size;
+
+    if (size == 0) {
+        lua_pushinteger(lvm, init);
+        lua_pushinteger(lvm, init - 1);
+        return 2;
+    }
+
+    while (pos <= last && (pos = memchr(pos, text[0], last - pos + 1))) {
+        if (!memcmp(pos, text, size)) {
+            lua_pushinteger(lvm, pos - job->body + 1);
+            lua_pushinteger(lvm, pos - job->body + size);
+            return 2;
+        }
+        pos++;
+    }
+
+    lua_pushnil(lvm);
+    return 1;
+}
+
+
+static int mx_lua_view_release(lua_State *lvm)
+{
+    mx_lua_view_drop(luaL_checkudata(lvm, 1, MX_LUA_VIEW));
+    return 0;
+}
+
+
+#ifdef MX_LUAJIT
+
+/*
+ * job:ffi() reads the job pointer at the head of mx_lua_view_t without
+ * calling C, so it can be compiled. The pointer is valid while the view
+ * holds the job
+ */
+static const char mx_lua_ffi_chunk[] =
+    "local methods, offset, size = ...\n"
+    "local ffi = require('ffi')\n"
+    "ffi.cdef[[\n" MX_LUA_JOB_CDEF "]]\n"
+    "if ffi.offsetof('mx_job_t', 'body') ~= offset or\n"
+    "   ffi.sizeof('mx_job_t') ~= size then\n"
+    "    error('mx_job_t of FFI is out of date')\n"
+    "end\n"
+    "local cast, viewp = ffi.cast, ffi.typeof('const mx_job_t **')\n"
+    "methods.ffi = function(view)\n"
+    "    local job = cast(viewp, view)[0]\n"
+    "    if job == nil then error('job was released or enqueued', 2) end\n"
+    "    return job\n"
+    "end\n";
+
+static void mx_lua_ffi_init(lua_State *lvm)
+{
+    if (luaL_loadbuffer(lvm, mx_lua_ffi_chunk,
+                        sizeof(mx_lua_ffi_chunk) - 1, "=ffi") == 0)
+    {
+        luaL_getmetatable(lvm, MX_LUA_VIEW);
+        lua_getfield(lvm, -1, "__index");
+        lua_remove(lvm, -2);
+        lua_pushinteger(lvm, offsetof(mx_job_t, body));
+        lua_pushinteger(lvm, sizeof(mx_job_t));
+
+        if (lua_pcall(lvm, 3, 0, 0) == 0) {
+            return;
+        }
+    }
+
+    mx_write_log(mx_log_error, "job:ffi() is unavailable, error: %s",
+                 lua_tostring(lvm, -1));
+    lua_pop(lvm, 1);
+}
+
+#endif
+
+
+static const luaL_Reg mx_lua_view_methods[] = {
+    {"len",     mx_lua_view_len},
+    {"prival",  mx_lua_view_prival},
+    {"body",    mx_lua_view_body},
+    {"sub",     mx_lua_view_sub},
+    {"byte",    mx_lua_view_byte},
+    {"find",    mx_lua_view_find},
+    {"release", mx_lua_view_release},
+    {NULL, NULL}
+};
+
+
+/*
+ * Take the body of an enqueue item from stack, a job view gives
+ * its job away so nothing is copied
+ */
+static void mx_lua_item_get(lua_State *lvm, int index, mx_lua_item_t *item)
+{
+    mx_lua_view_t *view;
+    size_t size;
+
+    if (lua_type(lvm, index) == LUA_TUSERDATA) {
+        view = mx_lua_view_check(lvm, index);
+        item->job = view->job;
+        item->body = NULL;
+        item->length = 0;
+        view->job = NULL;
+        return;
+    }
+
+    item->job = NULL;
+    item->body = lua_tolstring(lvm, index, &size);
+    item->length = size;
+}
+
+
+static int mx_lua_item_check(lua_State *lvm, int index)
+{
+    int type = lua_type(lvm, index);
+
+    if (type == LUA_TUSERDATA) {
+        mx_lua_view_check(lvm, index);
+        return 0;
+    }
+
+    return type == LUA_TSTRING || type == LUA_TNUMBER ? 0 : -1;
+}
+
+
+/* name of a queue may be created, error if it can't be saved */
+static const char *mx_lua_check_queue(lua_State *lvm, int index)
+{
+    const char *name;
+    size_t size;
+
+    name = luaL_checklstring(lvm, index, &size);
+    if (size == 0 || size > MX_QUEUE_NAME_MAX) {
+        luaL_argerror(lvm, index, "invaild queue name");
+    }
+
+    return name;
+}
+
+
+/* mx_dequeue(queue), body string or nil */
+static int mx_dequeue_lua_handler(lua_State *lvm)
+{
+    mx_lua_worker_t *worker = lua_touserdata(lvm, lua_upvalueindex(1));
+    mx_lua_view_t view;
+    mx_lua_msg_t msg;
+    mx_job_t *job;
+
+    msg.type = mx_lua_msg_dequeue;
+    msg.name = luaL_checkstring(lvm, 1);
+    msg.jobs = &job;
+    msg.count = 1;
+
+    mx_lua_post(worker, &msg);
+
+    if (msg.result == 0) {
+        lua_pushnil(lvm);
+        return 1;
+    }
+
+    /* the body stays until the event loop frees garbage */
+    view.job = job;
+    view.worker = worker;
+    mx_lua_view_drop(&view);
+
+    lua_pushlstring(lvm, job->body, job->length); /* copy to Lua */
+
+    return 1;
+}
+
+
+/* mx_dequeue_many(queue, count), array of job views */
+static int mx_dequeue_many_lua_handler(lua_State *lvm)
+{
+    mx_lua_worker_t *worker = lua_touserdata(lvm, lua_upvalueindex(1));
+    mx_lua_msg_t msg;
+    int i;
+
+    msg.type = mx_lua_msg_dequeue;
+    msg.name = luaL_checkstring(lvm, 1);
+    msg.count = luaL_checkint(lvm, 2);
+
+    luaL_argcheck(lvm, msg.count > 0, 2, "count must be positive");
+
+    if (msg.count > MX_MAX_BATCH_JOBS) {
+        msg.count = MX_MAX_BATCH_JOBS;
+    }
+
+    msg.jobs = lua_newuserdata(lvm, sizeof(mx_job_t *) * msg.count);
+
+    mx_lua_post(worker, &msg);
+
+    lua_createtable(lvm, msg.result, 0);
+
+    for (i = 0; i < msg.result; i++) {
+        mx_lua_view_push(lvm, worker, msg.jobs[i]);
+        lua_rawseti(lvm, -2, i + 1);
+    }
+
+    return 1;
+}
+
+
+/* mx_enqueue(queue, prival, delay, body), body is a string or a job view */
+static int mx_enqueue_lua_handler(lua_State *lvm)
+{
+    mx_lua_item_t item;
+    mx_lua_msg_t msg;
+
+    /* Get params from stack */
+    msg.type = mx_lua_msg_enqueue;
+    msg.name = mx_lua_check_queue(lvm, 1);
+    msg.prival = luaL_checkint(lvm, 2);
+    msg.delay = luaL_checkint(lvm, 3);
+
+    luaL_argcheck(lvm, mx_lua_item_check(lvm, 4) == 0, 4, "string or job expected");
+
+    mx_lua_item_get(lvm, 4, &item);
+
+    msg.items = &item;
+    msg.count = 1;
+
+    mx_lua_post(lua_touserdata(lvm, lua_upvalueindex(1)), &msg);
+
+    lua_pushboolean(lvm, msg.result);
+
+    return 1;
+}
+
+
+/* mx_enqueue_many(queue, prival, delay, bodies), return jobs enqueued */
+static int mx_enqueue_many_lua_handler(lua_State *lvm)
+{
+    mx_lua_msg_t msg;
+    int i, number;
+
+    msg.type = mx_lua_msg_enqueue;
+    msg.name = mx_lua_check_queue(lvm, 1);
+    msg.prival = luaL_checkint(lvm, 2);
+    msg.delay = luaL_checkint(lvm, 3);
+
+    luaL_checktype(lvm, 4, LUA_TTABLE);
+
+    msg.count = lua_objlen(lvm, 4);
+    if (msg.count == 0) {
+        lua_pushinteger(lvm, 0);
+        return 1;
+    }
+
+    /* check all before any view gives its job away */
+    for (i = 1; i <= msg.count; i++) {
+        lua_rawgeti(lvm, 4, i);
+        if (mx_lua_item_check(lvm, -1) == -1) {
+            return luaL_error(lvm, "item %d is not a string or job", i);
+        }
+        lua_pop(lvm, 1);
+    }
+
+    msg.items = lua_newuserdata(lvm, sizeof(mx_lua_item_t) * msg.count);
+
+    /* strings stay alive in the table, numbers are converted
+     * on the stack, so keep the converted strings in another one */
+    lua_newtable(lvm);
+
+    for (i = 0; i < msg.count; i++) {
+        lua_rawgeti(lvm, 4, i + 1);
+        number = lua_type(lvm, -1) == LUA_TNUMBER;
+        mx_lua_item_get(lvm, -1, &msg.items[i]);
+        if (number) {
+            lua_rawseti(lvm, -2, i + 1);
+        } else {
+            lua_pop(lvm, 1);
+        }
+    }
+
+    mx_lua_post(lua_touserdata(lvm, lua_upvalueindex(1)), &msg);
+
+    lua_pushinteger(lvm, msg.result);
+
+    return 1;
+}
+
+
+/* mx_move(src, dst, count), relink jobs without copy, return jobs moved */
+static int mx_move_lua_handler(lua_State *lvm)
+{
+    mx_lua_msg_t msg;
+
+    msg.type = mx_lua_msg_move;
+    msg.name = luaL_checkstring(lvm, 1);
+    msg.dest = mx_lua_check_queue(lvm, 2);
+    msg.count = luaL_checkint(lvm, 3);
+
+    mx_lua_post(lua_touserdata(lvm, lua_upvalueindex(1)), &msg);
+
+    lua_pushinteger(lvm, msg.result);
+
+    return 1;
+}
+
+
+/* mx_peek(queue), body and prival of the top job, nil if empty */
+static int mx_peek_lua_handler(lua_State *lvm)
+{
+    mx_lua_msg_t msg;
+
+    msg.type = mx_lua_msg_peek;
+    msg.name = luaL_checkstring(lvm, 1);
+    msg.data = NULL;
+
+    mx_lua_post(lua_touserdata(lvm, lua_upvalueindex(1)), &msg);
+
+    if (msg.result == -1) {
+        lua_pushnil(lvm);
+        return 1;
+    }
+
+    lua_pushlstring(lvm, msg.data, msg.result);
+    lua_pushinteger(lvm, msg.prival);
+    free(msg.data);
+
+    return 2;
+}
+
+
+static int mx_size_lua_handler(lua_State *lvm)
+{
+    mx_lua_msg_t msg;
+
+    msg.type = mx_lua_msg_size;
+    msg.name = luaL_checkstring(lvm, 1);
+
+    mx_lua_post(lua_touserdata(lvm, lua_upvalueindex(1)), &msg);
+
+    lua_pushnumber(lvm, msg.result);
+    return 1;
+}
+
+
+/* queue operations in the event loop */
+
+static int mx_lua_do_enqueue(mx_lua_msg_t *msg)
+{
+    mx_lua_item_t *item;
+    mx_queue_t *queue;
+    mx_job_t *job;
+    int i, ret, enqueued = 0;
+
+    queue = mx_queue_get((char *)msg->name, strlen(msg->name));
+
+    for (i = 0; i < msg->count; i++) {
+        item = &msg->items[i];
+
+        if (item->job) { /* relink the job of view */
+            job = item->job;
+            job->belong = queue;
+            job->prival = msg->prival;
+            job->timeout = msg->delay > 0 ? mx_current_time + msg->delay : 0;
+            mx_arena_job_move(job, queue);
+
+        } else {
+            job = queue ? mx_job_create(queue, msg->prival, msg->delay, item->length) : NULL;
+            if (job == NULL) {
+                continue;
+            }
+
+            memcpy(job->body, item->body, item->length);
+
+            job->body[item->length] = CR_CHR;
+            job->body[item->length+1] = LF_CHR;
+
+            mx_arena_job_commit(job);
+        }
+
+        if (queue == NULL) {
+            mx_job_free(job);
+            continue;
+        }
+
+        if (job->timeout > mx_current_time) {
+            ret = mx_skiplist_insert(mx_global->delay_queue, job->timeout, job);
+
+        } else {
+            if (job->timeout > 0) {
+                job->timeout = 0;
+            }
+            ret = mx_queue_insert(queue, job);
+        }
+
+        if (ret != SKL_STATUS_OK) {
+            mx_job_free(job);
+            continue;
+        }
+
+        enqueued++;
+    }
+
+    mx_global->dirty += enqueued;
+
+    return enqueued;
+}
+
+
+static int mx_lua_do_dequeue(mx_lua_msg_t *msg)
+{
+    mx_queue_t *queue;
+    int count = 0;
+
+    if (hash_lookup(mx_global->queue_table, (char *)msg->name,
+                                            (void **)&queue) == -1)
+    {
+        return 0;
+    }
+
+    while (count < msg->count) {
+        msg->jobs[count] = mx_queue_pop(queue);
+        if (msg->jobs[count] == NULL) {
+            break;
+        }
+        count++;
+    }
+
+    return count;
+}
+
+
+static int mx_lua_do_move(mx_lua_msg_t *msg)
+{
+    mx_queue_t *src, *dst;
+    mx_job_t *job;
+    int moved = 0;
+
+    if (!strcmp(msg->name, msg->dest) ||
+        hash_lookup(mx_global->queue_table, (char *)msg->name, (void **)&src) == -1 ||
+        (dst = mx_queue_get((char *)msg->dest, strlen(msg->dest))) == NULL)
+    {
+        return 0;
+    }
+
+    while (moved < msg->count) {
+        job = mx_queue_pop(src);
+        if (job == NULL) {
+            break;
+        }
+
+        job->belong = dst;
+        mx_arena_job_move(job, dst);
+
+        if (mx_queue_insert(dst, job) != SKL_STATUS_OK) {
+            job->belong = src; /* give it back */
+            mx_arena_job_move(job, src);
+            if (mx_queue_insert(src, job) != SKL_STATUS_OK) {
+                mx_job_free(job);
+            }
+            break;
+        }
+
+        moved++;
+    }
+
+    if (moved > 0) {
+        mx_global->dirty++;
+    }
+
+    return moved;
+}
+
+
+static int mx_lua_do_peek(mx_lua_msg_t *msg)
+{
+    mx_queue_t *queue;
+    mx_job_t *job;
+
+    if (hash_lookup(mx_global->queue_table, (char *)msg->name,
+                                            (void **)&queue) == -1 ||
+        (job = mx_queue_top(queue)) == NULL)
+    {
+        return -1;
+    }
+
+    msg->data = malloc(job->length + 1);
+    if (msg->data == NULL) {
+        return -1;
+    }
+
+    memcpy(msg->data, job->body, job->length);
+    msg->prival = job->prival;
+
+    return job->length;
+}
+
+
+static int mx_lua_do_size(mx_lua_msg_t *msg)
+{
+    mx_queue_t *queue;
+
+    if (hash_lookup(mx_global->queue_table, (char *)msg->name,
+                                     (void **)&queue) == -1)
+    {
+        return 0;
+    }
+
+    return mx_queue_size(queue);
+}
+
+
+/* free the jobs of collected views, the owner is waiting or gone */
+static void mx_lua_collect(mx_job_t **garbage, int count)
+{
+    int i;
+
+    for (i = 0; i < count; i++) {
+        mx_job_free(garbage[i]);
+    }
+}
+
+
+static void mx_lua_result_free(mx_lua_result_t *result)
+{
+    free(result->text);
+    mx_lua_collect(result->jobs, result->count);
+    free(result->jobs);
+}
+
+
+static void mx_lua_task_free(mx_lua_task_t *task)
+{
+    char key[16];
+    void *value;
+
+    if (task->handle) {
+        sprintf(key, "%d", task->handle);
+        hash_remove(mx_lua_handle_table, key, &value);
+        list_del(&task->link);
+    }
+
+    mx_lua_result_free(&task->result);
+    free(task);
+}
+
+
+static void mx_lua_stats_add(mx_lua_task_t *task)
+{
+    mx_lua_stat_t *stat;
+    int i;
+
+    if (hash_lookup(mx_lua_stats_table, task->args[0].value, (void **)&stat) == -1) {
+        if (mx_lua_stats_count >= MX_LUA_STATS_MAX) {
+            return;
+        }
+
+        if (!mx_lua_stats_list &&
+            !(mx_lua_stats_list = malloc(sizeof(*mx_lua_stats_list) * MX_LUA_STATS_MAX)))
+        {
+            return;
+        }
+
+        stat = calloc(1, sizeof(*stat) + task->args[0].length + 1);
+        if (!stat) {
+            return;
+        }
+
+        memcpy(stat->name, task->args[0].value, task->args[0].length + 1);
+
+        if (hash_insert(mx_lua_stats_table, stat->name, stat) == -1) {
+            free(stat);
+            return;
+        }
+
+        mx_lua_stats_list[mx_lua_stats_count++] = stat;
+    }
+
+    stat->calls++;
+    stat->total_us += task->elapsed;
+
+    if (task->result.status == mx_lua_failed) {
+        stat->failed++;
+    } else if (task->result.status == mx_lua_exceeded) {
+        stat->exceeded++;
+    }
+
+    if (task->elapsed > stat->max_us) {
+        stat->max_us = task->elapsed;
+    }
+
+    for (i = 0; i < MX_LUA_HISTOGRAM_SIZE - 1; i++) {
+        if (task->elapsed <= mx_lua_histogram_bounds[i]) {
+            break;
+        }
+    }
+
+    stat->histogram[i]++;
+}
+
+
+/*
+ * One line per function: <name> calls=.. failed=.. exceeded=.. avg_us=..
+ * max_us=.. and the latency histogram, the text should be freed
+ */
+char *mx_lua_stats(int *length)
+{
+    mx_lua_stat_t *stat;
+    char *text, *pos;
+    size_t size = 1;
+    int i, j;
+
+    for (i = 0; i < mx_lua_stats_count; i++) {
+        size += strlen(mx_lua_stats_list[i]->name) + 128 + MX_LUA_HISTOGRAM_SIZE * 32;
+    }
+
+    text = pos = malloc(size);
+    if (!text) {
+        return NULL;
+    }
+
+    *pos = 0;
+
+    for (i = 0; i < mx_lua_stats_count; i++) {
+        stat = mx_lua_stats_list[i];
+
+        pos += sprintf(pos, "%s calls=%lld failed=%lld exceeded=%lld avg_us=%lld max_us=%lld",
+                       stat->name, stat->calls, stat->failed, stat->exceeded,
+                       stat->total_us / stat->calls, stat->max_us);
+
+        for (j = 0; j < MX_LUA_HISTOGRAM_SIZE; j++) {
+            pos += sprintf(pos, " %s=%lld", mx_lua_histogram_names[j], stat->histogram[j]);
+        }
+
+        *pos++ = '\n';
+    }
+
+    *length = pos - text;
+
+    return text;
+}
+
+
+void mx_lua_stats_reset()
+{
+    void *stat;
+    int i;
+
+    for (i = 0; i < mx_lua_stats_count; i++) {
+        hash_remove(mx_lua_stats_table, mx_lua_stats_list[i]->name, &stat);
+        free(mx_lua_stats_list[i]);
+    }
+
+    mx_lua_stats_count = 0;
+}
+
+
+/*
+ * Handle the messages of workers and the finished tasks,
+ * both lists were pushed in reverse order
+ */
+static void mx_lua_process()
+{
+    mx_lua_msg_t *msg, *msgs = NULL, *next;
+    mx_lua_task_t *task, *tasks = NULL, *tnext;
+    mx_lua_worker_t *worker;
+
+    msg = __sync_lock_test_and_set(&mx_lua_msgs, NULL);
+    while (msg) {
+        next = msg->next;
+        msg->next = msgs;
+        msgs = msg;
+        msg = next;
+    }
+
+    for (msg = msgs; msg; msg = next) {
+        next = msg->next; /* msg is gone after the worker woke up */
+        worker = msg->worker;
+
+        /* the worker is waiting, its garbage can't change */
+        mx_lua_collect(worker->garbage, worker->garbage_count);
+        worker->garbage_count = 0;
+
+        switch (msg->type) {
+        case mx_lua_msg_enqueue:
+            msg->result = mx_lua_do_enqueue(msg);
+            break;
+        case mx_lua_msg_dequeue:
+            msg->result = mx_lua_do_dequeue(msg);
+            break;
+        case mx_lua_msg_move:
+            msg->result = mx_lua_do_move(msg);
+            break;
+        case mx_lua_msg_peek:
+            msg->result = mx_lua_do_peek(msg);
+            break;
+        case mx_lua_msg_size:
+            msg->result = mx_lua_do_size(msg);
+            break;
+        }
+
+        pthread_mutex_lock(&worker->lock);
+        msg->done = 1;
+        pthread_cond_signal(&worker->cond);
+        pthread_mutex_unlock(&worker->lock);
+    }
+
+    task = __sync_lock_test_and_set(&mx_lua_finished, NULL);
+    while (task) {
+        tnext = task->next;
+        task->next = tasks;
+        tasks = task;
+        task = tnext;
+    }
+
+    for (task = tasks; task; task = tnext) {
+        tnext = task->next;
+
+        mx_lua_stats_add(task);
+
+        mx_lua_collect(task->garbage, task->garbage_count);
+        free(task->garbage);
+        task->garbage = NULL;
+
+        mx_lua_pending--;
+
+        if (task->conn) {
+            task->conn->lua_task = NULL;
+            mx_exec_done(task->conn, &task->result); /* result was taken */
+            free(task);
+
+        } else if (task->handle) { /* wait for fetch */
+            task->expire = mx_current_time + MX_LUA_RESULT_TIMEOUT;
+            list_add_tail(&task->link, &mx_lua_results);
+
+        } else {
+            mx_lua_result_free(&task->result);
+            free(task);
+        }
+    }
+}
+
+
+/*
+ * Take the result of async call: 1 if finished, the result should
+ * be sent by mx_send_lua_result; 0 if still running; -1 if the handle
+ * is unknown or expired
+ */
+int mx_lua_fetch(int handle, mx_lua_result_t *result)
+{
+    mx_lua_task_t *task;
+    char key[16];
+
+    sprintf(key, "%d", handle);
+
+    if (hash_lookup(mx_lua_handle_table, key, (void **)&task) == -1) {
+        return -1;
+    }
+
+    if (task->link.next == NULL) { /* haven't finished */
+        return 0;
+    }
+
+    *result = task->result;
+    memset(&task->result, 0, sizeof(task->result));
+
+    mx_lua_task_free(task);
+
+    return 1;
+}
+
+
+/*
+ * Drop the async results nobody fetched, called by the core timer
+ */
+void mx_lua_expire(time_t now)
+{
+    mx_lua_task_t *task;
+
+    while (!list_empty(&mx_lua_results)) {
+        task = list_entry(mx_lua_results.next, mx_lua_task_t, link);
+        if (task->expire > now) {
+            break;
+        }
+
+        mx_lua_task_free(task);
+    }
+}
+
+
+static void mx_lua_notify_handler(aeEventLoop *eventLoop, int fd, void *data, int mask)
+{
+    char buf[256];
+
+    while (read(fd, buf, sizeof(buf)) > 0) {
+        /* drain the pipe */
+    }
+
+    mx_lua_process();
+}
+
+
+/* worker threads */
+
+static long long mx_lua_clock()
+{
+    struct timespec now;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+
+    return (long long)now.tv_sec * 1000000 + now.tv_nsec / 1000;
+}
+
+
+/*
+ * Count hook, raise an error when the call ran out of its budget.
+ * The error is raised again at every check, so a pcall in the
+ * script can't keep running
+ */
+static void mx_lua_hook(lua_State *lvm, lua_Debug *ar)
+{
+    mx_lua_worker_t *worker = mx_lua_current;
+
+    (void)ar;
+
+    worker->steps += mx_lua_hook_step;
+
+    if (!worker->exceeded) {
+        if (mx_global->lua_max_steps > 0 &&
+            worker->steps >= mx_global->lua_max_steps)
+        {
+            worker->exceeded = "instruction";
+
+        } else if (worker->deadline > 0 && mx_lua_clock() >= worker->deadline) {
+            worker->exceeded = "time";
+        }
+    }
+
+    if (worker->exceeded) {
+        luaL_error(lvm, "%s budget exceeded", worker->exceeded);
+    }
+}
+
+
+static void mx_lua_budget_start(mx_lua_worker_t *worker, long long now)
+{
+    worker->steps = 0;
+    worker->exceeded = NULL;
+
+    if (mx_global->lua_timeout > 0) {
+        worker->deadline = now + (long long)mx_global->lua_timeout * 1000;
+    } else {
+        worker->deadline = 0;
+    }
+}
+
+
+/*
+ * Convert the returned value: true is done, false or nil is failed.
+ * Elements of array are made jobs so it's replied like mdequeue,
+ * the jobs of views are taken from them. The text and jobs are set
+ * even if failed, they are freed by the event loop
+ */
+static void mx_lua_result_get(lua_State *lvm, mx_lua_result_t *result)
+{
+    mx_lua_view_t *view;
+    mx_job_t *job;
+    const char *data;
+    size_t size;
+    int i, count, type = lua_type(lvm, -1);
+
+    result->status = mx_lua_failed;
+
+    switch (type) {
+    case LUA_TBOOLEAN:
+        if (lua_toboolean(lvm, -1)) {
+            result->status = mx_lua_done;
+        }
+        return;
+
+    case LUA_TNUMBER:
+    case LUA_TSTRING:
+    case LUA_TUSERDATA:
+        if ((view = mx_lua_view_test(lvm, -1))) {
+            data = view->job->body;
+            size = view->job->length;
+        } else if (lua_isstring(lvm, -1)) {
+            data = lua_tolstring(lvm, -1, &size);
+        } else {
+            return;
+        }
+
+        result->text = malloc(size + 1);
+        if (!result->text) {
+            return;
+        }
+
+        memcpy(result->text, data, size);
+        result->text[size] = 0;
+        result->length = size;
+        result->status = type == LUA_TNUMBER ? mx_lua_number : mx_lua_string;
+        return;
+
+    case LUA_TTABLE:
+        break;
+
+    default:
+        return;
+    }
+
+    count = lua_objlen(lvm, -1);
+    if (count > MX_MAX_BATCH_JOBS) {
+        mx_write_log(mx_log_notice, "result has more than %d elements", MX_MAX_BATCH_JOBS);
+        return;
+    }
+
+    /* check elements first, the views are untouched if failed */
+    for (i = 1; i <= count; i++) {
+        lua_rawgeti(lvm, -1, i);
+        if (!lua_isstring(lvm, -1) && !mx_lua_view_test(lvm, -1)) {
+            lua_pop(lvm, 1);
+            mx_write_log(mx_log_notice, "element %d of result isn't a string or job", i);
+            return;
+        }
+        lua_pop(lvm, 1);
+    }
+
+    result->jobs = malloc(sizeof(mx_job_t *) * (count ? count : 1));
+    if (!result->jobs) {
+        return;
+    }
+
+    for (i = 1; i <= count; i++) {
+        lua_rawgeti(lvm, -1, i);
+
+        if ((view = mx_lua_view_test(lvm, -1))) {
+            job = view->job;
+            view->job = NULL;
+
+        } else {
+            data = lua_tolstring(lvm, -1, &size);
+
+            job = malloc(sizeof(*job) + size + 2);
+            if (!job) {
+                lua_pop(lvm, 1);
+                return;
+            }
+
+            job->prival = 0;
+            job->timeout = 0;
+            job->belong = NULL;
+            job->length = size;
+            job->shared = NULL;
+            job->body = job->data;
+
+            memcpy(job->body, data, size);
+            job->body[size] = CR_CHR;
+            job->body[size+1] = LF_CHR;
+        }
+
+        result->jobs[result->count++] = job;
+        lua_pop(lvm, 1);
+    }
+
+    result->status = mx_lua_array;
+}
+
+
+static void mx_lua_call(mx_lua_worker_t *worker, mx_lua_task_t *task)
+{
+    lua_State *lvm = worker->lvm;
+    int i;
+
+    task->result.status = mx_lua_failed;
+
+    if (task->script >= 0) {
+        if (task->script_gen != worker->scripts_gen ||
+            worker->refs[task->script] == LUA_NOREF)
+        {
+            mx_write_log(mx_log_notice, "script `%s' was flushed or broken",
+                         task->args[0].value);
+            return;
+        }
+
+        lua_rawgeti(lvm, LUA_REGISTRYINDEX, worker->refs[task->script]);
+
+    } else {
+        lua_getglobal(lvm, task->args[0].value);
+    }
+
+    /* push params to stack */
+    for (i = 1; i <= task->nargs; i++) {
+        if (task->args[i].is_integer) {
+            lua_pushinteger(lvm, task->args[i].integer);
+        } else {
+            lua_pushlstring(lvm, task->args[i].value, task->args[i].length);
+        }
+    }
+
+    if (lua_pcall(lvm, task->nargs, 1, 0) != 0) {
+        if (!worker->exceeded) {
+            mx_write_log(mx_log_notice, "failed to call function `%s', error: %s",
+                         task->args[0].value, lua_tostring(lvm, -1));
+        }
+        lua_pop(lvm, 1);
+        return;
+    }
+
+    mx_lua_result_get(lvm, &task->result);
+
+    lua_pop(lvm, 1); /* clean stack */
+}
+
+
+static void mx_lua_run(mx_lua_worker_t *worker, mx_lua_task_t *task)
+{
+    long long start = mx_lua_clock();
+
+    mx_lua_budget_start(worker, start);
+
+    mx_lua_call(worker, task);
+
+    /* the error may be caught by the script */
+    if (worker->exceeded) {
+        mx_write_log(mx_log_notice, "function `%s' aborted, %s budget exceeded",
+                     task->args[0].value, worker->exceeded);
+        task->result.status = mx_lua_exceeded;
+    }
+
+    task->elapsed = mx_lua_clock() - start;
+}
+
+
+/*
+ * Compile the scripts the worker haven't seen, called with mx_lua_lock
+ * held so the list can't change meanwhile
+ */
+static void mx_lua_sync_scripts(mx_lua_worker_t *worker)
+{
+    lua_State *lvm = worker->lvm;
+    mx_lua_script_t *script;
+    int *refs, i;
+
+    if (worker->scripts_gen != mx_lua_scripts_gen) { /* flushed */
+        for (i = 0; i < worker->refs_count; i++) {
+            luaL_unref(lvm, LUA_REGISTRYINDEX, worker->refs[i]);
+        }
+        worker->refs_count = 0;
+        worker->scripts_gen = mx_lua_scripts_gen;
+    }
+
+    if (worker->refs_count == mx_lua_scripts_count) {
+        return;
+    }
+
+    if (worker->refs_size < mx_lua_scripts_count) {
+        refs = realloc(worker->refs, sizeof(int) * mx_lua_scripts_size);
+        if (!refs) {
+            return;
+        }
+        worker->refs = refs;
+        worker->refs_size = mx_lua_scripts_size;
+    }
+
+    while (worker->refs_count < mx_lua_scripts_count) {
+        script = mx_lua_scripts[worker->refs_count];
+
+        if (luaL_loadbuffer(lvm, script->source, script->length, script->sha)) {
+            mx_write_log(mx_log_error, "failed to compile script `%s', error: %s",
+                         script->sha, lua_tostring(lvm, -1));
+            lua_pop(lvm, 1);
+            worker->refs[worker->refs_count++] = LUA_NOREF;
+            continue;
+        }
 
+        worker->refs[worker->refs_count++] = luaL_ref(lvm, LUA_REGISTRYINDEX);
+    }
+}
 
-static int mx_dequeue_lua_handler(lua_State *lvm)
+
+static int mx_lua_load_lib(lua_State *lvm, char *lua_file)
 {
-    const char *name;
-    mx_queue_t *queue;
-    mx_job_t *job;
+    if (luaL_loadfile(lvm, lua_file) || lua_pcall(lvm, 0, 0, 0) != 0) {
+        mx_write_log(mx_log_error, "failed to load lua file `%s', error: %s",
+                     lua_file, lua_tostring(lvm, -1));
+        lua_pop(lvm, 1);
+        return -1;
+    }
 
-    name = luaL_checkstring(lvm, 1);
+    return 0;
+}
 
-    if (hash_lookup(mx_global->queue_table, (char *)name,
-                                            (void **)&queue) == -1)
-    {
-        lua_pushnil(lvm);
-        return 1;
+
+static void *mx_lua_worker_main(void *arg)
+{
+    mx_lua_worker_t *worker = arg;
+    mx_lua_task_t *task, *head;
+    int reload;
+
+    mx_lua_current = worker;
+
+    for (;;) {
+        pthread_mutex_lock(&mx_lua_lock);
+
+        while (!mx_lua_head && !mx_lua_stopping) {
+            pthread_cond_wait(&mx_lua_cond, &mx_lua_lock);
+        }
+
+        if (mx_lua_stopping) {
+            break;
+        }
+
+        task = mx_lua_head;
+        mx_lua_head = task->next;
+        if (!mx_lua_head) {
+            mx_lua_tail = NULL;
+        }
+
+        mx_lua_sync_scripts(worker);
+
+        reload = worker->lib_gen != mx_lua_lib_gen;
+        worker->lib_gen = mx_lua_lib_gen;
+
+        pthread_mutex_unlock(&mx_lua_lock);
+
+        if (reload) { /* redefine the functions of lualib file */
+            mx_lua_budget_start(worker, mx_lua_clock());
+            mx_lua_load_lib(worker->lvm, mx_global->lualib_file);
+        }
+
+        mx_lua_run(worker, task);
+
+        /* the views dropped go back with the task */
+        task->garbage = worker->garbage;
+        task->garbage_count = worker->garbage_count;
+        worker->garbage = NULL;
+        worker->garbage_count = 0;
+        worker->garbage_size = 0;
+
+        do {
+            head = mx_lua_finished;
+            task->next = head;
+        } while (!__sync_bool_compare_and_swap(&mx_lua_finished, head, task));
+
+        mx_lua_notify();
     }
 
-    if (mx_skiplist_find_top(queue->list, (void **)&job) ==
-                                           SKL_STATUS_KEY_NOT_FOUND) {
-        lua_pushnil(lvm);
-        return 1;
+    mx_lua_alive--;
+    pthread_mutex_unlock(&mx_lua_lock);
+
+    return NULL;
+}
+
+
+/*
+ * Queue a call of Lua function for workers, arguments are copied
+ * because the request buffer would be reused. Connection waits for
+ * the result unless async is set, the handle of async call is returned
+ * then. Return -1 if failed.
+ */
+int mx_lua_submit(mx_connection_t *c, mx_token_t *tokens, int params, int async)
+{
+    mx_lua_script_t *script = NULL;
+    mx_lua_task_t *task;
+    char key[16];
+    size_t size;
+    char *pos;
+    int i;
+
+    size = sizeof(*task) + sizeof(mx_token_t) * (params + 1) + tokens[1].length + 1;
+    for (i = 0; i < params; i++) {
+        size += tokens[i+3].length + 1;
     }
 
-    mx_skiplist_delete_top(queue->list);
-    lua_pushlstring(lvm, job->body, job->length); /* copy to Lua */
-    mx_job_free(job);
+    task = malloc(size);
+    if (!task) {
+        return -1;
+    }
 
-    return 1;
+    task->next = NULL;
+    task->conn = async ? NULL : c;
+    memset(&task->result, 0, sizeof(task->result));
+    task->handle = 0;
+    task->link.next = NULL;
+    task->garbage = NULL;
+    task->garbage_count = 0;
+    task->elapsed = 0;
+    task->nargs = params;
+
+    /* call by digest */
+    if (tokens[1].length == MX_SHA1_HEX_SIZE) {
+        hash_lookup(mx_lua_script_table, tokens[1].value, (void **)&script);
+    }
+
+    task->script = script ? script->index : -1;
+    task->script_gen = mx_lua_scripts_gen;
+
+    pos = (char *)&task->args[params + 1];
+
+    for (i = 0; i <= params; i++) {
+        mx_token_t *token = &tokens[i ? i + 2 : 1];
+
+        task->args[i] = *token;
+        task->args[i].value = pos;
+        memcpy(pos, token->value, token->length);
+        pos[token->length] = 0;
+        pos += token->length + 1;
+    }
+
+    if (async) {
+        if (++mx_lua_last_handle <= 0) { /* wrapped */
+            mx_lua_last_handle = 1;
+        }
+
+        sprintf(key, "%d", mx_lua_last_handle);
+
+        if (hash_insert(mx_lua_handle_table, key, task) == -1) {
+            free(task);
+            return -1;
+        }
+
+        task->handle = mx_lua_last_handle;
+    }
+
+    pthread_mutex_lock(&mx_lua_lock);
+
+    if (mx_lua_tail) {
+        mx_lua_tail->next = task;
+    } else {
+        mx_lua_head = task;
+    }
+    mx_lua_tail = task;
+
+    pthread_cond_signal(&mx_lua_cond);
+    pthread_mutex_unlock(&mx_lua_lock);
+
+    if (!async) {
+        c->lua_task = task;
+    }
+
+    mx_lua_pending++;
+
+    return task->handle;
 }
 
 
-static int mx_enqueue_lua_handler(lua_State *lvm)
+/*
+ * The connection was closed, drop the result of its call
+ */
+void mx_lua_cancel(mx_connection_t *c)
 {
-    const char *name, *job_body;
-    int prival, delay, size;
-    mx_queue_t *queue;
-    mx_job_t *job;
-    int ret;
+    c->lua_task->conn = NULL;
+    c->lua_task = NULL;
+}
 
-    /* Get params from stack */
-    name = luaL_checkstring(lvm, 1);
-    prival = luaL_checkint(lvm, 2);
-    delay = luaL_checkint(lvm, 3);
-    job_body = luaL_checklstring(lvm, 4, (size_t *)&size);
 
-    if (hash_lookup(mx_global->queue_table, (char *)name,
-                                       (void **)&queue) == -1) {
+int mx_lua_busy()
+{
+    return mx_lua_pending;
+}
+
 
-        queue = mx_queue_create((char *)name, strlen(name));
-        if (queue == NULL) {
-            lua_pushboolean(lvm, 0);
-            return 1;
+/*
+ * Cache a chunk for workers, the digest of the chunk was written
+ * to sha. Loading the same chunk again does nothing
+ */
+int mx_lua_script_load(char *source, int length, char *sha)
+{
+    mx_lua_script_t *script, **scripts;
+    int size;
+
+    mx_sha1_hex(source, length, sha);
+
+    if (hash_lookup(mx_lua_script_table, sha, (void **)&script) == 0) {
+        return 0;
+    }
+
+    /* workers would compile it, so syntax errors are found here */
+    if (luaL_loadbuffer(mx_lua_main.lvm, source, length, sha)) {
+        mx_write_log(mx_log_notice, "failed to compile script, error: %s",
+                     lua_tostring(mx_lua_main.lvm, -1));
+        lua_pop(mx_lua_main.lvm, 1);
+        return -1;
+    }
+
+    lua_pop(mx_lua_main.lvm, 1);
+
+    script = malloc(sizeof(*script) + length);
+    if (!script) {
+        return -1;
+    }
+
+    memcpy(script->sha, sha, MX_SHA1_HEX_SIZE + 1);
+    memcpy(script->source, source, length);
+    script->length = length;
+
+    pthread_mutex_lock(&mx_lua_lock);
+
+    if (mx_lua_scripts_count == mx_lua_scripts_size) {
+        size = mx_lua_scripts_size ? mx_lua_scripts_size * 2 : 16;
+        scripts = realloc(mx_lua_scripts, sizeof(*scripts) * size);
+        if (!scripts) {
+            pthread_mutex_unlock(&mx_lua_lock);
+            free(script);
+            return -1;
+        }
+        mx_lua_scripts = scripts;
+        mx_lua_scripts_size = size;
+    }
+
+    script->index = mx_lua_scripts_count;
+    mx_lua_scripts[mx_lua_scripts_count++] = script;
+
+    pthread_mutex_unlock(&mx_lua_lock);
+
+    if (hash_insert(mx_lua_script_table, script->sha, script) == -1) {
+        return -1;
+    }
+
+    mx_write_log(mx_log_debug, "loaded script `%s'", sha);
+
+    return 0;
+}
+
+
+/*
+ * Forget all scripts, the calls haven't run fail
+ */
+void mx_lua_script_flush()
+{
+    void *script;
+    int i;
+
+    pthread_mutex_lock(&mx_lua_lock);
+
+    for (i = 0; i < mx_lua_scripts_count; i++) {
+        hash_remove(mx_lua_script_table, mx_lua_scripts[i]->sha, &script);
+        free(mx_lua_scripts[i]);
+    }
+    mx_lua_scripts_count = 0;
+    mx_lua_scripts_gen++;
+
+    pthread_mutex_unlock(&mx_lua_lock);
+}
+
+
+/*
+ * Run the lualib file again in every worker before its next call
+ */
+int mx_lua_script_reload()
+{
+    if (luaL_loadfile(mx_lua_main.lvm, mx_global->lualib_file)) {
+        mx_write_log(mx_log_error, "failed to reload lua file `%s', error: %s",
+                     mx_global->lualib_file, lua_tostring(mx_lua_main.lvm, -1));
+        lua_pop(mx_lua_main.lvm, 1);
+        return -1;
+    }
+
+    lua_pop(mx_lua_main.lvm, 1);
+
+    pthread_mutex_lock(&mx_lua_lock);
+    mx_lua_lib_gen++;
+    pthread_mutex_unlock(&mx_lua_lock);
+
+    /* the hook function may be redefined too */
+    mx_lua_budget_start(&mx_lua_main, mx_lua_clock());
+    mx_lua_load_lib(mx_lua_main.lvm, mx_global->lualib_file);
+
+    if (mx_lua_hook_name && mx_lua_hook_set(mx_lua_hook_name) == -1) {
+        mx_write_log(mx_log_error, "enqueue hook was disabled by reload");
+        mx_lua_hook_set(NULL);
+    }
+
+    return 0;
+}
+
+
+/*
+ * Use the function of lualib as enqueue hook, NULL disables it
+ */
+int mx_lua_hook_set(char *name)
+{
+    lua_State *lvm = mx_lua_main.lvm;
+    char *copy = NULL;
+    int ref = LUA_NOREF;
+
+    if (name) {
+        lua_getglobal(lvm, name);
+        if (!lua_isfunction(lvm, -1)) {
+            mx_write_log(mx_log_error, "enqueue hook `%s' isn't a function", name);
+            lua_pop(lvm, 1);
+            return -1;
         }
 
-        if (hash_insert(mx_global->queue_table, (char *)name, queue) == -1) {
-            mx_queue_free(queue);
-            lua_pushboolean(lvm, 0);
-            return 1;
+        copy = strdup(name);
+        if (!copy) {
+            lua_pop(lvm, 1);
+            return -1;
         }
+
+        ref = luaL_ref(lvm, LUA_REGISTRYINDEX);
     }
 
-    job = mx_job_create(queue, prival, delay, size);
-    if (job == NULL) {
-        lua_pushboolean(lvm, 0);
+    luaL_unref(lvm, LUA_REGISTRYINDEX, mx_lua_hook_ref);
+    free(mx_lua_hook_name);
+
+    mx_lua_hook_ref = ref;
+    mx_lua_hook_name = copy;
+
+    return 0;
+}
+
+
+/*
+ * hook(queue, prival, delay, job) is called before a job was inserted,
+ * it returns false to drop the job, or a queue name, priority and
+ * delay (nil keeps the value) to route it. The job view can't be used
+ * after the hook returned. Errors leave the job unchanged.
+ * Return 0 if the job was dropped
+ */
+int mx_lua_enqueue_hook(mx_job_t *job)
+{
+    lua_State *lvm = mx_lua_main.lvm;
+    mx_lua_view_t *view;
+    mx_queue_t *queue;
+    const char *name;
+    size_t size;
+    int delay, ret;
+
+    if (mx_lua_hook_ref == LUA_NOREF) {
         return 1;
     }
 
-    memcpy(job->body, job_body, size);
+    delay = job->timeout > mx_current_time ? job->timeout - mx_current_time : 0;
 
-    job->body[size] = CR_CHR;
-    job->body[size+1] = LF_CHR;
+    lua_rawgeti(lvm, LUA_REGISTRYINDEX, mx_lua_hook_ref);
+    lua_pushlstring(lvm, job->belong->name, job->belong->name_len);
+    lua_pushinteger(lvm, job->prival);
+    lua_pushinteger(lvm, delay);
+    lua_rawgeti(lvm, LUA_REGISTRYINDEX, mx_lua_hook_view);
 
-    if (job->timeout > mx_current_time) {
-        ret = mx_skiplist_insert(mx_global->delay_queue, job->timeout, job);
+    view = lua_touserdata(lvm, -1);  /* kept by registry */
+    view->job = job;
 
-    } else {
-        if (job->timeout > 0) {
-            job->timeout = 0;
+    mx_lua_budget_start(&mx_lua_main, mx_lua_clock());
+
+    ret = lua_pcall(lvm, 4, 3, 0);
+
+    view->job = NULL;
+
+    if (ret != 0 || mx_lua_main.exceeded) {
+        mx_write_log(mx_log_notice, "enqueue hook `%s' failed, error: %s",
+                     mx_lua_hook_name, ret ? lua_tostring(lvm, -1) : "budget exceeded");
+        lua_pop(lvm, ret ? 1 : 3);
+        return 1;
+    }
+
+    if (lua_isboolean(lvm, -3) && !lua_toboolean(lvm, -3)) {
+        lua_pop(lvm, 3);
+        return 0;
+    }
+
+    if (lua_type(lvm, -3) == LUA_TSTRING) {
+        name = lua_tolstring(lvm, -3, &size);
+
+        if (size != (size_t)job->belong->name_len || memcmp(name, job->belong->name, size)) {
+            queue = mx_queue_get((char *)name, size);
+            if (queue) {
+                job->belong = queue;
+                mx_arena_job_move(job, queue);
+            }
         }
-        ret = mx_skiplist_insert(queue->list, job->prival, job);
     }
-    
-    if (ret == SKL_STATUS_OK) {
-        lua_pushboolean(lvm, 1);
-    } else {
-        lua_pushboolean(lvm, 0);
+
+    if (lua_type(lvm, -2) == LUA_TNUMBER) {
+        job->prival = lua_tointeger(lvm, -2);
+    }
+
+    if (lua_type(lvm, -1) == LUA_TNUMBER) {
+        delay = lua_tointeger(lvm, -1);
+        job->timeout = delay > 0 ? mx_current_time + delay : 0;
     }
 
+    lua_pop(lvm, 3);
+
     return 1;
 }
 
 
-static int mx_size_lua_handler(lua_State *lvm)
+/* mx_queue_size of the enqueue hook, on the event loop */
+static int mx_size_hook_handler(lua_State *lvm)
 {
-    const char *name;
     mx_queue_t *queue;
 
-    name = luaL_checkstring(lvm, 1);
-
-    if (hash_lookup(mx_global->queue_table, (char *)name,
-                                     (void **)&queue) == -1)
+    if (hash_lookup(mx_global->queue_table, (char *)luaL_checkstring(lvm, 1),
+                                                       (void **)&queue) == -1)
     {
         lua_pushnumber(lvm, 0);
-        return 1;
+    } else {
+        lua_pushnumber(lvm, mx_queue_size(queue));
     }
 
-    lua_pushnumber(lvm, mx_skiplist_size(queue->list));
     return 1;
 }
 
 
-int mx_register_lua_functions()
+static int mx_lua_create_state(mx_lua_worker_t *worker, char *lua_file)
 {
-    lua_pushcfunction(mx_global->lvm, mx_dequeue_lua_handler);
-    lua_setglobal(mx_global->lvm, "mx_dequeue");
+    lua_State *lvm;
 
-    lua_pushcfunction(mx_global->lvm, mx_enqueue_lua_handler);
-    lua_setglobal(mx_global->lvm, "mx_enqueue");
+    worker->lvm = lvm = luaL_newstate(); /* create Lua vm */
+    if (!lvm) {
+        return -1;
+    }
 
-    lua_pushcfunction(mx_global->lvm, mx_size_lua_handler);
-    lua_setglobal(mx_global->lvm, "mx_queue_size");
+    /* load standard libs */
+    luaL_openlibs(lvm);
 
-    return 0;
-}
+    /* metatable of job views */
+    luaL_newmetatable(lvm, MX_LUA_VIEW);
+    lua_newtable(lvm);
+    luaL_register(lvm, NULL, mx_lua_view_methods);
+    lua_setfield(lvm, -2, "__index");
+    lua_pushcfunction(lvm, mx_lua_view_len);
+    lua_setfield(lvm, -2, "__len");
+    lua_pushcfunction(lvm, mx_lua_view_body);
+    lua_setfield(lvm, -2, "__tostring");
+    lua_pushcfunction(lvm, mx_lua_view_release);
+    lua_setfield(lvm, -2, "__gc");
+    lua_pop(lvm, 1);
 
+#ifdef MX_LUAJIT
+    mx_lua_ffi_init(lvm);
+#endif
 
-/*
- * Unlock lvm lock helper function
- */
-void mx_unlock_lvm(aeEventLoop *eventLoop, int fd, void *data, int mask)
-{
-    char c;
+    if (mx_lua_load_lib(lvm, lua_file) == -1) {
+        return -1;
+    }
+
+    if (worker == &mx_lua_main) {
+        lua_pushcfunction(lvm, mx_size_hook_handler);
+        lua_setglobal(lvm, "mx_queue_size");
+
+        mx_lua_view_push(lvm, NULL, NULL);
+        mx_lua_hook_view = luaL_ref(lvm, LUA_REGISTRYINDEX);
+
+        goto set_hook;
+    }
+
+    /* the functions know their worker by upvalue */
+    lua_pushlightuserdata(lvm, worker);
+    lua_pushcclosure(lvm, mx_dequeue_lua_handler, 1);
+    lua_setglobal(lvm, "mx_dequeue");
+
+    lua_pushlightuserdata(lvm, worker);
+    lua_pushcclosure(lvm, mx_enqueue_lua_handler, 1);
+    lua_setglobal(lvm, "mx_enqueue");
 
-    (void)read(fd, &c, 1); /* read a char from pipe */
+    lua_pushlightuserdata(lvm, worker);
+    lua_pushcclosure(lvm, mx_size_lua_handler, 1);
+    lua_setglobal(lvm, "mx_queue_size");
 
-    pthread_mutex_unlock(&mx_global->lvm_lock);
+    lua_pushlightuserdata(lvm, worker);
+    lua_pushcclosure(lvm, mx_dequeue_many_lua_handler, 1);
+    lua_setglobal(lvm, "mx_dequeue_many");
+
+    lua_pushlightuserdata(lvm, worker);
+    lua_pushcclosure(lvm, mx_enqueue_many_lua_handler, 1);
+    lua_setglobal(lvm, "mx_enqueue_many");
+
+    lua_pushlightuserdata(lvm, worker);
+    lua_pushcclosure(lvm, mx_move_lua_handler, 1);
+    lua_setglobal(lvm, "mx_move");
+
+    lua_pushlightuserdata(lvm, worker);
+    lua_pushcclosure(lvm, mx_peek_lua_handler, 1);
+    lua_setglobal(lvm, "mx_peek");
+
+set_hook:
+
+    /* the lualib file was loaded without budget */
+    if (mx_global->lua_max_steps > 0 || mx_global->lua_timeout > 0) {
+        lua_sethook(lvm, mx_lua_hook, LUA_MASKCOUNT, mx_lua_hook_step);
+    }
+
+    return 0;
 }
 
 
 int mx_lua_init(char *lua_file)
 {
-    mx_global->lvm = luaL_newstate(); /* create Lua vm */
-    if (!mx_global->lvm) {
+    mx_lua_worker_t *worker;
+    int i;
+
+    mx_lua_workers = calloc(mx_global->lua_workers, sizeof(*worker));
+    if (!mx_lua_workers) {
         return -1;
     }
 
-    /* load standard libs */
-    luaopen_base(mx_global->lvm);
-    luaopen_table(mx_global->lvm);
-    luaL_openlibs(mx_global->lvm);
-    luaopen_string(mx_global->lvm);
-    luaopen_math(mx_global->lvm);
-
-    if (luaL_loadfile(mx_global->lvm, lua_file) ||
-        lua_pcall(mx_global->lvm, 0, 0, 0) != 0 ||
-        mx_register_lua_functions() == -1)
-    {
+    mx_lua_workers_count = mx_global->lua_workers;
+
+    mx_lua_script_table = hash_alloc(32);
+    mx_lua_stats_table = hash_alloc(32);
+    mx_lua_handle_table = hash_alloc(32);
+    if (!mx_lua_script_table || !mx_lua_stats_table || !mx_lua_handle_table) {
+        return -1;
+    }
+
+    /* small budget is checked more often */
+    if (mx_global->lua_max_steps > 0 && mx_global->lua_max_steps < mx_lua_hook_step) {
+        mx_lua_hook_step = mx_global->lua_max_steps;
+    }
+
+    mx_lua_current = &mx_lua_main;
+
+    if (mx_lua_create_state(&mx_lua_main, lua_file) == -1) {
         return -1;
     }
 
-    pthread_mutex_init(&mx_global->lvm_lock, NULL);
+    if (mx_global->lua_enqueue_hook &&
+        mx_lua_hook_set(mx_global->lua_enqueue_hook) == -1)
+    {
+        return -1;
+    }
 
     if (pipe(mx_global->lvm_pipe) < 0) {
         return -1;
     }
 
-    aeCreateFileEvent(mx_global->event, mx_global->lvm_pipe[0], 
-           AE_READABLE, mx_unlock_lvm, NULL);
+    fcntl(mx_global->lvm_pipe[0], F_SETFL, O_NONBLOCK);
+    fcntl(mx_global->lvm_pipe[1], F_SETFL, O_NONBLOCK);
+
+    if (aeCreateFileEvent(mx_global->event, mx_global->lvm_pipe[0],
+           AE_READABLE, mx_lua_notify_handler, NULL) == -1)
+    {
+        return -1;
+    }
+
+    for (i = 0; i < mx_lua_workers_count; i++) {
+        worker = &mx_lua_workers[i];
+
+        if (mx_lua_create_state(worker, lua_file) == -1) {
+            return -1;
+        }
+
+        pthread_mutex_init(&worker->lock, NULL);
+        pthread_cond_init(&worker->cond, NULL);
+
+        if (pthread_create(&worker->tid, NULL, mx_lua_worker_main, worker) != 0) {
+            return -1;
+        }
+
+        worker->started = 1;
+        mx_lua_alive++;
+    }
+
+    mx_write_log(mx_log_debug, "started (%d)lua workers", mx_lua_workers_count);
 
     return 0;
 }
 
 
+/*
+ * Stop the workers, a worker may be waiting for a queue operation
+ * so keep serving the messages until all workers exited
+ */
 void mx_lua_close()
 {
-    if (mx_global->lua_enable && mx_global->lvm) {
-        lua_close(mx_global->lvm);
-        pthread_mutex_destroy(&mx_global->lvm_lock);
-        close(mx_global->lvm_pipe[0]);
-        close(mx_global->lvm_pipe[1]);
+    mx_lua_worker_t *worker;
+    time_t deadline;
+    int i, alive;
+
+    if (!mx_global->lua_enable || !mx_lua_workers) {
+        return;
+    }
+
+    pthread_mutex_lock(&mx_lua_lock);
+    mx_lua_stopping = 1;
+    pthread_cond_broadcast(&mx_lua_cond);
+    pthread_mutex_unlock(&mx_lua_lock);
+
+    deadline = time(NULL) + MX_LUA_CLOSE_TIMEOUT;
+
+    for (;;) {
+        mx_lua_process();
+
+        pthread_mutex_lock(&mx_lua_lock);
+        alive = mx_lua_alive;
+        pthread_mutex_unlock(&mx_lua_lock);
+
+        if (alive == 0) {
+            break;
+        }
+
+        if (time(NULL) >= deadline) { /* a script never returns */
+            mx_write_log(mx_log_error, "(%d)lua workers didn't exit, leave them", alive);
+            return;
+        }
+
+        usleep(1000);
+    }
+
+    for (i = 0; i < mx_lua_workers_count; i++) {
+        worker = &mx_lua_workers[i];
+
+        if (worker->started) {
+            pthread_join(worker->tid, NULL);
+            pthread_mutex_destroy(&worker->lock);
+            pthread_cond_destroy(&worker->cond);
+        }
+
+        if (worker->lvm) {
+            lua_close(worker->lvm);  /* views were collected */
+        }
+
+        mx_lua_collect(worker->garbage, worker->garbage_count);
+        free(worker->garbage);
+        free(worker->refs);
+    }
+
+    /* tasks never run */
+    while (mx_lua_head) {
+        mx_lua_tail = mx_lua_head->next;
+        free(mx_lua_head);
+        mx_lua_head = mx_lua_tail;
     }
+
+    /* results never fetched */
+    while (!list_empty(&mx_lua_results)) {
+        mx_lua_task_free(list_entry(mx_lua_results.next, mx_lua_task_t, link));
+    }
+
+    hash_destroy(mx_lua_handle_table, NULL);
+
+    free(mx_lua_workers);
+    mx_lua_workers = NULL;
+
+    mx_lua_script_flush();
+    hash_destroy(mx_lua_script_table, NULL);
+
+    mx_lua_stats_reset();
+    hash_destroy(mx_lua_stats_table, NULL);
+    free(mx_lua_stats_list);
+
+    lua_close(mx_lua_main.lvm);
+    free(mx_lua_hook_name);
+    free(mx_lua_scripts);
+
+    close(mx_global->lvm_pipe[0]);
+    close(mx_global->lvm_pipe[1]);
 }
@@ -0,0 +1,450 @@
+/*
+ * Copyright (c) 2012 - 2013, YukChung Lee <liexusong@qq.com>
+ * All rights reserved.
+ *  __   __  __   __         _______  __   __  _______  __   __  _______  ______
+ * |  |_|  ||  |_|  |       |       ||  | |  ||       ||  | |  ||       ||      |
+ * |       ||       | ____  |   _   ||  | |  ||    ___||  | |  ||    ___||  _    |
+ * |       ||       ||____| |  | |  ||  |_|  ||   |___ |  |_|  ||   |___ | | |   |
+ * |       | |     |        |  |_|  ||       ||    ___||       ||    ___|| |_|   |
+ * | ||_|| ||   _   |       |      | |       ||   |___ |       ||   |___ |       |
+ * |_|   |_||__| |__|       |____||_||_______||_______||_______||_______||______|
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/*
+ * Lua routing microbenchmark: a routing script like an enqueue hook is
+ * called for every job, reading the body by the methods of job view
+ * (a C call for every field) and, built with LuaJIT, by job:ffi().
+ *
+ *   make luabench && ./mx-luabench [jobs] [rounds]
+ *   make clean && make luajit && ./mx-luabench [jobs] [rounds]
+ */
+
+#include <sys/time.h>
+#include <stdlib.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <string.h>
+#include "global.h"
+
+#define MX_BENCH_JOBS    10000
+#define MX_BENCH_ROUNDS  100
+
+#define MX_BENCH_VIEW  "mx.job"
+
+#ifdef MX_LUAJIT
+#define MX_BENCH_LUA  "LuaJIT"
+#else
+#define MX_BENCH_LUA  "Lua"
+#endif
+
+/*
+ * Job body: <kind><flag><tenant>|<payload>, '!' kind is an alert and
+ * 'X' flag is spam. Routes by the header bytes, priority and length
+ */
+static const char mx_bench_script[] =
+    "local tenants = {'tenant-0', 'tenant-1', 'tenant-2', 'tenant-3'}\n"
+    "function route(q, prival, delay, job)\n"
+    "    if job:byte(1) == 33 then return 'urgent' end\n"
+    "    if job:byte(2) == 88 then return false end\n"
+    "    if job:prival() > 7 then return 'high' end\n"
+    "    if job:len() > 96 then return 'bulk' end\n"
+    "    local id, i = 0, 3\n"
+    "    local c = job:byte(i)\n"
+    "    while c and c >= 48 and c <= 57 do\n"
+    "        id = id * 10 + c - 48\n"
+    "        i = i + 1\n"
+    "        c = job:byte(i)\n"
+    "    end\n"
+    "    return tenants[id % 4 + 1]\n"
+    "end\n"
+#ifdef MX_LUAJIT
+    "function route_ffi(q, prival, delay, view)\n"
+    "    local job = view:ffi()\n"
+    "    local b, n = job.body, job.length\n"
+    "    if b[0] == 33 then return 'urgent' end\n"
+    "    if b[1] == 88 then return false end\n"
+    "    if job.prival > 7 then return 'high' end\n"
+    "    if n > 96 then return 'bulk' end\n"
+    "    local id, i = 0, 2\n"
+    "    while i < n and b[i] >= 48 and b[i] <= 57 do\n"
+    "        id = id * 10 + b[i] - 48\n"
+    "        i = i + 1\n"
+    "    end\n"
+    "    return tenants[id % 4 + 1]\n"
+    "end\n"
+#endif
+    ;
+
+
+/* the methods of job view in lua.c read by the script */
+
+static mx_job_t *mx_bench_job(lua_State *lvm)
+{
+    return *(mx_job_t **)luaL_checkudata(lvm, 1, MX_BENCH_VIEW);
+}
+
+
+static int mx_bench_view_len(lua_State *lvm)
+{
+    lua_pushinteger(lvm, mx_bench_job(lvm)->length);
+    return 1;
+}
+
+
+static int mx_bench_view_prival(lua_State *lvm)
+{
+    lua_pushinteger(lvm, mx_bench_job(lvm)->prival);
+    return 1;
+}
+
+
+static int mx_bench_view_sub(lua_State *lvm)
+{
+    mx_job_t *job = mx_bench_job(lvm);
+    int i = luaL_optinteger(lvm, 2, 1);
+    int j = luaL_optinteger(lvm, 3, -1);
+
+    if (i < 0) i += job->length + 1;
+    if (j < 0) j += job->length + 1;
+    if (i < 1) i = 1;
+    if (j > job->length) j = job->length;
+
+    if (i > j) {
+        lua_pushliteral(lvm, "");
+    } else {
+        lua_pushlstring(lvm, job->body + i - 1, j - i + 1);
+    }
+
+    return 1;
+}
+
+
+static int mx_bench_view_byte(lua_State *lvm)
+{
+    mx_job_t *job = mx_bench_job(lvm);
+    int i = luaL_optinteger(lvm, 2, 1);
+
+    if (i < 0) i += job->length + 1;
+
+    if (i < 1 || i > job->length) {
+        return 0;
+    }
+
+    lua_pushinteger(lvm, (unsigned char)job->body[i - 1]);
+    return 1;
+}
+
+
+static int mx_bench_view_find(lua_State *lvm)
+{
+    mx_job_t *job = mx_bench_job(lvm);
+    size_t size;
+    const char *text = luaL_checklstring(lvm, 2, &size);
+    int init = luaL_optinteger(lvm, 3, 1);
+    char *pos, *last;
+
+    if (init < 1) init = 1;
+
+    if (size == 0 || init + (int)size - 1 > job->length) {
+        lua_pushnil(lvm);
+        return 1;
+    }
+
+    pos = job->body + init - 1;
+    last = job->body + job->length - size;
+
+    while (pos <= last && (pos = memchr(pos, text[0], last - pos + 1))) {
+        if (!memcmp(pos, text, size)) {
+            lua_pushinteger(lvm, pos - job->body + 1);
+            lua_pushinteger(lvm, pos - job->body + size);
+            return 2;
+        }
+        pos++;
+    }
+
+    lua_pushnil(lvm);
+    return 1;
+}
+
+
+#ifdef MX_LUAJIT
+
+/* same as mx_lua_ffi_init() of lua.c */
+static const char mx_bench_ffi_chunk[] =
+    "local methods, offset, size = ...\n"
+    "local ffi = require('ffi')\n"
+    "ffi.cdef[[\n" MX_LUA_JOB_CDEF "]]\n"
+    "if ffi.offsetof('mx_job_t', 'body') ~= offset or\n"
+    "   ffi.sizeof('mx_job_t') ~= size then\n"
+    "    error('mx_job_t of FFI is out of date')\n"
+    "end\n"
+    "local cast, viewp = ffi.cast, ffi.typeof('const mx_job_t **')\n"
+    "methods.ffi = function(view)\n"
+    "    local job = cast(viewp, view)[0]\n"
+    "    if job == nil then error('job was released or enqueued', 2) end\n"
+    "    return job\n"
+    "end\n";
+#endif
+
+
+static const luaL_Reg mx_bench_view_methods[] = {
+    {"len",    mx_bench_view_len},
+    {"prival", mx_bench_view_prival},
+    {"sub",    mx_bench_view_sub},
+    {"byte",   mx_bench_view_byte},
+    {"find",   mx_bench_view_find},
+    {NULL, NULL}
+};
+
+
+static lua_State *mx_bench_state()
+{
+    lua_State *lvm = luaL_newstate();
+
+    if (!lvm) {
+        return NULL;
+    }
+
+    luaL_openlibs(lvm);
+
+    luaL_newmetatable(lvm, MX_BENCH_VIEW);
+    lua_newtable(lvm);
+    luaL_register(lvm, NULL, mx_bench_view_methods);
+    lua_setfield(lvm, -2, "__index");
+    lua_pushcfunction(lvm, mx_bench_view_len);
+    lua_setfield(lvm, -2, "__len");
+
+#ifdef MX_LUAJIT
+    if (luaL_loadbuffer(lvm, mx_bench_ffi_chunk,
+                        sizeof(mx_bench_ffi_chunk) - 1, "=ffi") != 0)
+    {
+        goto failed;
+    }
+
+    lua_getfield(lvm, -2, "__index");
+    lua_pushinteger(lvm, offsetof(mx_job_t, body));
+    lua_pushinteger(lvm, sizeof(mx_job_t));
+
+    if (lua_pcall(lvm, 3, 0, 0) != 0) {
+        goto failed;
+    }
+#endif
+
+    lua_pop(lvm, 1);
+
+    if (luaL_loadbuffer(lvm, mx_bench_script,
+                        sizeof(mx_bench_script) - 1, "=route") != 0 ||
+        lua_pcall(lvm, 0, 0, 0) != 0)
+    {
+        goto failed;
+    }
+
+    return lvm;
+
+failed:
+    fprintf(stderr, "[error] %s\n", lua_tostring(lvm, -1));
+    lua_close(lvm);
+    return NULL;
+}
+
+
+/* alerts, spam, orders and clicks of 60 to 110 bytes */
+static mx_job_t **mx_bench_jobs(int count)
+{
+    mx_job_t **jobs, *job;
+    char body[128];
+    int i, length;
+
+    jobs = malloc(sizeof(*jobs) * count);
+    if (!jobs) {
+        return NULL;
+    }
+
+    for (i = 0; i < count; i++) {
+        switch (i % 10) {
+        case 0:
+            length = sprintf(body, "!-%d|disk of host-%04d is almost full, "
+                             "used=97%%", i % 1000, i);
+            break;
+        case 7:
+            length = sprintf(body, "CX%d|subject=cheap watches;from=unknown",
+                             i % 1000);
+            break;
+        case 1: case 2: case 3: case 4:
+            length = sprintf(body, "C-%d|user=%d;session=a81f03c2e5d94b1e;"
+                             "page=/item/%d;ts=1363154201%s",
+                             i % 1000, i, i % 977, i % 3 ? "" : ";ref=/search?q=watch+strap");
+            break;
+        default:
+            length = sprintf(body, "O-%d|user=%d;order=%d;amount=%d.%02d;"
+                             "currency=USD;ts=1363154201",
+                             i % 1000, i, i * 7, i % 500, i % 100);
+            break;
+        }
+
+        job = malloc(sizeof(*job) + length + 2);
+        if (!job) {
+            return NULL;
+        }
+
+        job->prival = i % 10;
+        job->timeout = 0;
+        job->belong = NULL;
+        job->length = length;
+        job->shared = NULL;
+        job->body = job->data;
+
+        memcpy(job->body, body, length);
+        job->body[length] = CR_CHR;
+        job->body[length+1] = LF_CHR;
+
+        jobs[i] = job;
+    }
+
+    return jobs;
+}
+
+
+static double mx_bench_elapsed(struct timeval *begin)
+{
+    struct timeval end;
+
+    gettimeofday(&end, NULL);
+
+    return (end.tv_sec - begin->tv_sec) +
+           (end.tv_usec - begin->tv_usec) / 1000000.0;
+}
+
+
+/*
+ * Call the function for every job like the enqueue hook, one view
+ * is reused. Return a checksum of the routes, -1 if failed
+ */
+static long mx_bench_run(lua_State *lvm, char *name, mx_job_t **jobs,
+    int count, int rounds)
+{
+    mx_job_t **view;
+    size_t size;
+    const char *route;
+    long checksum = 0;
+    int i, r;
+
+    view = lua_newuserdata(lvm, sizeof(*view));
+    luaL_getmetatable(lvm, MX_BENCH_VIEW);
+    lua_setmetatable(lvm, -2);
+
+    for (r = 0; r < rounds; r++) {
+        for (i = 0; i < count; i++) {
+            *view = jobs[i];
+
+            lua_getglobal(lvm, name);
+            lua_pushliteral(lvm, "events");
+            lua_pushinteger(lvm, jobs[i]->prival);
+            lua_pushinteger(lvm, 0);
+            lua_pushvalue(lvm, -5);
+
+            if (lua_pcall(lvm, 4, 1, 0) != 0) {
+                fprintf(stderr, "[error] %s\n", lua_tostring(lvm, -1));
+                return -1;
+            }
+
+            if (lua_type(lvm, -1) == LUA_TSTRING) {
+                route = lua_tolstring(lvm, -1, &size);
+                checksum += size * 31 + route[0];
+            } else {
+                checksum += 7;  /* dropped */
+            }
+
+            lua_pop(lvm, 1);
+        }
+    }
+
+    lua_pop(lvm, 1);
+
+    return checksum;
+}
+
+
+int main(int argc, char *argv[])
+{
+    lua_State *lvm;
+    mx_job_t **jobs;
+    struct timeval begin;
+    double elapsed;
+    long checksum;
+    int count = MX_BENCH_JOBS, rounds = MX_BENCH_ROUNDS;
+
+    if (argc > 1) {
+        count = atoi(argv[1]);
+    }
+
+    if (argc > 2) {
+        rounds = atoi(argv[2]);
+    }
+
+    if (count <= 0 || rounds <= 0) {
+        fprintf(stderr, "Usage: %s [jobs] [rounds]\n", argv[0]);
+        return 1;
+    }
+
+    jobs = mx_bench_jobs(count);
+    lvm = mx_bench_state();
+    if (!jobs || !lvm) {
+        return 1;
+    }
+
+    printf("%s, routed %d jobs %d times\n", MX_BENCH_LUA, count, rounds);
+
+    gettimeofday(&begin, NULL);
+    checksum = mx_bench_run(lvm, "route", jobs, count, rounds);
+    elapsed = mx_bench_elapsed(&begin);
+
+    if (checksum == -1) {
+        return 1;
+    }
+
+    printf("job view methods:  %.3f seconds, %.1f ns/job\n",
+           elapsed, elapsed * 1e9 / ((double)count * rounds));
+
+#ifdef MX_LUAJIT
+    {
+        long ffi_checksum;
+
+        gettimeofday(&begin, NULL);
+        ffi_checksum = mx_bench_run(lvm, "route_ffi", jobs, count, rounds);
+        elapsed = mx_bench_elapsed(&begin);
+
+        if (ffi_checksum == -1) {
+            return 1;
+        }
+
+        printf("job:ffi():         %.3f seconds, %.1f ns/job\n",
+               elapsed, elapsed * 1e9 / ((double)count * rounds));
+
+        if (ffi_checksum != checksum) {
+            fprintf(stderr, "[error] routes mismatch: %ld != %ld\n",
+                    checksum, ffi_checksum);
+            return 1;
+        }
+    }
+#endif
+
+    lua_close(lvm);
+
+    return 0;
+}
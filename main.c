@@ -33,7 +33,9 @@
 #include <sys/resource.h>
 #include <sys/mman.h>
 #include <sys/wait.h>
+#include <sys/uio.h>
 #include <fcntl.h>
+#include <limits.h>
 #include <unistd.h>
 #include <netinet/in.h>
 #include <netinet/tcp.h>
@@ -43,37 +45,78 @@
 #include <stdlib.h>
 #include <stdio.h>
 #include <string.h>
-#include <stdarg.h>
 #include <getopt.h>
+#include <pthread.h>
 
 #include "global.h"
+#include "sha1.h"
+
+#ifndef IOV_MAX
+#define IOV_MAX  1024
+#endif
 
 
 void mx_command_ping_handler(mx_connection_t *c, mx_token_t *tokens);
 void mx_command_auth_handler(mx_connection_t *c, mx_token_t *tokens);
 void mx_command_enqueue_handler(mx_connection_t *c, mx_token_t *tokens);
+void mx_command_menqueue_handler(mx_connection_t *c, mx_token_t *tokens);
 void mx_command_dequeue_handler(mx_connection_t *c, mx_token_t *tokens);
 void mx_command_touch_handler(mx_connection_t *c, mx_token_t *tokens);
+void mx_command_mdequeue_handler(mx_connection_t *c, mx_token_t *tokens);
+void mx_command_mtouch_handler(mx_connection_t *c, mx_token_t *tokens);
+void mx_command_bdequeue_handler(mx_connection_t *c, mx_token_t *tokens);
+void mx_command_btouch_handler(mx_connection_t *c, mx_token_t *tokens);
+void mx_command_dequeue_any_handler(mx_connection_t *c, mx_token_t *tokens);
+void mx_command_touch_any_handler(mx_connection_t *c, mx_token_t *tokens);
 void mx_command_recycle_handler(mx_connection_t *c, mx_token_t *tokens);
+void mx_command_ack_handler(mx_connection_t *c, mx_token_t *tokens);
+void mx_command_nack_handler(mx_connection_t *c, mx_token_t *tokens);
+void mx_command_extend_handler(mx_connection_t *c, mx_token_t *tokens);
+void mx_command_move_handler(mx_connection_t *c, mx_token_t *tokens);
+void mx_command_fanout_handler(mx_connection_t *c, mx_token_t *tokens);
+void mx_command_subscribe_handler(mx_connection_t *c, mx_token_t *tokens);
+void mx_command_unsubscribe_handler(mx_connection_t *c, mx_token_t *tokens);
+void mx_command_credit_handler(mx_connection_t *c, mx_token_t *tokens);
 void mx_command_remove_handler(mx_connection_t *c, mx_token_t *tokens);
 void mx_command_size_handler(mx_connection_t *c, mx_token_t *tokens);
 void mx_command_exec_handler(mx_connection_t *c, mx_token_t *tokens);
 void mx_command_async_handler(mx_connection_t *c, mx_token_t *tokens);
-
-mx_command_t mx_commands[] = {
-    {"ping",    sizeof("ping")-1,    mx_command_ping_handler,    0},
-    {"auth",    sizeof("auth")-1,    mx_command_auth_handler,    2},
-    {"enqueue", sizeof("enqueue")-1, mx_command_enqueue_handler, 4},
-    {"dequeue", sizeof("dequeue")-1, mx_command_dequeue_handler, 1},
-    {"touch",   sizeof("touch")-1,   mx_command_touch_handler,   1},
-    {"recycle", sizeof("recycle")-1, mx_command_recycle_handler, 3},
-    {"remove",  sizeof("remove")-1,  mx_command_remove_handler,  1},
-    {"size",    sizeof("size")-1,    mx_command_size_handler,    1},
-    {"exec",    sizeof("exec")-1,    mx_command_exec_handler,   -1},
-#if 0
-    {"async",   sizeof("async")-1,   mx_command_async_handler,  -1},
-#endif
-    {NULL, 0, NULL},
+void mx_command_script_handler(mx_connection_t *c, mx_token_t *tokens);
+void mx_command_result_handler(mx_connection_t *c, mx_token_t *tokens);
+void mx_command_slowlog_handler(mx_connection_t *c, mx_token_t *tokens);
+void mx_command_info_handler(mx_connection_t *c, mx_token_t *tokens);
+
+/* binary opcodes are the indexes, so new commands are appended */
+mx_command_t mx_commands[mx_op_count] = {
+    [mx_op_ping]    = {"ping",    sizeof("ping")-1,    mx_command_ping_handler,    0},
+    [mx_op_auth]    = {"auth",    sizeof("auth")-1,    mx_command_auth_handler,    2},
+    [mx_op_enqueue] = {"enqueue", sizeof("enqueue")-1, mx_command_enqueue_handler, 4},
+    [mx_op_menqueue] = {"menqueue", sizeof("menqueue")-1, mx_command_menqueue_handler, 1},
+    [mx_op_dequeue] = {"dequeue", sizeof("dequeue")-1, mx_command_dequeue_handler, 1},
+    [mx_op_touch]   = {"touch",   sizeof("touch")-1,   mx_command_touch_handler,   1},
+    [mx_op_mdequeue] = {"mdequeue", sizeof("mdequeue")-1, mx_command_mdequeue_handler, -1},
+    [mx_op_mtouch]  = {"mtouch",  sizeof("mtouch")-1,  mx_command_mtouch_handler,  -1},
+    [mx_op_bdequeue] = {"bdequeue", sizeof("bdequeue")-1, mx_command_bdequeue_handler, 2},
+    [mx_op_btouch]  = {"btouch",  sizeof("btouch")-1,  mx_command_btouch_handler,  2},
+    [mx_op_dequeue_any] = {"dequeue_any", sizeof("dequeue_any")-1, mx_command_dequeue_any_handler, -1},
+    [mx_op_touch_any] = {"touch_any", sizeof("touch_any")-1, mx_command_touch_any_handler, -1},
+    [mx_op_recycle] = {"recycle", sizeof("recycle")-1, mx_command_recycle_handler, 3},
+    [mx_op_remove]  = {"remove",  sizeof("remove")-1,  mx_command_remove_handler,  1},
+    [mx_op_size]    = {"size",    sizeof("size")-1,    mx_command_size_handler,    1},
+    [mx_op_exec]    = {"exec",    sizeof("exec")-1,    mx_command_exec_handler,   -1},
+    [mx_op_ack]     = {"ack",     sizeof("ack")-1,     mx_command_ack_handler,     1},
+    [mx_op_nack]    = {"nack",    sizeof("nack")-1,    mx_command_nack_handler,    2},
+    [mx_op_extend]  = {"extend",  sizeof("extend")-1,  mx_command_extend_handler,  2},
+    [mx_op_move]    = {"move",    sizeof("move")-1,    mx_command_move_handler,   -1},
+    [mx_op_fanout]  = {"fanout",  sizeof("fanout")-1,  mx_command_fanout_handler, -1},
+    [mx_op_subscribe] = {"subscribe", sizeof("subscribe")-1, mx_command_subscribe_handler, -1},
+    [mx_op_unsubscribe] = {"unsubscribe", sizeof("unsubscribe")-1, mx_command_unsubscribe_handler, 0},
+    [mx_op_credit]  = {"credit",  sizeof("credit")-1,  mx_command_credit_handler,  1},
+    [mx_op_async]   = {"async",   sizeof("async")-1,   mx_command_async_handler,  -1},
+    [mx_op_script]  = {"script",  sizeof("script")-1,  mx_command_script_handler, -1},
+    [mx_op_result]  = {"result",  sizeof("result")-1,  mx_command_result_handler, 1},
+    [mx_op_slowlog] = {"slowlog", sizeof("slowlog")-1, mx_command_slowlog_handler, -1},
+    [mx_op_info]    = {"info",    sizeof("info")-1,    mx_command_info_handler,   -1},
 };
 
 
@@ -82,6 +125,17 @@ void mx_connection_free(mx_connection_t *c);
 void mx_debug_connection(mx_connection_t *c);
 void mx_send_ok_reply(mx_connection_t *c, char *str);
 void mx_send_fail_reply(mx_connection_t *c, char *str);
+void mx_read_request_handler(mx_connection_t *c);
+void mx_send_response_handler(mx_connection_t *c);
+void mx_read_batch_handler(mx_connection_t *c);
+void mx_read_blocked_handler(mx_connection_t *c);
+void mx_connection_unblock(mx_connection_t *c);
+void mx_queue_wakeup(mx_queue_t *queue);
+void mx_deliver_job(mx_connection_t *c, mx_job_t *job, int touch);
+void mx_send_job(mx_connection_t *c, mx_job_t *job);
+void mx_subscribe_ready(mx_connection_t *c);
+void mx_subscribe_unpark(mx_connection_t *c);
+void mx_enqueue_comm_handler(mx_connection_t *c, mx_token_t *tokens);
 mx_queue_t *mx_queue_create(char *name, int name_len);
 void mx_queue_free(void *arg);
 mx_job_t *mx_job_create(mx_queue_t *belong, int prival, int delay, int length);
@@ -97,37 +151,130 @@ time_t mx_current_time;
 static mx_connection_t *mx_free_connections = NULL;
 static int mx_free_connections_count = 0;
 static int mx_timer_calls = 0;
+static volatile sig_atomic_t mx_shutdown_asap = 0;
 
 
-void mx_write_log(mx_log_level level, const char *fmt, ...)
+/*
+ * Slow log timing: parse is from reading the command line to calling its
+ * handler, execution is the handler and the later steps (job bodies read
+ * after the handler returned), send is from the last step until the reply
+ * was written out. Replies of pipelined commands are written together, so
+ * the send time is counted on the last one
+ */
+static long long mx_slowlog_step_begin(mx_connection_t *c)
 {
-    va_list ap;
-    FILE *fp;
-    char *c = "-*+";
-    char buf[64];
-    time_t now;
+    if (!c->slow_start || c->slow_running) {
+        return 0;
+    }
+
+    c->slow_running = 1;
+
+    return mx_clock_usec();
+}
+
 
-    if (level > mx_global->log_level) {
+static void mx_slowlog_step_end(mx_connection_t *c, long long begin)
+{
+    if (!begin) {
         return;
     }
 
-    if (mx_global->daemon_mode) {
-        fp = mx_global->log;
-    } else {
-        fp = stdout; /* interactive model */
+    c->slow_mark = mx_clock_usec();
+    c->slow_exec += c->slow_mark - begin;
+    c->slow_running = 0;
+}
+
+
+static void mx_slowlog_finish(mx_connection_t *c)
+{
+    long long send;
+
+    if (!c->slow_start) {
+        return;
+    }
+
+    send = mx_clock_usec() - c->slow_mark;
+
+    if (c->slow_parse + c->slow_exec + send >= mx_global->slowlog_threshold) {
+        mx_slowlog_add(mx_commands[c->slow_opcode].name, c->slow_queue,
+                       c->slow_bytes, c->slow_parse, c->slow_exec, send);
     }
 
-    va_start(ap, fmt);
+    c->slow_start = 0;
+}
 
-    now = time(NULL);
-    strftime(buf, 64, "[%d %b %H:%M:%S]", gmtime(&now));
-    fprintf(fp, "%s %c ", buf, c[level]);
-    vfprintf(fp, fmt, ap);
-    fprintf(fp, "\n");
-    fflush(fp);
-    va_end(ap);
 
-    return;
+/* rates of the last second, sampled by the core timer for info command */
+static long long mx_stat_commands_last[mx_op_count];
+static int mx_stat_ops_sec[mx_op_count];
+static long long mx_stat_sample_time = 0;
+
+/* event loop iterations, busy is the time from poll returned to next poll */
+static long long mx_loop_awake = 0;
+static long long mx_loop_busy = 0;
+static long long mx_loop_busy_max = 0;
+static int mx_loop_count = 0;
+static int mx_loop_per_sec = 0;
+static int mx_loop_avg_us = 0;
+static int mx_loop_max_us = 0;
+
+
+static void mx_after_sleep(aeEventLoop *eventLoop)
+{
+    (void)eventLoop;
+
+    mx_loop_awake = mx_clock_usec();
+}
+
+
+static void mx_before_sleep(aeEventLoop *eventLoop)
+{
+    long long busy;
+
+    (void)eventLoop;
+
+    if (!mx_loop_awake) {
+        return;
+    }
+
+    busy = mx_clock_usec() - mx_loop_awake;
+
+    mx_loop_busy += busy;
+    if (busy > mx_loop_busy_max) {
+        mx_loop_busy_max = busy;
+    }
+
+    mx_loop_count++;
+    mx_loop_awake = 0;
+}
+
+
+static void mx_stat_sample()
+{
+    long long now, elapsed;
+    int i;
+
+    now = mx_clock_usec();
+    elapsed = now - mx_stat_sample_time;
+    if (elapsed < 1000000) {
+        return;
+    }
+
+    for (i = 0; i < mx_op_count; i++) {
+        mx_stat_ops_sec[i] = (mx_global->stat_commands[i] -
+                              mx_stat_commands_last[i]) * 1000000 / elapsed;
+        mx_stat_commands_last[i] = mx_global->stat_commands[i];
+    }
+
+    mx_loop_per_sec = mx_loop_count * 1000000LL / elapsed;
+    mx_loop_avg_us = mx_loop_count ? mx_loop_busy / mx_loop_count : 0;
+    mx_loop_max_us = mx_loop_busy_max;
+
+    mx_loop_busy = 0;
+    mx_loop_busy_max = 0;
+    mx_loop_count = 0;
+
+    mx_stat_sample_time = now;
 }
 
 
@@ -188,17 +335,19 @@ void mx_event_process_handler(aeEventLoop *eventLoop, int sock,
 
         break;
 
-    case mx_blocking_state: /* !wevent and !revent */
+    case mx_blocking_state: /* waiting for jobs, !wevent */
         if (mask == AE_WRITABLE && c->wevent_set) {
             aeDeleteFileEvent(mx_global->event, c->sock, AE_WRITABLE);
             c->wevent_set = 0;
             return;
         }
 
-        if (mask == AE_READABLE && c->revent_set) {
+        /* watch the connection closed by client */
+        if (c->revent_handler) {
+            c->revent_handler(c);
+        } else if (c->revent_set) {
             aeDeleteFileEvent(mx_global->event, c->sock, AE_READABLE);
             c->revent_set = 0;
-            return;
         }
 
         break;
@@ -212,72 +361,85 @@ void mx_event_process_handler(aeEventLoop *eventLoop, int sock,
 }
 
 
-size_t mx_tokenize_command(char *command, mx_token_t *tokens, size_t max_tokens)
+void mx_process_request(mx_connection_t *c)
 {
-    char *s, *e;
-    size_t ntokens = 0;
+    char *begin, *last, *pos;
+    mx_command_t *cmd;
+    mx_token_t tokens[MX_MAX_TOKENS];
+    int amount, opcode, argc;
+    long long start = 0;
 
-    for (s = e = command; ntokens < max_tokens - 1; ++e) {
-        if (*e == ' ') {
-            if (s != e) {
-                tokens[ntokens].value = s;
-                tokens[ntokens].length = e - s;
-                ntokens++;
-                *e = 0;
-            }
-            s = e + 1;
+do_again:
+
+    if (mx_global->slowlog_threshold >= 0) {
+        mx_slowlog_finish(c); /* reply of last pipelined command */
+        start = mx_clock_usec();
+    }
+
+    /* binary protocol is negotiated by the first byte */
+    if (!c->binary && c->recvpos < c->recvlast &&
+        (unsigned char)*c->recvpos == MX_BINARY_REQUEST_MAGIC)
+    {
+        c->binary = 1;
+    }
+
+    if (c->binary) {
+        amount = mx_binary_parse(c, tokens, 1, &opcode, &c->request_id);
+        if (amount == 0) {
+            return;
         }
-        else if (*e == 0) {
-            if (s != e) {
-                tokens[ntokens].value = s;
-                tokens[ntokens].length = e - s;
-                ntokens++;
-            }
 
-            break;
+        if (amount == -1) { /* lost the frame boundary, drop all */
+            c->recvpos = c->recvbuf;
+            c->recvlast = c->recvbuf;
+            mx_send_fail_reply(c, "invaild");
+            return;
         }
-    }
 
-    return ntokens;
-}
+        cmd = opcode < mx_op_count ? &mx_commands[opcode] : NULL;
 
+        tokens[0].value = cmd ? cmd->name : "";
+        tokens[0].length = cmd ? cmd->name_len : 0;
+        tokens[0].is_integer = 0;
 
-mx_command_t *mx_command_find(char *name)
-{
-    mx_command_t *cmd;
-    int ret;
-    
-    ret = hash_lookup(mx_global->cmd_table, name, (void **)&cmd);
-    if (ret == -1) {
-        return NULL;
-    }
-    return cmd;
-}
+    } else {
+        begin = c->recvpos;
 
+        last = memchr(begin, LF_CHR, c->recvlast - begin);
+        if (NULL == last) { /* not found LF character */
+            return;
+        }
 
-void mx_process_request(mx_connection_t *c)
-{
-    char *begin, *last;
-    mx_command_t *cmd;
-    mx_token_t tokens[MX_MAX_TOKENS];
-    int amount;
+        c->recvpos = last + 1; /* next process position */
+        if (last - begin > 1 && *(last - 1) == CR_CHR)
+            last--;
+        *last = 0;
 
-do_again:
+        /* command name */
+        pos = begin;
+        if (mx_tokenize_command(&pos, last, tokens, 1) == 0) {
+            tokens[0].value = "";
+            tokens[0].length = 0;
+        }
 
-    begin = c->recvpos;
+        opcode = mx_command_opcode(tokens[0].value, tokens[0].length);
+        cmd = opcode == -1 ? NULL : &mx_commands[opcode];
 
-    last = memchr(begin, LF_CHR, c->recvlast - begin);
-    if (NULL == last) { /* not found LF character */
-        return;
-    }
+        /* only parse the arguments command wants */
+        argc = (cmd && cmd->argc != -1) ? cmd->argc : MX_MAX_TOKENS - 2;
+
+        amount = 1 + mx_tokenize_command(&pos, last, tokens + 1, argc);
+        tokens[amount].value = NULL; /* end of tokens */
 
-    c->recvpos = last + 1; /* next process position */
-    if (last - begin > 1 && *(last - 1) == CR_CHR)
-        last--;
-    *last = 0;
+        if (pos < last) { /* too many arguments */
+            cmd = NULL;
+        }
+    }
 
-    /* separation parameter */
-    amount = mx_tokenize_command(begin, tokens, MX_MAX_TOKENS);
+    /* stop pushing jobs until the request was replied */
+    if (c->subscribe_parked) {
+        mx_subscribe_unpark(c);
+    }
 
     if (mx_global->auth_enable && !c->reliable) {
         if (strcmp(tokens[0].value, "auth")) {
@@ -286,7 +448,6 @@ do_again:
         }
     }
 
-    cmd = mx_command_find(tokens[0].value);
     if (NULL == cmd || (cmd->argc != -1 &&
                         cmd->argc != (amount - 1)))
     {
@@ -294,8 +455,34 @@ do_again:
         return;
     }
 
+    mx_global->stat_commands[cmd - mx_commands]++;
+
+    if (start) {
+        c->slow_start = start;
+        c->slow_mark = mx_clock_usec();
+        c->slow_parse = c->slow_mark - start;
+        c->slow_exec = 0;
+        c->slow_opcode = cmd - mx_commands;
+        c->slow_bytes = 0;
+        c->slow_running = 1;
+
+        /* don't keep the password of auth */
+        if (tokens[1].value && cmd != &mx_commands[mx_op_auth]) {
+            strncpy(c->slow_queue, tokens[1].value, MX_SLOWLOG_NAME_SIZE - 1);
+            c->slow_queue[MX_SLOWLOG_NAME_SIZE - 1] = '\0';
+        } else {
+            c->slow_queue[0] = '\0';
+        }
+
+        start = c->slow_mark;
+    }
+
     cmd->handler(c, tokens);
 
+    if (start) {
+        mx_slowlog_step_end(c, start);
+    }
+
     /* reset process position */
     if (c->recvpos < c->recvlast) {
         int movcnt;
@@ -305,6 +492,18 @@ do_again:
         c->recvpos = c->recvbuf;
         c->recvlast = c->recvbuf + movcnt;
 
+        /* the rest data belongs to menqueue command */
+        if (c->revent_handler != mx_read_request_handler) {
+            return;
+        }
+
+        /* jobs are sending, continue when finished */
+        if (c->state == mx_wevent_state &&
+            c->wevent_handler != mx_send_response_handler)
+        {
+            return;
+        }
+
         goto do_again; /* pipeline request */
 
     } else {
@@ -336,20 +535,119 @@ void mx_read_request_handler(mx_connection_t *c)
     } else if (rbytes == 0) {
         mx_connection_free(c);
         return;
+    } else {
+        mx_global->stat_bytes_in += rbytes;
+        c->recvlast += rbytes;
     }
     
-    c->recvlast += rbytes;
-    
     mx_process_request(c); /* may be reset revent_handler */
 
     return;
 }
 
 
+/*
+ * A job of enqueue or menqueue command was finished,
+ * menqueue command only reply once when all jobs finished,
+ * success is the number of jobs enqueued for fanout command
+ */
+void mx_enqueue_done(mx_connection_t *c, int success)
+{
+    char sndbuf[32];
+
+    if (c->fanout) {
+        c->fanout = 0;
+        c->fanout_count = 0;
+        if (success) {
+            sprintf(sndbuf, "%d", success);
+            mx_send_ok_reply(c, sndbuf);
+        } else {
+            mx_send_fail_reply(c, "failed");
+        }
+        return;
+    }
+
+    if (c->batch_remain <= 0) {
+        if (success) {
+            mx_send_ok_reply(c, "enqueued");
+        } else {
+            mx_send_fail_reply(c, "failed");
+        }
+        return;
+    }
+
+    if (success) {
+        c->batch_ok++;
+    }
+
+    if (--c->batch_remain > 0) {
+        c->revent_handler = mx_read_batch_handler; /* next job */
+        return;
+    }
+
+    sprintf(sndbuf, "%d", c->batch_ok);
+
+    c->batch_ok = 0;
+    c->revent_handler = mx_read_request_handler;
+
+    mx_send_ok_reply(c, sndbuf);
+}
+
+
+/*
+ * Put a new job to the delay queue or its queue
+ */
+static int mx_job_enqueue(mx_job_t *job)
+{
+    if (job->timeout > mx_current_time) {
+        return mx_skiplist_insert(mx_global->delay_queue, job->timeout, job);
+    }
+
+    if (job->timeout > 0) {
+        job->timeout = 0;
+    }
+
+    return mx_queue_insert(job->belong, job);
+}
+
+
+/*
+ * Make a job of queue with the same body, the body is shared
+ * if it can be, otherwise copied
+ */
+static mx_job_t *mx_job_clone(mx_job_t *job, mx_queue_t *queue)
+{
+    mx_job_t *copy;
+
+    if (job->shared) {
+        copy = mx_job_create_shared(queue, job->prival, 0, job->shared);
+    } else {
+        copy = mx_job_create(queue, job->prival, 0, job->length);
+        if (copy) {
+            memcpy(copy->body, job->body, job->length + 2);
+        }
+    }
+
+    if (copy) {
+        copy->timeout = job->timeout;
+        mx_arena_job_commit(copy);
+    }
+
+    return copy;
+}
+
+
 void mx_read_body_finish(mx_connection_t *c)
 {
-    mx_job_t *job = c->job;
-    int ret;
+    mx_job_t *job = c->job, *copy;
+    int ret, i, enqueued = 0;
+
+    c->slow_bytes += job->length;
+
+    if (c->binary) { /* binary frames carry no CRLF, but jobs keep it */
+        job->body[job->length] = CR_CHR;
+        job->body[job->length+1] = LF_CHR;
+    }
 
     if (job->body[c->job->length] != CR_CHR &&
         job->body[c->job->length+1] != LF_CHR)
@@ -360,26 +658,52 @@ void mx_read_body_finish(mx_connection_t *c)
         c->job_body_cptr = NULL;
         c->job_body_read = 0;
 
-        mx_send_fail_reply(c, "failed");
+        mx_enqueue_done(c, 0);
         return;
     }
 
-    if (job->timeout > mx_current_time) {
-        ret = mx_skiplist_insert(mx_global->delay_queue, job->timeout, job);
+    mx_arena_job_commit(job);
 
-    } else {
-        if (job->timeout > 0) {
-            job->timeout = 0;
+    /* enqueue hook may route the job or drop it */
+    if (mx_global->lua_enable && !c->fanout && !mx_lua_enqueue_hook(job)) {
+        mx_job_free(c->job);
+
+        c->job = NULL;
+        c->job_body_cptr = NULL;
+        c->job_body_read = 0;
+
+        if (c->batch_remain <= 0) {
+            mx_send_ok_reply(c, "dropped");
+        } else {
+            mx_enqueue_done(c, 1);
+        }
+        return;
+    }
+
+    /*
+     * The copies of fanout must be made before the job was inserted,
+     * a waiter or the spill file may take and free it at once
+     */
+    for (i = 0; i < c->fanout_count; i++) {
+        copy = mx_job_clone(job, c->fanout_queues[i]);
+        if (copy == NULL) {
+            continue;
         }
 
-        ret = mx_skiplist_insert(job->belong->list, job->prival, job);
+        if (mx_job_enqueue(copy) == SKL_STATUS_OK) {
+            mx_global->dirty++;
+            enqueued++;
+        } else {
+            mx_job_free(copy);
+        }
     }
 
+    ret = mx_job_enqueue(job);
+
     if (ret == SKL_STATUS_OK) {
-        mx_send_ok_reply(c, "enqueued");
         mx_global->dirty++;
+        enqueued++;
     } else {
-        mx_send_fail_reply(c, "failed");
         mx_job_free(c->job);
     }
 
@@ -387,12 +711,15 @@ void mx_read_body_finish(mx_connection_t *c)
     c->job_body_cptr = NULL;
     c->job_body_read = 0;
 
+    mx_enqueue_done(c, c->fanout ? enqueued : ret == SKL_STATUS_OK);
+
     return;
 }
 
 
 void mx_read_body_handler(mx_connection_t *c)
 {
+    long long begin;
     int rbytes;
 
     rbytes = read(c->sock, c->job_body_cptr, c->job_body_read);
@@ -408,11 +735,18 @@ void mx_read_body_handler(mx_connection_t *c)
         return;
     }
 
+    mx_global->stat_bytes_in += rbytes;
     c->job_body_cptr += rbytes;
     c->job_body_read -= rbytes;
 
     if (c->job_body_read <= 0) {
+        begin = mx_slowlog_step_begin(c);
         mx_read_body_finish(c);
+        mx_slowlog_step_end(c, begin);
+
+        if (c->revent_handler == mx_read_batch_handler) {
+            mx_read_batch_handler(c);
+        }
     }
 
     return;
@@ -429,7 +763,7 @@ void mx_discard_body_handler(mx_connection_t *c)
 do_again:
 
     if (c->job_body_read <= 0) {
-        mx_send_fail_reply(c, "failed");
+        mx_enqueue_done(c, 0);
         return;
     }
 
@@ -449,6 +783,7 @@ do_again:
         return;
     }
 
+    mx_global->stat_bytes_in += rbytes;
     c->job_body_read -= rbytes;
 
     if (rbytes == toread || c->job_body_read <= 0) {
@@ -457,6 +792,108 @@ do_again:
 }
 
 
+/*
+ * Process job headers of menqueue command in receive buffer
+ */
+void mx_process_batch(mx_connection_t *c)
+{
+    char *begin, *last, *pos;
+    mx_token_t tokens[MX_MAX_TOKENS];
+    int amount, opcode;
+    unsigned int request_id;
+
+    while (c->batch_remain > 0 && c->revent_handler == mx_read_batch_handler) {
+
+        if (c->binary) { /* opcode and request id of job frames are ignored */
+            amount = mx_binary_parse(c, tokens, 0, &opcode, &request_id);
+            if (amount == 0) {
+                break;
+            }
+
+            if (amount == -1) {
+                c->recvpos = c->recvlast;
+            }
+
+        } else {
+            begin = c->recvpos;
+
+            last = memchr(begin, LF_CHR, c->recvlast - begin);
+            if (NULL == last) {
+                break;
+            }
+
+            c->recvpos = last + 1;
+            if (last - begin > 1 && *(last - 1) == CR_CHR)
+                last--;
+            *last = 0;
+
+            pos = begin;
+            amount = mx_tokenize_command(&pos, last, tokens, 4);
+            if (pos < last) {
+                amount = -1;
+            }
+        }
+
+        /* <queue> <prival> <delay> <size> */
+        if (amount != 4) {
+            c->batch_remain = 0;
+            c->batch_ok = 0;
+            c->revent_handler = mx_read_request_handler;
+            mx_send_fail_reply(c, "invaild");
+            break;
+        }
+
+        mx_enqueue_comm_handler(c, tokens);
+    }
+
+    /* move the rest data to the front of buffer */
+    if (c->recvpos > c->recvbuf) {
+        int movcnt = c->recvlast - c->recvpos;
+
+        memmove(c->recvbuf, c->recvpos, movcnt);
+        c->recvpos = c->recvbuf;
+        c->recvlast = c->recvbuf + movcnt;
+    }
+}
+
+
+void mx_read_batch_handler(mx_connection_t *c)
+{
+    long long begin;
+    int rsize, rbytes;
+
+    rsize = c->recvend - c->recvlast;
+    if (rsize == 0) { /* job header too big */
+        mx_write_log(mx_log_error, "job header too big, socket %d", c->sock);
+        mx_connection_free(c);
+        return;
+    }
+
+    rbytes = read(c->sock, c->recvlast, rsize);
+    if (rbytes == -1) {
+        if (errno != EAGAIN && errno != EWOULDBLOCK) {
+            mx_connection_free(c);
+            return;
+        }
+    } else if (rbytes == 0) {
+        mx_connection_free(c);
+        return;
+    } else {
+        mx_global->stat_bytes_in += rbytes;
+        c->recvlast += rbytes;
+    }
+
+    begin = mx_slowlog_step_begin(c);
+    mx_process_batch(c);
+    mx_slowlog_step_end(c, begin);
+
+    /* pipeline requests after menqueue */
+    if (c->revent_handler == mx_read_request_handler && c->recvpos < c->recvlast) {
+        mx_process_request(c);
+    }
+}
+
+
 void mx_send_response_handler(mx_connection_t *c)
 {
     int wcount, wsize, ret;
@@ -474,16 +911,24 @@ void mx_send_response_handler(mx_connection_t *c)
         return;
     }
 
+    mx_global->stat_bytes_out += wcount;
     c->sendpos += wcount;
 
     if (c->sendpos >= c->sendlast)
     {
         c->sendpos = c->sendbuf;
         c->sendlast = c->sendbuf;
-        c->state = mx_revent_state;
-        c->revent_handler = mx_read_request_handler;
         c->wevent_handler = NULL;
 
+        /* replies before blocking dequeue (or exec) were sent */
+        if (c->blocked || c->lua_task) {
+            c->state = mx_blocking_state;
+            c->revent_handler = mx_read_blocked_handler;
+        } else {
+            c->state = mx_revent_state;
+            c->revent_handler = mx_read_request_handler;
+        }
+
 #if 0
         /* don't delete write event,
          * because mx_event_process_handler() function would delete it,
@@ -502,6 +947,17 @@ void mx_send_response_handler(mx_connection_t *c)
                 c->revent_set = 1;
             }
         }
+
+        if (!c->blocked && !c->lua_task) {
+            mx_slowlog_finish(c);
+        }
+
+        /* pipelined requests after blocking dequeue */
+        if (!c->blocked && !c->lua_task && c->recvpos < c->recvlast) {
+            mx_process_request(c);
+        }
+
+        mx_subscribe_ready(c);
     }
 }
 
@@ -534,6 +990,7 @@ void mx_send_job_handler(mx_connection_t *c)
             return;
         }
         
+        mx_global->stat_bytes_out += wcount;
         c->sendpos += wcount;
         if (wcount == wsize) {
             c->phase = mx_send_job_body;
@@ -561,6 +1018,7 @@ send_body_flag:
             return;
         }
 
+        mx_global->stat_bytes_out += wcount;
         c->job_body_cptr += wcount;
         c->job_body_send -= wcount;
 
@@ -568,10 +1026,20 @@ send_body_flag:
             c->sendpos = c->sendbuf;
             c->sendlast = c->sendbuf;
 
-            if (c->recycle) { /* job would be recycle */
+            if (c->bulk) { /* text of bulk reply, not a job */
+                free(c->job);
+                c->bulk = 0;
+            } else if (c->moving) { /* move ... get, job enter the new queue */
+                if (mx_queue_insert(c->job->belong, c->job) != SKL_STATUS_OK) {
+                    mx_job_free(c->job);
+                }
+                c->moving = 0;
+            } else if (c->recycle) { /* job would be recycle */
                 c->job->timeout = mx_current_time + mx_global->recycle_timeout;
-                mx_skiplist_insert(mx_global->recycle_queue,
-                      c->recycle_id, c->job);
+                mx_arena_job_recycle(c->job, c->recycle_id);
+                if (mx_inflight_add(c->recycle_id, c->job) == -1) {
+                    mx_job_free(c->job);
+                }
                 c->recycle = 0;
                 c->recycle_id = 0;
             } else {
@@ -582,10 +1050,13 @@ send_body_flag:
             c->job_body_cptr = NULL;
             c->job_body_send = 0;
             c->phase = 0;
+            c->push = 0;
 
             c->state = mx_revent_state;
             c->revent_handler = mx_read_request_handler;
 
+            mx_slowlog_finish(c);
+
             /* set read event */
             if (!c->revent_set) {
                 ret = aeCreateFileEvent(mx_global->event, c->sock, 
@@ -594,6 +1065,13 @@ send_body_flag:
                     c->revent_set = 1;
                 }
             }
+
+            /* pipelined requests */
+            if (c->recvpos < c->recvlast) {
+                mx_process_request(c);
+            }
+
+            mx_subscribe_ready(c);
         }
         break;
     }
@@ -603,6 +1081,106 @@ send_body_flag:
 }
 
 
+/*
+ * Jobs of mdequeue/mtouch were sent, touched jobs
+ * would be put into recycle queue
+ */
+void mx_release_jobs(mx_connection_t *c)
+{
+    mx_job_t *job;
+    int i;
+
+    for (i = 0; i < c->jobs_count; i++) {
+        job = c->jobs[i];
+
+        if (c->jobs_touch) {
+            job->timeout = mx_current_time + c->jobs_lease;
+            mx_arena_job_recycle(job, c->jobs_recycle_id + i);
+            if (mx_inflight_add(c->jobs_recycle_id + i, job) == -1) {
+                mx_job_free(job);
+            }
+        } else {
+            mx_job_free(job);
+        }
+    }
+
+    c->jobs_count = 0;
+    c->jobs_touch = 0;
+    c->iov_pos = 0;
+    c->iov_count = 0;
+}
+
+
+void mx_send_jobs_handler(mx_connection_t *c)
+{
+    struct iovec *iov;
+    int wcount, count, ret;
+
+    while (c->iov_pos < c->iov_count) {
+
+        count = c->iov_count - c->iov_pos;
+        if (count > IOV_MAX) {
+            count = IOV_MAX;
+        }
+
+        wcount = writev(c->sock, c->iov + c->iov_pos, count);
+        if (wcount == -1) {
+            if (errno != EAGAIN && errno != EWOULDBLOCK) {
+                mx_write_log(mx_log_debug,
+                      "Failed to write, and not due to blocking");
+                mx_connection_free(c);
+            }
+            return;
+        } else if (wcount == 0) {
+            mx_connection_free(c);
+            return;
+        }
+
+        mx_global->stat_bytes_out += wcount;
+
+        /* skip sent buffers */
+        while (wcount > 0) {
+            iov = &c->iov[c->iov_pos];
+
+            if ((size_t)wcount >= iov->iov_len) {
+                wcount -= iov->iov_len;
+                c->iov_pos++;
+            } else {
+                iov->iov_base = (char *)iov->iov_base + wcount;
+                iov->iov_len -= wcount;
+                wcount = 0;
+            }
+        }
+    }
+
+    c->sendpos = c->sendbuf;
+    c->sendlast = c->sendbuf;
+
+    mx_release_jobs(c);
+
+    mx_slowlog_finish(c);
+
+    c->state = mx_revent_state;
+    c->revent_handler = mx_read_request_handler;
+    c->wevent_handler = NULL;
+
+    if (!c->revent_set) {
+        ret = aeCreateFileEvent(mx_global->event, c->sock,
+              AE_READABLE, mx_event_process_handler, c);
+        if (ret == 0) {
+            c->revent_set = 1;
+        }
+    }
+
+    /* pipelined requests */
+    if (c->recvpos < c->recvlast) {
+        mx_process_request(c);
+    }
+
+    mx_subscribe_ready(c);
+}
+
+
 void mx_send_reply(mx_connection_t *c, mx_reply_type type, char *str)
 {
     char *response_state;
@@ -623,6 +1201,10 @@ void mx_send_reply(mx_connection_t *c, mx_reply_type type, char *str)
 
     slen = strlen(str);
 
+    if (c->binary) { /* frame header instead of state and CRLF */
+        rlen = MX_BINARY_HEADER_SIZE - 2;
+    }
+
     /* output string too big */
     if (slen + rlen + 2 > (c->sendend - c->sendlast)) {
         mx_write_log(mx_log_notice,
@@ -630,17 +1212,25 @@ void mx_send_reply(mx_connection_t *c, mx_reply_type type, char *str)
         return;
     }
 
-    /* response state */
-    memcpy(c->sendlast, response_state, rlen);
-    c->sendlast += rlen;
+    if (c->binary) {
+        c->sendlast = mx_binary_header(c->sendlast, type == mx_reply_fail,
+                                       mx_binary_string, c->request_id, slen);
+        memcpy(c->sendlast, str, slen);
+        c->sendlast += slen;
 
-    /* response message */
-    memcpy(c->sendlast, str, slen);
-    c->sendlast += slen;
+    } else {
+        /* response state */
+        memcpy(c->sendlast, response_state, rlen);
+        c->sendlast += rlen;
+
+        /* response message */
+        memcpy(c->sendlast, str, slen);
+        c->sendlast += slen;
 
-    /* inlcude CRLF */
-    memcpy(c->sendlast, CRLF, 2);
-    c->sendlast += 2;
+        /* inlcude CRLF */
+        memcpy(c->sendlast, CRLF, 2);
+        c->sendlast += 2;
+    }
 
     c->state = mx_wevent_state;
     c->wevent_handler = mx_send_response_handler;
@@ -669,6 +1259,69 @@ void mx_send_fail_reply(mx_connection_t *c, char *str)
 }
 
 
+/*
+ * Reply a text may be longer than the send buffer:
+ * +OK <length>\r\n<text>\r\n, the text is sent like a job body
+ */
+void mx_send_bulk_reply(mx_connection_t *c, char *data, int length)
+{
+    char buf[64];
+    mx_job_t *job;
+    int len, ret;
+
+    job = malloc(sizeof(*job) + length + 2);
+    if (job == NULL) {
+        mx_send_fail_reply(c, "failed");
+        return;
+    }
+
+    job->prival = 0;
+    job->timeout = 0;
+    job->belong = NULL;
+    job->length = length;
+    job->shared = NULL;
+    job->body = job->data;
+
+    memcpy(job->body, data, length);
+    job->body[length] = CR_CHR;
+    job->body[length+1] = LF_CHR;
+
+    if (c->binary) {
+        len = mx_binary_header(buf, 0, mx_binary_string, c->request_id, length) - buf;
+    } else {
+        len = sprintf(buf, "+OK %d" CRLF, length);
+    }
+
+    if (len >= c->sendend - c->sendlast) {
+        mx_write_log(mx_log_notice,
+              "Output string too big, socket(%d)", c->sock);
+        free(job);
+        return;
+    }
+
+    memcpy(c->sendlast, buf, len);
+
+    c->sendlast += len;
+
+    c->job = job;
+    c->job_body_cptr = job->body;
+    c->job_body_send = job->length + (c->binary ? 0 : 2);
+    c->bulk = 1;
+
+    c->state = mx_wevent_state;
+    c->wevent_handler = mx_send_job_handler;
+    c->phase = mx_send_job_header;
+
+    if (!c->wevent_set) {
+        ret = aeCreateFileEvent(mx_global->event, c->sock,
+             AE_WRITABLE, mx_event_process_handler, c);
+        if (ret != -1) {
+            c->wevent_set = 1;
+        }
+    }
+}
+
+
 mx_connection_t *mx_connection_create(int sock)
 {
     mx_connection_t *c;
@@ -689,6 +1342,16 @@ mx_connection_t *mx_connection_create(int sock)
         c->recvend = c->recvbuf + MX_RECVBUF_SIZE;
         c->sendbuf = c->recvend;
         c->sendend = c->sendbuf + MX_SENDBUF_SIZE;
+
+        /* grow when mdequeue/mtouch used */
+        c->jobs = NULL;
+        c->jobs_size = 0;
+        c->iov = NULL;
+        c->iov_hdr = NULL;
+        c->waiters = NULL;
+        c->waiters_size = 0;
+        c->any_key = NULL;
+        c->any_current = NULL;
     }
 
     c->sock = sock;
@@ -705,6 +1368,8 @@ mx_connection_t *mx_connection_create(int sock)
     c->job_body_read = 0;
     c->job_body_send = 0;
     c->phase = 0;
+    c->binary = 0;
+    c->request_id = 0;
 
     c->revent_handler = mx_read_request_handler;
     c->wevent_handler = NULL;
@@ -716,6 +1381,38 @@ mx_connection_t *mx_connection_create(int sock)
     c->recycle = 0;
     c->recycle_id = 0;
 
+    c->batch_remain = 0;
+    c->batch_ok = 0;
+    c->fanout = 0;
+    c->fanout_count = 0;
+
+    c->jobs_count = 0;
+    c->jobs_touch = 0;
+    c->iov_pos = 0;
+    c->iov_count = 0;
+
+    c->waiters_count = 0;
+    c->blocked = 0;
+    c->block_touch = 0;
+    c->send_name = 0;
+    c->moving = 0;
+    c->bulk = 0;
+
+    c->subscribe_name = NULL;
+    c->subscribe_parked = 0;
+    c->push = 0;
+    c->lua_task = NULL;
+    c->script = NULL;
+    c->slow_start = 0;
+    c->slow_running = 0;
+
+    /* round-robin state of last connection */
+    free(c->any_key);
+    c->any_key = NULL;
+
+    list_add(&c->link, &mx_global->connections);
+    mx_global->clients++;
+
     if (aeCreateFileEvent(mx_global->event, c->sock, 
            AE_READABLE, mx_event_process_handler, c) == -1)
     {
@@ -741,11 +1438,56 @@ void mx_connection_free(mx_connection_t *c)
         aeDeleteFileEvent(mx_global->event, c->sock, delete_event);
     close(c->sock);
 
+    list_del(&c->link);
+    mx_global->clients--;
+
+    if (c->blocked) {
+        mx_connection_unblock(c);
+    }
+
+    if (c->subscribe_parked) {
+        mx_subscribe_unpark(c);
+    }
+
+    free(c->subscribe_name);
+    c->subscribe_name = NULL;
+
+    if (c->lua_task) {
+        mx_lua_cancel(c);
+    }
+
+    free(c->script);
+    c->script = NULL;
+
+    if (c->bulk) {
+        free(c->job);
+        c->job = NULL;
+        c->bulk = 0;
+    }
+
+    /* the moved job must not be lost */
+    if (c->moving && c->job) {
+        mx_queue_insert(c->job->belong, c->job);
+        c->job = NULL;
+        c->moving = 0;
+    }
+
+    /* partly sent jobs were treated as sent */
+    if (c->jobs_count > 0) {
+        mx_release_jobs(c);
+    }
+
     if (mx_free_connections_count < MX_FREE_CONNECTIONS_MAX_SIZE) {
         c->next = mx_free_connections;
         mx_free_connections = c;
         mx_free_connections_count++;
     } else {
+        free(c->jobs);
+        free(c->iov);
+        free(c->iov_hdr);
+        free(c->waiters);
+        free(c->any_key);
+        free(c->any_current);
         free(c);
     }
 }
@@ -812,28 +1554,122 @@ void mx_connection_accept(aeEventLoop *eventLoop, int fd, void *data, int mask)
 }
 
 
-int mx_register_default_command()
+static void mx_signal_handler(int sig)
 {
-    mx_command_t *cmd;
-    int ret;
-    
-    for (cmd = mx_commands; cmd->name; cmd++) {
-        ret = hash_insert(mx_global->cmd_table, cmd->name, cmd);
-        if (ret == -1) {
-            return -1;
+    (void)sig;
+
+    /* the second signal skips waiting */
+    mx_shutdown_asap = mx_shutdown_asap ? 2 : 1;
+}
+
+
+/*
+ * Close the connection and keep its job when shutdown timeout,
+ * the job had been dequeued would be saved again
+ */
+static void mx_connection_abort(mx_connection_t *c)
+{
+    mx_job_t *job;
+    int i;
+
+    /* text of bulk reply is freed with the connection */
+    if (c->job && !c->bulk) {
+        if (c->state == mx_wevent_state && c->wevent_handler == mx_send_job_handler &&
+            c->job->belong)
+        {
+            if (mx_queue_insert(c->job->belong, c->job) != SKL_STATUS_OK) {
+                mx_job_free(c->job);
+            }
+        } else {
+            mx_job_free(c->job); /* job body hadn't been read */
+        }
+        c->job = NULL;
+    }
+
+    /* jobs of mdequeue/mtouch, strings of lua result have no queue */
+    for (i = 0; i < c->jobs_count; i++) {
+        job = c->jobs[i];
+        if (!job->belong || mx_queue_insert(job->belong, job) != SKL_STATUS_OK) {
+            mx_job_free(job);
+        }
+    }
+    c->jobs_count = 0;
+
+    mx_connection_free(c);
+}
+
+
+/*
+ * Stop accepting and wait for all replies to be sent.
+ * Return 0 when the event loop can be stopped
+ */
+int mx_prepare_shutdown(int force)
+{
+    struct list_head *pos, *next;
+    mx_connection_t *c;
+
+    if (!mx_global->shutdown) {
+        mx_write_log(mx_log_notice, "received shutdown signal, stop accepting connections");
+
+        aeDeleteFileEvent(mx_global->event, mx_global->sock, AE_READABLE);
+        close(mx_global->sock);
+        mx_global->sock = -1;
+
+        mx_global->shutdown = 1;
+        mx_global->shutdown_deadline = mx_current_time + MX_SHUTDOWN_TIMEOUT;
+    }
+
+    if (mx_current_time >= mx_global->shutdown_deadline) {
+        force = 1;
+    }
+
+    list_for_each_safe(pos, next, &mx_global->connections) {
+        c = list_entry(pos, mx_connection_t, link);
+
+        /* idle connection (no pending request and reply) */
+        if ((c->state == mx_revent_state &&
+             c->revent_handler == mx_read_request_handler &&
+             c->recvpos == c->recvlast) ||
+            (c->state == mx_blocking_state && !c->lua_task))
+        {
+            mx_connection_free(c);
+
+        } else if (force) {
+            mx_connection_abort(c);
         }
     }
+
+    if (mx_global->clients > 0) {
+        mx_write_log(mx_log_debug, "waiting for (%d)connections to finish",
+                     mx_global->clients);
+        return -1;
+    }
+
+    /* lua async call is running */
+    if (mx_global->lua_enable && mx_shutdown_asap < 2 && mx_lua_busy()) {
+        return -1;
+    }
+
     return 0;
 }
 
 
 int mx_core_timer(aeEventLoop *eventLoop, long long id, void *data)
 {
+    struct list_head *pos, *next;
+    mx_connection_t *c;
     mx_job_t *job;
     int ret;
 
     (void)time(&mx_current_time);
 
+    mx_stat_sample();
+
+    if (mx_shutdown_asap && mx_prepare_shutdown(mx_shutdown_asap > 1) == 0) {
+        aeStop(eventLoop);
+        return AE_NOMORE;
+    }
+
     /*
      * push timeout job into ready queue
      */
@@ -847,27 +1683,41 @@ int mx_core_timer(aeEventLoop *eventLoop, long long id, void *data)
         }
 
         job->timeout = 0;
-        mx_skiplist_insert(job->belong->list, job->prival, job);
         mx_skiplist_delete_top(mx_global->delay_queue);
+        mx_queue_insert(job->belong, job);
     }
 
     /*
      * free timeout recycle job
      */
-    while (!mx_skiplist_empty(mx_global->recycle_queue))
-    {
-        ret = mx_skiplist_find_top(mx_global->recycle_queue, (void **)&job);
-        if (ret == SKL_STATUS_KEY_NOT_FOUND ||
-            job->timeout > mx_current_time)
-        {
-            break;
-        }
+    mx_inflight_expire(mx_current_time);
 
-        mx_skiplist_delete_top(mx_global->recycle_queue);
-        mx_job_free(job);
+    /*
+     * free async results nobody fetched
+     */
+    if (mx_global->lua_enable) {
+        mx_lua_expire(mx_current_time);
+    }
+
+    /*
+     * blocking dequeue timeout
+     */
+    list_for_each_safe(pos, next, &mx_global->blocked) {
+        c = list_entry(pos, mx_connection_t, block_link);
+
+        /* wait timeout seconds at least */
+        if (c->block_deadline > 0 && c->block_deadline < mx_current_time) {
+            mx_connection_unblock(c);
+            mx_send_fail_reply(c, "timeout");
+        }
     }
 
     mx_try_bgsave_queues();
+
+    if (mx_global->arena_enable && mx_timer_calls % 10 == 0) {
+        mx_arena_sync();
+    }
+
     mx_timer_calls++;
 
     return 100;
@@ -976,12 +1826,6 @@ int mx_server_startup()
         goto failed;
     }
 
-    mx_global->cmd_table = hash_alloc(32);
-    if (!mx_global->cmd_table || mx_register_default_command() == -1) {
-        mx_write_log(mx_log_error, "failed to create command's table");
-        goto failed;
-    }
-
     mx_global->queue_table = hash_alloc(32);
     if (!mx_global->queue_table) {
         mx_write_log(mx_log_error, "failed to create queue's table");
@@ -994,12 +1838,36 @@ int mx_server_startup()
         goto failed;
     }
 
-    mx_global->recycle_queue = mx_skiplist_create(MX_SKIPLIST_MIN_TYPE);
-    if (!mx_global->recycle_queue) {
-        mx_write_log(mx_log_error, "failed to create recycle queue");
+    if (mx_inflight_init() == -1) {
+        mx_write_log(mx_log_error, "failed to create recycle table");
+        goto failed;
+    }
+
+    if (mx_slowlog_init(mx_global->slowlog_size) == -1) {
+        mx_write_log(mx_log_error, "failed to create slow log");
+        goto failed;
+    }
+
+    if (mx_global->spill_enable && mx_spill_init() == -1) {
+        mx_write_log(mx_log_error, "failed to initialize spill path `%s'",
+                     mx_global->spill_path);
         goto failed;
     }
 
+    if (mx_global->arena_enable) {
+        if (mx_global->spill_enable) {
+            mx_write_log(mx_log_error, "spill-over storage can not work with arena");
+            goto failed;
+        }
+
+        mx_global->arena_attached = mx_arena_init();
+        if (mx_global->arena_attached == -1) {
+            mx_write_log(mx_log_error, "failed to initialize arena `%s'",
+                         mx_global->arena_path);
+            goto failed;
+        }
+    }
+
     if (mx_global->auth_enable) {
         mx_global->auth_table = hash_alloc(16);
         if (!mx_global->auth_table || mx_create_auth_table() == -1) {
@@ -1023,31 +1891,19 @@ int mx_server_startup()
 
     aeCreateTimeEvent(mx_global->event, 1, mx_core_timer, NULL, NULL);
 
-    /* must be final */
-    if (mx_global->lua_enable) {
-        if (mx_lua_init(mx_global->lualib_file) == -1) {
-            mx_write_log(mx_log_error, "failed to create lua vm");
-            goto failed;
-        }
-    }
+    aeSetBeforeSleepProc(mx_global->event, mx_before_sleep);
+    aeSetAfterSleepProc(mx_global->event, mx_after_sleep);
+    mx_stat_sample_time = mx_clock_usec();
 
     return 0;
 
 
 failed:
 
-    if (mx_global->log) {
-        fclose(mx_global->log);
-    }
-
     if (mx_global->sock != -1) {
         close(mx_global->sock);
     }
 
-    if (mx_global->cmd_table) {
-        hash_destroy(mx_global->cmd_table, NULL);
-    }
-
     if (mx_global->queue_table) {
         hash_destroy(mx_global->queue_table, NULL);
     }
@@ -1056,9 +1912,9 @@ failed:
         mx_skiplist_destroy(mx_global->delay_queue, NULL);
     }
 
-    if (mx_global->recycle_queue) {
-        mx_skiplist_destroy(mx_global->recycle_queue, NULL);
-    }
+    mx_inflight_destroy(NULL);
+
+    mx_slowlog_destroy();
 
     if (mx_global->auth_table) {
         hash_destroy(mx_global->auth_table, free);
@@ -1066,6 +1922,8 @@ failed:
 
     mx_lua_close();
 
+    mx_arena_close();
+
     if (mx_global->event) {
         aeDeleteEventLoop(mx_global->event);
     }
@@ -1076,17 +1934,20 @@ failed:
 
 void mx_server_shutdown()
 {
-    fclose(mx_global->log);
+    /* keep jobs in arena, must before free queues */
+    mx_arena_close();
 
-    close(mx_global->sock);
-
-    hash_destroy(mx_global->cmd_table, NULL);
+    if (mx_global->sock != -1) {
+        close(mx_global->sock);
+    }
 
     hash_destroy(mx_global->queue_table, mx_queue_free);
 
     mx_skiplist_destroy(mx_global->delay_queue, mx_job_free);
 
-    mx_skiplist_destroy(mx_global->recycle_queue, mx_job_free);
+    mx_inflight_destroy(mx_job_free);
+
+    mx_slowlog_destroy();
 
     if (mx_global->auth_table) {
         hash_destroy(mx_global->auth_table, free);
@@ -1096,6 +1957,16 @@ void mx_server_shutdown()
 
     aeDeleteEventLoop(mx_global->event);
 
+    mx_write_log(mx_log_notice, "server exited");
+
+    /* no other threads left, drain the log ring */
+    mx_log_close();
+
+    if (mx_global->log) {
+        fclose(mx_global->log);
+        mx_global->log = NULL;
+    }
+
     return;
 }
 
@@ -1106,10 +1977,8 @@ void mx_default_init()
     mx_global->daemon_mode = 0;
     mx_global->port = MX_DEFAULT_PORT;
     mx_global->event = NULL;
-    mx_global->cmd_table = NULL;
     mx_global->queue_table = NULL;
     mx_global->delay_queue = NULL;
-    mx_global->recycle_queue = NULL;
 
     mx_global->bgsave_enable = 0;
     mx_global->bgsave_times = 300;
@@ -1117,19 +1986,48 @@ void mx_default_init()
     mx_global->bgsave_filepath = MX_DEFAULT_BGSAVE_PATH;
     mx_global->bgsave_pid = -1;
     mx_global->last_bgsave_time = time(NULL);
+    mx_global->bgsave_start = 0;
+    mx_global->last_bgsave_duration = 0;
+    mx_global->last_bgsave_status = 0;
     mx_global->dirty = 0;
     mx_global->outof_memory = 0;
 
     mx_global->last_recycle_id = 1;
     mx_global->recycle_timeout = MX_RECYCLE_TIMEOUT;
 
-    mx_global->auth_table = NULL;
+    mx_global->spill_enable = 0;
+    mx_global->spill_path = NULL;
+    mx_global->spill_threshold = (long)MX_DEFAULT_SPILL_THRESHOLD * 1024 * 1024;
+
+    mx_global->arena_enable = 0;
+    mx_global->arena_path = NULL;
+    mx_global->arena_size = (long)MX_DEFAULT_ARENA_SIZE * 1024 * 1024;
+    mx_global->arena_attached = 0;
+
+    mx_global->shutdown = 0;
+    mx_global->shutdown_deadline = 0;
+
+    INIT_LIST_HEAD(&mx_global->connections);
+    mx_global->clients = 0;
+    INIT_LIST_HEAD(&mx_global->blocked);
+
+    mx_global->auth_table = NULL;
     mx_global->auth_enable = 0;
     mx_global->auth_file = NULL;
 
     mx_global->lua_enable = 0;
     mx_global->lualib_file = NULL;
-    mx_global->lvm = NULL;
+    mx_global->lua_workers = MX_DEFAULT_LUA_WORKERS;
+    mx_global->lua_max_steps = 0;
+    mx_global->lua_timeout = MX_DEFAULT_LUA_TIMEOUT;
+    mx_global->lua_enqueue_hook = NULL;
+
+    mx_global->slowlog_threshold = MX_DEFAULT_SLOWLOG_THRESHOLD;
+    mx_global->slowlog_size = MX_DEFAULT_SLOWLOG_SIZE;
+
+    mx_global->start_time = time(NULL);
+    mx_global->stat_bytes_in = 0;
+    mx_global->stat_bytes_out = 0;
 
     mx_global->log = NULL;
     mx_global->log_path = MX_DEFAULT_LOG_PATH;
@@ -1149,10 +2047,20 @@ void mx_usage(void)
     printf("    --bgsave-changes <number>     how many data changes background save will take place.\n");
     printf("    --bgsave-path <path>          background save path.\n");
     printf("    --recycle-timeout <seconds>   how long the recycle job life.\n");
+    printf("    --spill-path <path>           enable spill-over storage and set segments directory.\n");
+    printf("    --spill-threshold <MB>        queue memory limit before spilling (default %d).\n", MX_DEFAULT_SPILL_THRESHOLD);
+    printf("    --arena-path <path>           keep jobs in a persistent memory mapped arena file.\n");
+    printf("    --arena-size <MB>             arena file size (default %d).\n", MX_DEFAULT_ARENA_SIZE);
     printf("    --log-path <path>             log save path.\n");
     printf("    --log-level <level>           log level (error|notice|debug).\n");
     printf("    --auth-file <path>            enable auth feature and set auth file path.\n");
     printf("    --lualib <path>               enable lua feature and lua library file path.\n");
+    printf("    --lua-workers <number>        threads running lua functions (default %d).\n", MX_DEFAULT_LUA_WORKERS);
+    printf("    --lua-max-steps <number>      instructions a lua call can run (default no limit).\n");
+    printf("    --lua-timeout <ms>            milliseconds a lua call can run, 0 is no limit (default %d).\n", MX_DEFAULT_LUA_TIMEOUT);
+    printf("    --lua-enqueue-hook <function> lua function to route or drop new jobs.\n");
+    printf("    --slowlog-threshold <us>      log commands slower than this, negative disables (default %d).\n", MX_DEFAULT_SLOWLOG_THRESHOLD);
+    printf("    --slowlog-size <number>       slow log entries kept (default %d).\n", MX_DEFAULT_SLOWLOG_SIZE);
     printf("    --version                     print this current version and exit.\n");
     printf("    --help                        print this help and exit.\n");
     return;
@@ -1176,10 +2084,20 @@ const struct option long_options[] = {
     {"bgsave-changes",  1, NULL, 'c'},
     {"bgsave-path",     1, NULL, 'P'},
     {"recycle-timeout", 1, NULL, 'r'},
+    {"spill-path",      1, NULL, 'S'},
+    {"spill-threshold", 1, NULL, 'T'},
+    {"arena-path",      1, NULL, 'A'},
+    {"arena-size",      1, NULL, 'Z'},
     {"log-path",        1, NULL, 'l'},
     {"log-level",       1, NULL, 'L'},
     {"auth-file",       1, NULL, 'a'},
     {"lualib",          1, NULL, 'f'},
+    {"lua-workers",     1, NULL, 'W'},
+    {"lua-max-steps",   1, NULL, 'I'},
+    {"lua-timeout",     1, NULL, 'O'},
+    {"lua-enqueue-hook", 1, NULL, 'H'},
+    {"slowlog-threshold", 1, NULL, 'g'},
+    {"slowlog-size",    1, NULL, 'G'},
     {NULL,              0, NULL, 0  }
 };
 
@@ -1220,6 +2138,44 @@ void mx_parse_options(int argc, char *argv[])
                 exit(-1);
             }
             break;
+        case 'S':
+            mx_global->spill_enable = 1;
+            mx_global->spill_path = strdup(optarg);
+            if (!mx_global->spill_path) {
+                fprintf(stderr, "[error] can not duplicate spill path.\n");
+                exit(-1);
+            }
+            break;
+        case 'T':
+        {
+            int threshold;
+
+            if (mx_atoi(optarg, &threshold) != 0 || threshold <= 0) {
+                fprintf(stderr, "[error] spill threshold is not a valid number.\n");
+                exit(-1);
+            }
+            mx_global->spill_threshold = (long)threshold * 1024 * 1024;
+            break;
+        }
+        case 'A':
+            mx_global->arena_enable = 1;
+            mx_global->arena_path = strdup(optarg);
+            if (!mx_global->arena_path) {
+                fprintf(stderr, "[error] can not duplicate arena path.\n");
+                exit(-1);
+            }
+            break;
+        case 'Z':
+        {
+            int size;
+
+            if (mx_atoi(optarg, &size) != 0 || size <= 0) {
+                fprintf(stderr, "[error] arena size is not a valid number.\n");
+                exit(-1);
+            }
+            mx_global->arena_size = (long)size * 1024 * 1024;
+            break;
+        }
         case 'c':
             if (mx_atoi(optarg, (int *)&mx_global->bgsave_changes) != 0) {
                 fprintf(stderr, "[error] bgsave changes is not a valid number.\n");
@@ -1268,6 +2224,51 @@ void mx_parse_options(int argc, char *argv[])
                 exit(-1);
             }
             break;
+        case 'W':
+            if (mx_atoi(optarg, &mx_global->lua_workers) != 0 ||
+                mx_global->lua_workers <= 0)
+            {
+                fprintf(stderr, "[error] lua workers is not a valid number.\n");
+                exit(-1);
+            }
+            break;
+        case 'I':
+            if (mx_atoi(optarg, &mx_global->lua_max_steps) != 0 ||
+                mx_global->lua_max_steps < 0)
+            {
+                fprintf(stderr, "[error] lua max steps is not a valid number.\n");
+                exit(-1);
+            }
+            break;
+        case 'O':
+            if (mx_atoi(optarg, &mx_global->lua_timeout) != 0 ||
+                mx_global->lua_timeout < 0)
+            {
+                fprintf(stderr, "[error] lua timeout is not a valid number.\n");
+                exit(-1);
+            }
+            break;
+        case 'H':
+            mx_global->lua_enqueue_hook = strdup(optarg);
+            if (!mx_global->lua_enqueue_hook) {
+                fprintf(stderr, "[error] can not duplicate lua enqueue hook.\n");
+                exit(-1);
+            }
+            break;
+        case 'g':
+            if (mx_atoi(optarg, &mx_global->slowlog_threshold) != 0) {
+                fprintf(stderr, "[error] slowlog threshold is not a valid number.\n");
+                exit(-1);
+            }
+            break;
+        case 'G':
+            if (mx_atoi(optarg, &mx_global->slowlog_size) != 0 ||
+                mx_global->slowlog_size <= 0)
+            {
+                fprintf(stderr, "[error] slowlog size is not a valid number.\n");
+                exit(-1);
+            }
+            break;
         default:
             exit(-1);
         }
@@ -1323,6 +2324,15 @@ int main(int argc, char *argv[])
         exit(-1);
     }
 
+    /* graceful shutdown */
+    sact.sa_handler = mx_signal_handler;
+    if (sigaction(SIGTERM, &sact, 0) == -1 ||
+        sigaction(SIGINT, &sact, 0) == -1)
+    {
+        fprintf(stderr, "[error] unable set SIGTERM handler.\n");
+        exit(-1);
+    }
+
     if (mx_server_startup() == -1) {
         mx_write_log(mx_log_error, "failed to initialization server environment");
         exit(-1);
@@ -1331,8 +2341,20 @@ int main(int argc, char *argv[])
     if (mx_global->daemon_mode) {
         mx_daemonize();
     }
-    
-    if (mx_global->bgsave_enable) {
+
+    /* the writer thread must be created after fork */
+    if (mx_log_init() == -1) {
+        exit(-1);
+    }
+
+    /* so do the lua worker threads */
+    if (mx_global->lua_enable && mx_lua_init(mx_global->lualib_file) == -1) {
+        mx_write_log(mx_log_error, "failed to create lua vm");
+        exit(-1);
+    }
+
+    /* an used arena is newer than the database file */
+    if (mx_global->bgsave_enable && !mx_global->arena_attached) {
         if (mx_load_queues() != 0) {
             exit(-1);
         }
@@ -1340,6 +2362,11 @@ int main(int argc, char *argv[])
 
     aeMain(mx_global->event);
 
+    /* all connections were closed, save the final snapshot */
+    if (mx_global->bgsave_enable) {
+        mx_save_queues();
+    }
+
     mx_server_shutdown();
 
     return 0;
@@ -1349,7 +2376,12 @@ int main(int argc, char *argv[])
 mx_queue_t *mx_queue_create(char *name, int name_len)
 {
     mx_queue_t *queue;
-    
+
+    /* longer name can't be saved to database file */
+    if (name_len <= 0 || name_len > MX_QUEUE_NAME_MAX) {
+        return NULL;
+    }
+
     queue = malloc(sizeof(*queue) + name_len + 1);
     if (queue) {
         queue->list = mx_skiplist_create(MX_SKIPLIST_MAX_TYPE);
@@ -1360,6 +2392,10 @@ mx_queue_t *mx_queue_create(char *name, int name_len)
         memcpy(queue->name, name, name_len);
         queue->name[name_len] = 0;
         queue->name_len = name_len;
+        queue->bytes = 0;
+        queue->spill = NULL;
+        queue->arena = mx_arena_queue_alloc(name, name_len);
+        INIT_LIST_HEAD(&queue->waiters);
 
     } else {
         mx_global->outof_memory++;
@@ -1372,197 +2408,688 @@ mx_queue_t *mx_queue_create(char *name, int name_len)
 void mx_queue_free(void *arg)
 {
     mx_queue_t *queue = (mx_queue_t *)arg;
+    mx_waiter_t *waiter;
+    mx_connection_t *c;
+
+    /* wake up the connections waiting for this queue */
+    while (!list_empty(&queue->waiters)) {
+        waiter = list_entry(queue->waiters.next, mx_waiter_t, link);
+        c = waiter->conn;
+
+        if (c->blocked) {
+            mx_connection_unblock(c);
+        } else { /* idle subscriber, the subscription is over */
+            mx_subscribe_unpark(c);
+            free(c->subscribe_name);
+            c->subscribe_name = NULL;
+            c->request_id = c->subscribe_id;
+        }
+
+        mx_send_fail_reply(c, "removed");
+    }
 
     mx_skiplist_destroy(queue->list, mx_job_free);
 
+    mx_spill_free(queue->spill);
+
+    if (queue->arena) {
+        mx_arena_free(queue->arena);
+    }
+
     free(queue);
 
     return;
 }
 
 
-mx_job_t *mx_job_create(mx_queue_t *belong, int prival, int delay, int length)
+/*
+ * Insert a ready job into queue (maybe spill it to disk)
+ */
+int mx_queue_insert(mx_queue_t *queue, mx_job_t *job)
 {
-    mx_job_t *job;
+    int ret;
+
+    if (mx_spill_need(queue, job) && mx_spill_push(queue, job) == 0) {
+        ret = SKL_STATUS_OK;
 
-    job = malloc(sizeof(*job) + length + 2); /* include CRLF */
-    if (job) {
-        job->belong = belong;
-        job->prival = prival;
-        job->length = length;
-        if (delay > 0) {
-            job->timeout = mx_current_time + delay;
-        } else {
-            job->timeout = 0;
-        }
     } else {
-        mx_global->outof_memory++;
+        ret = mx_skiplist_insert(queue->list, job->prival, job);
+        if (ret == SKL_STATUS_OK) {
+            queue->bytes += job->length;
+        }
     }
 
-    return job;
+    /* hand off the top job to the first waiting connection */
+    if (ret == SKL_STATUS_OK && !list_empty(&queue->waiters) &&
+        !mx_global->shutdown)
+    {
+        mx_queue_wakeup(queue);
+    }
+
+    return ret;
 }
 
 
-void mx_job_free(void *job)
+/*
+ * Get the top job of queue without removing it
+ */
+mx_job_t *mx_queue_top(mx_queue_t *queue)
 {
-    if (NULL != job) {
-        free(job);
-        mx_global->dirty++;
+    mx_job_t *job;
+
+    if (mx_skiplist_find_top(queue->list, (void **)&job) == SKL_STATUS_KEY_NOT_FOUND) {
+        if (!queue->spill || mx_spill_load(queue) <= 0 ||
+            mx_skiplist_find_top(queue->list, (void **)&job) == SKL_STATUS_KEY_NOT_FOUND)
+        {
+            return NULL;
+        }
     }
-    return;
+
+    return job;
 }
 
 
-void mx_send_job(mx_connection_t *c, mx_job_t *job)
+/*
+ * Pop the top job from queue, return NULL if queue empty
+ */
+mx_job_t *mx_queue_pop(mx_queue_t *queue)
 {
-    char buf[128];
-    int len, ret;
+    mx_job_t *job;
 
-    if (c->recycle) { /* the job need be recycle? send recycle id for connection */
-        len = sprintf(buf, "+OK %d %d" CRLF, c->recycle_id, job->length);
-    } else {
-        len = sprintf(buf, "+OK %d" CRLF, job->length);
+    if ((job = mx_queue_top(queue)) == NULL) {
+        return NULL;
     }
 
-    memcpy(c->sendlast, buf, len);
-
-    c->sendlast += len;
-
-    c->job = job;
-    c->job_body_cptr = job->body;
-    c->job_body_send = job->length + 2;
-
-    c->state = mx_wevent_state;
-    c->wevent_handler = mx_send_job_handler;
-    c->phase = mx_send_job_header;
+    mx_skiplist_delete_top(queue->list);
+    queue->bytes -= job->length;
 
-    if (!c->wevent_set) {
-        ret = aeCreateFileEvent(mx_global->event, c->sock, 
-             AE_WRITABLE, mx_event_process_handler, c);
-        if (ret != -1) {
-            c->wevent_set = 1;
-        }
+    /* read spilled jobs back when memory part drains */
+    if (queue->spill && queue->bytes < mx_global->spill_threshold / 2) {
+        mx_spill_load(queue);
     }
+
+    return job;
 }
 
 
-/* command's handlers */
+/*
+ * Pop the first job whose priority is in [min, max], jobs
+ * in spill segments are not considered
+ */
+mx_job_t *mx_queue_take(mx_queue_t *queue, int min, int max)
+{
+    mx_job_t *job;
 
-#define mx_failed_and_reply(execute, response)   \
-    do {                                         \
-        int ret;                                 \
-        ret = (execute);                         \
-        if (ret == 1) {                          \
-            mx_send_fail_reply(c, response);     \
-            return;                              \
-        }                                        \
-    } while(0)
+    if (mx_skiplist_delete_first(queue->list, max, min,
+          (void **)&job) != SKL_STATUS_OK)
+    {
+        return NULL;
+    }
 
+    queue->bytes -= job->length;
 
-void mx_command_ping_handler(mx_connection_t *c, mx_token_t *tokens)
-{
-    mx_send_ok_reply(c, "pong");
+    if (queue->spill && queue->bytes < mx_global->spill_threshold / 2) {
+        mx_spill_load(queue);
+    }
+
+    return job;
 }
 
 
-void mx_command_auth_handler(mx_connection_t *c, mx_token_t *tokens)
+int mx_queue_size(mx_queue_t *queue)
 {
-    char *pass;
-
-    mx_failed_and_reply(
-         hash_lookup(mx_global->auth_table, tokens[1].value, (void **)&pass) == -1 ||
-         strcmp(tokens[2].value, pass),
-        "denied"
-    );
-
-    c->reliable = 1; /* set connection reliable */
-    mx_send_ok_reply(c, "done");
-    return;
+    return mx_skiplist_size(queue->list) + mx_spill_jobs(queue);
 }
 
 
-void mx_command_enqueue_handler(mx_connection_t *c, mx_token_t *tokens)
+mx_job_t *mx_job_create(mx_queue_t *belong, int prival, int delay, int length)
 {
-    int prival, delay, size;
-    mx_queue_t *queue;
     mx_job_t *job;
-    int remain;
-
-    mx_failed_and_reply(
-        mx_atoi(tokens[2].value, &prival) == -1 ||
-        mx_atoi(tokens[3].value, &delay) == -1 ||
-        mx_atoi(tokens[4].value, &size) == -1,
-        "invaild"
-    );
 
-    if (hash_lookup(mx_global->queue_table, tokens[1].value, (void **)&queue) == -1) {
-
-        queue = mx_queue_create(tokens[1].value, tokens[1].length);
-        if (queue == NULL) {
-            goto discard_body;
-        }
+    if (mx_global->arena_enable) {
+        job = mx_arena_job_alloc(belong, length); /* NULL if arena full */
+    } else {
+        job = malloc(sizeof(*job) + length + 2); /* include CRLF */
+    }
 
-        if (hash_insert(mx_global->queue_table, tokens[1].value, queue) == -1) {
-            mx_queue_free(queue);
-            goto discard_body;
+    if (job) {
+        job->belong = belong;
+        job->prival = prival;
+        job->length = length;
+        job->shared = NULL;
+        job->body = job->data;
+        if (delay > 0) {
+            job->timeout = mx_current_time + delay;
+        } else {
+            job->timeout = 0;
         }
+    } else {
+        mx_global->outof_memory++;
     }
 
-    job = mx_job_create(queue, prival, delay, size);
-    if (job == NULL) {
-        goto discard_body;
+    return job;
+}
+
+
+/*
+ * Create a body can be shared by jobs, refcount is one
+ */
+mx_body_t *mx_body_create(int length)
+{
+    mx_body_t *body;
+
+    body = malloc(sizeof(*body) + length + 2); /* include CRLF */
+    if (!body) {
+        mx_global->outof_memory++;
+        return NULL;
     }
 
-    c->job = job;
-    c->job_body_cptr = job->body;       /* read begin position */
-    c->job_body_read = job->length + 2; /* crlf */
+    body->refcount = 1;
+    body->length = length;
+    body->save_gen = 0;
+    body->save_id = 0;
 
-    remain = c->recvlast - c->recvpos;
+    return body;
+}
 
-    if (remain > 0) {
-        int tocpy = remain > c->job_body_read ?
-                             c->job_body_read : remain;
 
-        memcpy(c->job_body_cptr, c->recvpos, tocpy);
+void mx_body_release(mx_body_t *body)
+{
+    if (--body->refcount == 0) {
+        free(body);
+    }
+}
 
-        c->job_body_cptr += tocpy;
-        c->job_body_read -= tocpy;
 
-        c->recvpos += tocpy; /* fix position */
+/*
+ * Create a job references the body, the body was copied if
+ * jobs live in the arena
+ */
+mx_job_t *mx_job_create_shared(mx_queue_t *belong, int prival, int delay,
+    mx_body_t *body)
+{
+    mx_job_t *job;
 
-        /* finish read job body */
-        if (c->job_body_read <= 0) {
-            mx_read_body_finish(c);
-            return;
+    if (mx_global->arena_enable) {
+        job = mx_job_create(belong, prival, delay, body->length);
+        if (job) {
+            memcpy(job->body, body->data, body->length + 2);
         }
+        return job;
     }
 
-    c->revent_handler = mx_read_body_handler;
-    return;
+    job = malloc(sizeof(*job));
+    if (!job) {
+        mx_global->outof_memory++;
+        return NULL;
+    }
 
+    job->belong = belong;
+    job->prival = prival;
+    job->length = body->length;
+    job->shared = body;
+    job->body = body->data;
+    if (delay > 0) {
+        job->timeout = mx_current_time + delay;
+    } else {
+        job->timeout = 0;
+    }
 
-discard_body:
+    body->refcount++;
 
-    c->job_body_read  = size + 2;
-    c->revent_handler = mx_discard_body_handler;
+    return job;
+}
 
-    remain = c->recvlast - c->recvpos;
 
-    if (remain > 0) {
-        int todelete = remain > c->job_body_read ?
-                                c->job_body_read : remain;
+void mx_job_free(void *arg)
+{
+    mx_job_t *job = arg;
 
-        c->job_body_read -= todelete;
-        c->recvpos += todelete;
+    if (NULL != job) {
+        if (job->shared) {
+            mx_body_release(job->shared);
+        }
 
-        if (c->job_body_read <= 0) {
-            c->revent_handler(c);
+        if (mx_arena_owned(job)) {
+            mx_arena_free(job);
+        } else {
+            free(job);
         }
+        mx_global->dirty++;
     }
     return;
 }
 
 
+void mx_deliver_job(mx_connection_t *c, mx_job_t *job, int touch)
+{
+    if (touch) {
+        c->recycle = 1;
+        c->recycle_id = mx_global->last_recycle_id++;
+    } else {
+        c->recycle = 0;
+        c->recycle_id = 0;
+    }
+
+    mx_send_job(c, job);
+}
+
+
+/*
+ * Park the connection on the waiter lists of queues
+ * until a job arrives or timeout
+ */
+int mx_connection_block(mx_connection_t *c, mx_queue_t **queues, int count,
+    int timeout, int touch)
+{
+    mx_waiter_t *waiters;
+    int i;
+
+    if (count > c->waiters_size) {
+        waiters = realloc(c->waiters, sizeof(mx_waiter_t) * count);
+        if (!waiters) {
+            return -1;
+        }
+        c->waiters = waiters;
+        c->waiters_size = count;
+    }
+
+    for (i = 0; i < count; i++) {
+        c->waiters[i].conn = c;
+        list_add_tail(&c->waiters[i].link, &queues[i]->waiters);
+    }
+
+    c->waiters_count = count;
+    c->block_deadline = timeout > 0 ? mx_current_time + timeout : 0;
+    c->block_touch = touch;
+    c->blocked = 1;
+
+    list_add_tail(&c->block_link, &mx_global->blocked);
+
+    c->revent_handler = mx_read_blocked_handler;
+
+    /* pending replies would be sent first */
+    if (c->state != mx_wevent_state) {
+        c->state = mx_blocking_state;
+    }
+
+    return 0;
+}
+
+
+void mx_connection_unblock(mx_connection_t *c)
+{
+    int i;
+
+    for (i = 0; i < c->waiters_count; i++) {
+        list_del(&c->waiters[i].link);
+    }
+
+    c->waiters_count = 0;
+    c->blocked = 0;
+
+    list_del(&c->block_link);
+
+    if (c->slow_start) { /* waiting isn't counted */
+        c->slow_mark = mx_clock_usec();
+    }
+
+    c->revent_handler = mx_read_request_handler;
+    if (c->state == mx_blocking_state) {
+        c->state = mx_revent_state;
+    }
+}
+
+
+/*
+ * Read pipelined requests of blocked connection,
+ * they would be processed after the job sent
+ */
+void mx_read_blocked_handler(mx_connection_t *c)
+{
+    int rsize, rbytes;
+
+    rsize = c->recvend - c->recvlast;
+    if (rsize == 0) {
+        mx_disable_read_event(c);
+        return;
+    }
+
+    rbytes = read(c->sock, c->recvlast, rsize);
+    if (rbytes == -1) {
+        if (errno != EAGAIN && errno != EWOULDBLOCK) {
+            mx_connection_free(c);
+        }
+        return;
+    } else if (rbytes == 0) {
+        mx_connection_free(c);
+        return;
+    }
+
+    mx_global->stat_bytes_in += rbytes;
+    c->recvlast += rbytes;
+}
+
+
+void mx_subscribe_unpark(mx_connection_t *c)
+{
+    list_del(&c->subscribe_waiter.link);
+    c->subscribe_parked = 0;
+}
+
+
+/*
+ * Push a job to the subscriber, framed as dequeue_any but
+ * begins with +PUSH (binary reply has subscribe's request id)
+ */
+static void mx_subscribe_push(mx_connection_t *c, mx_job_t *job)
+{
+    if (c->subscribe_parked) {
+        mx_subscribe_unpark(c);
+    }
+
+    c->credits--;
+    c->push = 1;
+    c->request_id = c->subscribe_id;
+
+    mx_deliver_job(c, job, c->subscribe_touch);
+}
+
+
+/*
+ * The subscriber is idle: push a job if it has credits,
+ * or park it on the queue until a job arrives
+ */
+void mx_subscribe_ready(mx_connection_t *c)
+{
+    mx_queue_t *queue;
+    mx_job_t *job;
+
+    if (!c->subscribe_name || c->subscribe_parked || c->credits <= 0 ||
+        c->state != mx_revent_state ||
+        c->revent_handler != mx_read_request_handler ||
+        mx_global->shutdown)
+    {
+        return;
+    }
+
+    queue = mx_queue_get(c->subscribe_name, c->subscribe_len);
+    if (queue == NULL) {
+        return;
+    }
+
+    if ((job = mx_queue_pop(queue)) != NULL) {
+        mx_subscribe_push(c, job);
+        return;
+    }
+
+    c->subscribe_waiter.conn = c;
+    list_add_tail(&c->subscribe_waiter.link, &queue->waiters);
+    c->subscribe_parked = 1;
+}
+
+
+void mx_queue_wakeup(mx_queue_t *queue)
+{
+    mx_waiter_t *waiter;
+    mx_connection_t *c;
+    mx_job_t *job;
+
+    waiter = list_entry(queue->waiters.next, mx_waiter_t, link);
+    c = waiter->conn;
+
+    if ((job = mx_queue_pop(queue)) == NULL) {
+        return;
+    }
+
+    if (!c->blocked) { /* parked subscriber */
+        mx_subscribe_push(c, job);
+        return;
+    }
+
+    mx_connection_unblock(c);
+    mx_deliver_job(c, job, c->block_touch);
+}
+
+
+void mx_send_job(mx_connection_t *c, mx_job_t *job)
+{
+    char buf[MX_SENDBUF_SIZE], *pos;
+    int len, nlen, ret;
+
+    c->slow_bytes += job->length;
+
+    if (c->binary) { /* <recycle_id> <name_len> <name> <body> */
+        nlen = (c->send_name || c->push) ? job->belong->name_len : 0;
+
+        if (MX_BINARY_HEADER_SIZE + 8 + nlen >= (int)sizeof(buf)) {
+            len = sizeof(buf);
+        } else {
+            pos = mx_binary_header(buf, 0, mx_binary_job, c->request_id,
+                                   8 + nlen + job->length);
+            pos = mx_binary_put32(pos, c->recycle ? c->recycle_id : 0);
+            pos = mx_binary_put32(pos, nlen);
+            memcpy(pos, job->belong->name, nlen);
+            len = pos + nlen - buf;
+        }
+
+    } else if (c->push) { /* pushed to subscriber */
+        if (c->recycle) {
+            len = snprintf(buf, sizeof(buf), "+PUSH %s %d %d" CRLF,
+                           job->belong->name, c->recycle_id, job->length);
+        } else {
+            len = snprintf(buf, sizeof(buf), "+PUSH %s %d" CRLF,
+                           job->belong->name, job->length);
+        }
+    } else if (c->send_name) { /* dequeue_any/touch_any tell which queue */
+        if (c->recycle) {
+            len = snprintf(buf, sizeof(buf), "+OK %s %d %d" CRLF,
+                           job->belong->name, c->recycle_id, job->length);
+        } else {
+            len = snprintf(buf, sizeof(buf), "+OK %s %d" CRLF,
+                           job->belong->name, job->length);
+        }
+    } else if (c->recycle) { /* the job need be recycle? send recycle id for connection */
+        len = sprintf(buf, "+OK %d %d" CRLF, c->recycle_id, job->length);
+    } else {
+        len = sprintf(buf, "+OK %d" CRLF, job->length);
+    }
+
+    if (len >= c->sendend - c->sendlast) {
+        mx_write_log(mx_log_notice,
+              "Output string too big, socket(%d)", c->sock);
+        mx_queue_insert(job->belong, job);
+        mx_send_fail_reply(c, "failed");
+        return;
+    }
+
+    memcpy(c->sendlast, buf, len);
+
+    c->sendlast += len;
+
+    c->job = job;
+    c->job_body_cptr = job->body;
+    c->job_body_send = job->length + (c->binary ? 0 : 2);
+
+    c->state = mx_wevent_state;
+    c->wevent_handler = mx_send_job_handler;
+    c->phase = mx_send_job_header;
+
+    if (!c->wevent_set) {
+        ret = aeCreateFileEvent(mx_global->event, c->sock, 
+             AE_WRITABLE, mx_event_process_handler, c);
+        if (ret != -1) {
+            c->wevent_set = 1;
+        }
+    }
+}
+
+
+/* command's handlers */
+
+#define mx_failed_and_reply(execute, response)   \
+    do {                                         \
+        int ret;                                 \
+        ret = (execute);                         \
+        if (ret == 1) {                          \
+            mx_send_fail_reply(c, response);     \
+            return;                              \
+        }                                        \
+    } while(0)
+
+
+void mx_command_ping_handler(mx_connection_t *c, mx_token_t *tokens)
+{
+    mx_send_ok_reply(c, "pong");
+}
+
+
+void mx_command_auth_handler(mx_connection_t *c, mx_token_t *tokens)
+{
+    char *pass;
+
+    mx_failed_and_reply(
+         hash_lookup(mx_global->auth_table, tokens[1].value, (void **)&pass) == -1 ||
+         strcmp(tokens[2].value, pass),
+        "denied"
+    );
+
+    c->reliable = 1; /* set connection reliable */
+    mx_send_ok_reply(c, "done");
+    return;
+}
+
+
+/*
+ * tokens: <queue> <prival> <delay> <size>
+ */
+void mx_enqueue_comm_handler(mx_connection_t *c, mx_token_t *tokens)
+{
+    int prival, delay, size;
+    mx_queue_t *queue;
+    mx_body_t *body;
+    mx_job_t *job;
+    int remain;
+
+    if (mx_token_int(&tokens[1], &prival) == -1 ||
+        mx_token_int(&tokens[2], &delay) == -1 ||
+        mx_token_int(&tokens[3], &size) == -1)
+    {
+        /* can't find the next job of menqueue, give up */
+        c->batch_remain = 0;
+        c->batch_ok = 0;
+        c->fanout = 0;
+        c->fanout_count = 0;
+        c->revent_handler = mx_read_request_handler;
+        mx_send_fail_reply(c, "invaild");
+        return;
+    }
+
+    if (hash_lookup(mx_global->queue_table, tokens[0].value, (void **)&queue) == -1) {
+
+        queue = mx_queue_create(tokens[0].value, tokens[0].length);
+        if (queue == NULL) {
+            goto discard_body;
+        }
+
+        if (hash_insert(mx_global->queue_table, tokens[0].value, queue) == -1) {
+            mx_queue_free(queue);
+            goto discard_body;
+        }
+    }
+
+    if (c->fanout && !mx_global->arena_enable) {
+        body = mx_body_create(size);
+        if (body == NULL) {
+            goto discard_body;
+        }
+        job = mx_job_create_shared(queue, prival, delay, body);
+        mx_body_release(body); /* the job holds it */
+    } else {
+        job = mx_job_create(queue, prival, delay, size);
+    }
+
+    if (job == NULL) {
+        goto discard_body;
+    }
+
+    c->job = job;
+    c->job_body_cptr = job->body;       /* read begin position */
+    c->job_body_read = job->length + (c->binary ? 0 : 2); /* crlf */
+
+    remain = c->recvlast - c->recvpos;
+
+    if (remain > 0) {
+        int tocpy = remain > c->job_body_read ?
+                             c->job_body_read : remain;
+
+        memcpy(c->job_body_cptr, c->recvpos, tocpy);
+
+        c->job_body_cptr += tocpy;
+        c->job_body_read -= tocpy;
+
+        c->recvpos += tocpy; /* fix position */
+    }
+
+    /* finish read job body */
+    if (c->job_body_read <= 0) {
+        mx_read_body_finish(c);
+        return;
+    }
+
+    c->revent_handler = mx_read_body_handler;
+    return;
+
+
+discard_body:
+
+    c->job_body_read  = size + (c->binary ? 0 : 2);
+    c->revent_handler = mx_discard_body_handler;
+
+    remain = c->recvlast - c->recvpos;
+
+    if (remain > 0) {
+        int todelete = remain > c->job_body_read ?
+                                c->job_body_read : remain;
+
+        c->job_body_read -= todelete;
+        c->recvpos += todelete;
+    }
+
+    if (c->job_body_read <= 0) {
+        c->revent_handler(c);
+    }
+    return;
+}
+
+
+void mx_command_enqueue_handler(mx_connection_t *c, mx_token_t *tokens)
+{
+    mx_enqueue_comm_handler(c, tokens + 1);
+}
+
+
+/*
+ * menqueue <count>\r\n
+ * <queue> <prival> <delay> <size>\r\n<body>\r\n ... (count times)
+ */
+void mx_command_menqueue_handler(mx_connection_t *c, mx_token_t *tokens)
+{
+    int count;
+
+    mx_failed_and_reply(
+        mx_token_int(&tokens[1], &count) == -1 || count <= 0,
+        "invaild"
+    );
+
+    c->batch_remain = count;
+    c->batch_ok = 0;
+    c->revent_handler = mx_read_batch_handler;
+
+    mx_process_batch(c);
+}
+
+
 void mx_dequeue_comm_handler(mx_connection_t *c, char *name, int touch)
 {
     mx_queue_t *queue;
@@ -1570,241 +3097,1331 @@ void mx_dequeue_comm_handler(mx_connection_t *c, char *name, int touch)
 
     mx_failed_and_reply(
         hash_lookup(mx_global->queue_table, name, (void **)&queue) == -1 ||
-        mx_skiplist_find_top(queue->list, (void **)&job) == SKL_STATUS_KEY_NOT_FOUND,
+        (job = mx_queue_pop(queue)) == NULL,
+        "failed"
+    );
+
+    c->send_name = 0;
+    mx_deliver_job(c, job, touch);
+
+    return;
+}
+
+
+void mx_command_dequeue_handler(mx_connection_t *c, mx_token_t *tokens)
+{
+    mx_dequeue_comm_handler(c, tokens[1].value, 0);
+}
+
+
+void mx_command_touch_handler(mx_connection_t *c, mx_token_t *tokens)
+{
+    mx_dequeue_comm_handler(c, tokens[1].value, 1);
+}
+
+
+/*
+ * Find the queue, create it if not exists
+ */
+mx_queue_t *mx_queue_get(char *name, int name_len)
+{
+    mx_queue_t *queue;
+
+    if (hash_lookup(mx_global->queue_table, name, (void **)&queue) == 0) {
+        return queue;
+    }
+
+    queue = mx_queue_create(name, name_len);
+    if (queue == NULL) {
+        return NULL;
+    }
+
+    if (hash_insert(mx_global->queue_table, name, queue) == -1) {
+        mx_queue_free(queue);
+        return NULL;
+    }
+
+    return queue;
+}
+
+
+/*
+ * Dequeue a job, wait timeout seconds (zero is forever) if queue empty
+ */
+void mx_bdequeue_comm_handler(mx_connection_t *c, mx_token_t *tokens, int touch)
+{
+    mx_queue_t *queue;
+    mx_job_t *job;
+    int timeout;
+
+    mx_failed_and_reply(
+        mx_token_int(&tokens[2], &timeout) == -1 || timeout < 0,
+        "invaild"
+    );
+
+    mx_failed_and_reply(
+        (queue = mx_queue_get(tokens[1].value, tokens[1].length)) == NULL,
+        "failed"
+    );
+
+    c->send_name = 0;
+
+    if ((job = mx_queue_pop(queue)) != NULL) {
+        mx_deliver_job(c, job, touch);
+        return;
+    }
+
+    mx_failed_and_reply(
+        mx_connection_block(c, &queue, 1, timeout, touch) == -1,
+        "failed"
+    );
+}
+
+
+void mx_command_bdequeue_handler(mx_connection_t *c, mx_token_t *tokens)
+{
+    mx_bdequeue_comm_handler(c, tokens, 0);
+}
+
+
+void mx_command_btouch_handler(mx_connection_t *c, mx_token_t *tokens)
+{
+    mx_bdequeue_comm_handler(c, tokens, 1);
+}
+
+
+/*
+ * Reset round-robin state when the queue list changed
+ */
+static int mx_dequeue_any_prepare(mx_connection_t *c, char *key, int count)
+{
+    int *current;
+
+    if (c->any_key && strcmp(c->any_key, key) == 0) {
+        return 0;
+    }
+
+    current = realloc(c->any_current, sizeof(int) * count);
+    if (!current) {
+        return -1;
+    }
+    c->any_current = current;
+    memset(c->any_current, 0, sizeof(int) * count);
+
+    free(c->any_key);
+    if (!(c->any_key = malloc(strlen(key) + 1))) {
+        return -1;
+    }
+    strcpy(c->any_key, key);
+
+    return 0;
+}
+
+
+/*
+ * <timeout> <queue>[:<weight>] ...
+ * Smooth weighted round-robin when weights given, otherwise
+ * take the first queue has jobs in order. Block on all queues
+ * if they are empty
+ */
+void mx_dequeue_any_comm_handler(mx_connection_t *c, mx_token_t *tokens, int touch)
+{
+    mx_queue_t *queues[MX_MAX_TOKENS];
+    int weights[MX_MAX_TOKENS];
+    char key[MX_RECVBUF_SIZE];
+    int timeout, count = 0, weighted = 0, klen = 0;
+    int best = -1, total = 0, i;
+    char *sep;
+    mx_job_t *job;
+
+    mx_failed_and_reply(
+        !tokens[1].value || !tokens[2].value ||
+        mx_token_int(&tokens[1], &timeout) == -1 || timeout < 0,
+        "invaild"
+    );
+
+    for (i = 2; tokens[i].value; i++, count++) {
+
+        memcpy(key + klen, tokens[i].value, tokens[i].length);
+        klen += tokens[i].length;
+        key[klen++] = ' ';
+
+        weights[count] = 1;
+
+        if ((sep = strchr(tokens[i].value, ':')) != NULL) {
+            *sep = 0;
+            mx_failed_and_reply(
+                mx_atoi(sep + 1, &weights[count]) == -1 || weights[count] <= 0,
+                "invaild"
+            );
+            weighted = 1;
+        }
+
+        mx_failed_and_reply(
+            (queues[count] = mx_queue_get(tokens[i].value,
+                                          strlen(tokens[i].value))) == NULL,
+            "failed"
+        );
+    }
+
+    key[klen] = 0;
+
+    mx_failed_and_reply(
+        weighted && mx_dequeue_any_prepare(c, key, count) == -1,
+        "failed"
+    );
+
+    for (i = 0; i < count; i++) {
+        if (mx_queue_top(queues[i]) == NULL) {
+            continue;
+        }
+
+        if (!weighted) { /* strict order */
+            best = i;
+            break;
+        }
+
+        c->any_current[i] += weights[i];
+        total += weights[i];
+
+        if (best == -1 || c->any_current[i] > c->any_current[best]) {
+            best = i;
+        }
+    }
+
+    c->send_name = 1;
+
+    if (best != -1) {
+        if (weighted) {
+            c->any_current[best] -= total;
+        }
+
+        job = mx_queue_pop(queues[best]);
+        mx_deliver_job(c, job, touch);
+        return;
+    }
+
+    mx_failed_and_reply(
+        mx_connection_block(c, queues, count, timeout, touch) == -1,
+        "failed"
+    );
+}
+
+
+/*
+ * move <src> <dst> <count>|get [<min_prival> <max_prival>]
+ *
+ * Relink up to count jobs (in the priority range if given) from src
+ * to dst without copy, reply +OK <moved>. With `get', move one job
+ * and reply it like dequeue, the job enter dst after it was sent.
+ */
+void mx_command_move_handler(mx_connection_t *c, mx_token_t *tokens)
+{
+    mx_queue_t *src, *dst;
+    int count, min = 0, max = 0, range = 0, get = 0, moved = 0;
+    mx_job_t *job;
+    char sndbuf[32];
+
+    mx_failed_and_reply(
+        !tokens[1].value || !tokens[2].value || !tokens[3].value ||
+        !strcmp(tokens[1].value, tokens[2].value),
+        "invaild"
+    );
+
+    if (!tokens[3].is_integer && !strcmp(tokens[3].value, "get")) {
+        get = 1;
+        count = 1;
+    } else {
+        mx_failed_and_reply(
+            mx_token_int(&tokens[3], &count) == -1 || count <= 0,
+            "invaild"
+        );
+    }
+
+    if (tokens[4].value) {
+        mx_failed_and_reply(
+            !tokens[5].value || tokens[6].value ||
+            mx_token_int(&tokens[4], &min) == -1 ||
+            mx_token_int(&tokens[5], &max) == -1 || min > max,
+            "invaild"
+        );
+        range = 1;
+    }
+
+    mx_failed_and_reply(
+        hash_lookup(mx_global->queue_table, tokens[1].value, (void **)&src) == -1 ||
+        (dst = mx_queue_get(tokens[2].value, tokens[2].length)) == NULL,
+        "failed"
+    );
+
+    while (moved < count) {
+        job = range ? mx_queue_take(src, min, max) : mx_queue_pop(src);
+        if (job == NULL) {
+            break;
+        }
+
+        job->belong = dst;
+        mx_arena_job_move(job, dst);
+
+        if (get) {
+            c->moving = 1;
+            c->send_name = 0;
+            mx_global->dirty++;
+            mx_deliver_job(c, job, 0);
+            return;
+        }
+
+        if (mx_queue_insert(dst, job) != SKL_STATUS_OK) {
+            job->belong = src; /* give it back */
+            mx_arena_job_move(job, src);
+            if (mx_queue_insert(src, job) != SKL_STATUS_OK) {
+                mx_job_free(job);
+            }
+            break;
+        }
+
+        moved++;
+    }
+
+    mx_failed_and_reply(get, "failed"); /* nothing to get */
+
+    if (moved > 0) {
+        mx_global->dirty++;
+    }
+
+    sprintf(sndbuf, "%d", moved);
+    mx_send_ok_reply(c, sndbuf);
+}
+
+
+/*
+ * Enqueue a job to several queues, the queues share one body
+ */
+void mx_command_fanout_handler(mx_connection_t *c, mx_token_t *tokens)
+{
+    mx_token_t args[4];
+    mx_queue_t *queue;
+    int i;
+
+    mx_failed_and_reply(
+        !tokens[1].value || !tokens[2].value || !tokens[3].value ||
+        !tokens[4].value,
+        "invaild"
+    );
+
+    c->fanout_count = 0;
+
+    for (i = 5; tokens[i].value; i++) {
+        queue = mx_queue_get(tokens[i].value, tokens[i].length);
+        if (queue) {
+            c->fanout_queues[c->fanout_count++] = queue;
+        }
+    }
+
+    /* the first queue is the one of enqueue command */
+    args[0] = tokens[4];
+    args[1] = tokens[1];
+    args[2] = tokens[2];
+    args[3] = tokens[3];
+
+    c->fanout = 1;
+
+    mx_enqueue_comm_handler(c, args);
+}
+
+
+/*
+ * subscribe <queue> <prefetch> [touch]: push jobs of queue when they
+ * arrive, at most prefetch jobs are pushed without credits returned
+ */
+void mx_command_subscribe_handler(mx_connection_t *c, mx_token_t *tokens)
+{
+    int prefetch, touch = 0;
+    char *name;
+
+    mx_failed_and_reply(
+        !tokens[1].value || !tokens[2].value ||
+        tokens[1].length > MX_QUEUE_NAME_MAX ||
+        mx_token_int(&tokens[2], &prefetch) == -1 || prefetch <= 0,
+        "invaild"
+    );
+
+    if (tokens[3].value) {
+        mx_failed_and_reply(
+            tokens[4].value || tokens[3].is_integer ||
+            strcmp(tokens[3].value, "touch"),
+            "invaild"
+        );
+        touch = 1;
+    }
+
+    mx_failed_and_reply(
+        (name = malloc(tokens[1].length + 1)) == NULL,
+        "failed"
+    );
+
+    memcpy(name, tokens[1].value, tokens[1].length + 1);
+
+    free(c->subscribe_name);
+
+    c->subscribe_name = name;
+    c->subscribe_len = tokens[1].length;
+    c->subscribe_id = c->request_id;
+    c->subscribe_touch = touch;
+    c->prefetch = prefetch;
+    c->credits = prefetch;
+
+    /* pushing starts after the reply was sent */
+    mx_send_ok_reply(c, "subscribed");
+}
+
+
+void mx_command_unsubscribe_handler(mx_connection_t *c, mx_token_t *tokens)
+{
+    (void)tokens;
+
+    free(c->subscribe_name);
+    c->subscribe_name = NULL;
+
+    mx_send_ok_reply(c, "unsubscribed");
+}
+
+
+/*
+ * credit <count>: subscriber can take count more jobs (up to prefetch)
+ */
+void mx_command_credit_handler(mx_connection_t *c, mx_token_t *tokens)
+{
+    char sndbuf[32];
+    int count;
+
+    mx_failed_and_reply(
+        mx_token_int(&tokens[1], &count) == -1 || count <= 0,
+        "invaild"
+    );
+
+    mx_failed_and_reply(!c->subscribe_name, "failed");
+
+    c->credits += count;
+    if (c->credits > c->prefetch) {
+        c->credits = c->prefetch;
+    }
+
+    sprintf(sndbuf, "%d", c->credits);
+    mx_send_ok_reply(c, sndbuf);
+}
+
+
+void mx_command_dequeue_any_handler(mx_connection_t *c, mx_token_t *tokens)
+{
+    mx_dequeue_any_comm_handler(c, tokens, 0);
+}
+
+
+void mx_command_touch_any_handler(mx_connection_t *c, mx_token_t *tokens)
+{
+    mx_dequeue_any_comm_handler(c, tokens, 1);
+}
+
+
+static int mx_connection_reserve_jobs(mx_connection_t *c, int count)
+{
+    void *ptr;
+
+    if (count <= c->jobs_size) {
+        return 0;
+    }
+
+    if (!(ptr = realloc(c->jobs, sizeof(mx_job_t *) * count))) {
+        return -1;
+    }
+    c->jobs = ptr;
+
+    if (!(ptr = realloc(c->iov, sizeof(struct iovec) * (count * 2 + 1)))) {
+        return -1;
+    }
+    c->iov = ptr;
+
+    if (!(ptr = realloc(c->iov_hdr, MX_JOB_HEADER_SIZE * count))) {
+        return -1;
+    }
+    c->iov_hdr = ptr;
+
+    c->jobs_size = count;
+
+    return 0;
+}
+
+
+/*
+ * Reply the jobs of c->jobs like mdequeue/mtouch, bytes is the total
+ * length of bodies. The jobs are released after sent
+ */
+static void mx_send_jobs(mx_connection_t *c, int bytes)
+{
+    mx_job_t *job;
+    char *hdr;
+    int touch = c->jobs_touch, len, i, ret;
+
+    c->slow_bytes += bytes;
+
+    /* reply header follows the pending replies */
+    if (c->binary) { /* <count> (<recycle_id> <length> <body>) ... */
+        c->sendlast = mx_binary_header(c->sendlast, 0, mx_binary_jobs,
+               c->request_id, 4 + c->jobs_count * 8 + bytes);
+        c->sendlast = mx_binary_put32(c->sendlast, c->jobs_count);
+    } else {
+        c->sendlast += sprintf(c->sendlast, "+OK %d" CRLF, c->jobs_count);
+    }
+
+    c->iov[0].iov_base = c->sendpos;
+    c->iov[0].iov_len = c->sendlast - c->sendpos;
+
+    for (i = 0; i < c->jobs_count; i++) {
+        job = c->jobs[i];
+        hdr = c->iov_hdr + i * MX_JOB_HEADER_SIZE;
+
+        if (c->binary) {
+            mx_binary_put32(hdr, touch ? c->jobs_recycle_id + i : 0);
+            mx_binary_put32(hdr + 4, job->length);
+            len = 8;
+        } else if (touch) {
+            len = sprintf(hdr, "%d %d" CRLF, c->jobs_recycle_id + i, job->length);
+        } else {
+            len = sprintf(hdr, "%d" CRLF, job->length);
+        }
+
+        c->iov[i * 2 + 1].iov_base = hdr;
+        c->iov[i * 2 + 1].iov_len = len;
+        c->iov[i * 2 + 2].iov_base = job->body;
+        c->iov[i * 2 + 2].iov_len = job->length + (c->binary ? 0 : 2); /* include CRLF */
+    }
+
+    c->iov_pos = 0;
+    c->iov_count = c->jobs_count * 2 + 1;
+
+    c->state = mx_wevent_state;
+    c->wevent_handler = mx_send_jobs_handler;
+
+    if (!c->wevent_set) {
+        ret = aeCreateFileEvent(mx_global->event, c->sock,
+              AE_WRITABLE, mx_event_process_handler, c);
+        if (ret == 0) {
+            c->wevent_set = 1;
+        }
+    }
+}
+
+
+/*
+ * Pop up to count jobs (and up to max_bytes if not zero), reply:
+ * +OK <count>\r\n
+ * [<recycle_id> ]<length>\r\n<body>\r\n ...
+ */
+void mx_mdequeue_comm_handler(mx_connection_t *c, char *name,
+    int count, int max_bytes, int touch, int lease)
+{
+    mx_queue_t *queue;
+    mx_job_t *job;
+    int bytes = 0;
+
+    if (count > MX_MAX_BATCH_JOBS) {
+        count = MX_MAX_BATCH_JOBS;
+    }
+
+    mx_failed_and_reply(
+        hash_lookup(mx_global->queue_table, name, (void **)&queue) == -1 ||
+        mx_queue_top(queue) == NULL,
+        "failed"
+    );
+
+    mx_failed_and_reply(
+        mx_connection_reserve_jobs(c, count) == -1 ||
+        c->sendend - c->sendlast < 32,
         "failed"
     );
 
+    c->jobs_count = 0;
+
+    while (c->jobs_count < count && (job = mx_queue_top(queue)) != NULL) {
+
+        /* return one job at least */
+        if (max_bytes > 0 && c->jobs_count > 0 &&
+            bytes + job->length > max_bytes)
+        {
+            break;
+        }
+
+        mx_queue_pop(queue);
+
+        c->jobs[c->jobs_count++] = job;
+        bytes += job->length;
+    }
+
+    c->jobs_touch = touch;
+    c->jobs_lease = lease;
+    c->jobs_recycle_id = 0;
+
     if (touch) {
-        c->recycle = 1;
-        c->recycle_id = mx_global->last_recycle_id++;
-	} else {
-        c->recycle = 0;
-        c->recycle_id = 0;
+        c->jobs_recycle_id = mx_global->last_recycle_id;
+        mx_global->last_recycle_id += c->jobs_count;
+    }
+
+    mx_send_jobs(c, bytes);
+}
+
+
+/*
+ * mdequeue <queue> <count> [<max_bytes>]
+ */
+void mx_command_mdequeue_handler(mx_connection_t *c, mx_token_t *tokens)
+{
+    int count, max_bytes = 0;
+
+    mx_failed_and_reply(
+        !tokens[1].value || !tokens[2].value ||
+        mx_token_int(&tokens[2], &count) == -1 || count <= 0 ||
+        (tokens[3].value && (mx_token_int(&tokens[3], &max_bytes) == -1 ||
+                             tokens[4].value)),
+        "invaild"
+    );
+
+    mx_mdequeue_comm_handler(c, tokens[1].value, count, max_bytes, 0, 0);
+}
+
+
+/*
+ * mtouch <queue> <count> <lease> [<max_bytes>]
+ */
+void mx_command_mtouch_handler(mx_connection_t *c, mx_token_t *tokens)
+{
+    int count, lease, max_bytes = 0;
+
+    mx_failed_and_reply(
+        !tokens[1].value || !tokens[2].value || !tokens[3].value ||
+        mx_token_int(&tokens[2], &count) == -1 || count <= 0 ||
+        mx_token_int(&tokens[3], &lease) == -1 ||
+        (tokens[4].value && (mx_token_int(&tokens[4], &max_bytes) == -1 ||
+                             tokens[5].value)),
+        "invaild"
+    );
+
+    if (lease <= 0) {
+        lease = mx_global->recycle_timeout;
+    }
+
+    mx_mdequeue_comm_handler(c, tokens[1].value, count, max_bytes, 1, lease);
+}
+
+
+/*
+ * Put a job taken from recycle table back to its queue
+ */
+static int mx_job_requeue(mx_job_t *job, int delay)
+{
+    mx_arena_job_recycle(job, 0);
+
+    if (delay > 0) {
+        job->timeout = mx_current_time + delay;
+        return mx_skiplist_insert(mx_global->delay_queue, job->timeout, job);
+    }
+
+    job->timeout = 0;
+    return mx_queue_insert(job->belong, job);
+}
+
+
+void mx_command_recycle_handler(mx_connection_t *c, mx_token_t *tokens)
+{
+    int recycle_id, prival, delay;
+    mx_job_t *job;
+
+    mx_failed_and_reply(
+        mx_token_int(&tokens[1], &recycle_id) == -1 ||
+        mx_token_int(&tokens[2], &prival) == -1 ||
+        mx_token_int(&tokens[3], &delay) == -1,
+        "invaild"
+    );
+
+    mx_failed_and_reply(
+        (job = mx_inflight_remove(recycle_id)) == NULL,
+        "failed"
+    );
+
+    job->prival = prival;
+
+    if (mx_job_requeue(job, delay) == SKL_STATUS_OK) {
+        mx_send_ok_reply(c, "recycled");
+    } else {
+        mx_send_fail_reply(c, "failed");
+        mx_job_free(job);
+    }
+
+    return;
+}
+
+
+/*
+ * ack <recycle_id>: the job was processed, free it now
+ */
+/*
+ * A touched job was confirmed, give back the credit of subscriber
+ */
+static void mx_subscribe_credit(mx_connection_t *c)
+{
+    if (c->subscribe_name && c->subscribe_touch && c->credits < c->prefetch) {
+        c->credits++;
+    }
+}
+
+
+void mx_command_ack_handler(mx_connection_t *c, mx_token_t *tokens)
+{
+    int recycle_id;
+    mx_job_t *job;
+
+    mx_failed_and_reply(
+        mx_token_int(&tokens[1], &recycle_id) == -1,
+        "invaild"
+    );
+
+    mx_failed_and_reply(
+        (job = mx_inflight_remove(recycle_id)) == NULL,
+        "failed"
+    );
+
+    mx_job_free(job);
+    mx_global->dirty++;
+
+    mx_subscribe_credit(c);
+    mx_send_ok_reply(c, "acked");
+}
+
+
+/*
+ * nack <recycle_id> <delay>: requeue the job with its priority
+ */
+void mx_command_nack_handler(mx_connection_t *c, mx_token_t *tokens)
+{
+    int recycle_id, delay;
+    mx_job_t *job;
+
+    mx_failed_and_reply(
+        mx_token_int(&tokens[1], &recycle_id) == -1 ||
+        mx_token_int(&tokens[2], &delay) == -1,
+        "invaild"
+    );
+
+    mx_failed_and_reply(
+        (job = mx_inflight_remove(recycle_id)) == NULL,
+        "failed"
+    );
+
+    if (mx_job_requeue(job, delay) == SKL_STATUS_OK) {
+        mx_global->dirty++;
+        mx_subscribe_credit(c);
+        mx_send_ok_reply(c, "nacked");
+    } else {
+        mx_send_fail_reply(c, "failed");
+        mx_job_free(job);
+    }
+}
+
+
+/*
+ * extend <recycle_id> <seconds>: lease the job for more seconds from now
+ */
+void mx_command_extend_handler(mx_connection_t *c, mx_token_t *tokens)
+{
+    int recycle_id, seconds;
+
+    mx_failed_and_reply(
+        mx_token_int(&tokens[1], &recycle_id) == -1 ||
+        mx_token_int(&tokens[2], &seconds) == -1 || seconds <= 0,
+        "invaild"
+    );
+
+    mx_failed_and_reply(
+        mx_inflight_extend(recycle_id, mx_current_time + seconds) == -1,
+        "failed"
+    );
+
+    mx_send_ok_reply(c, "extended");
+}
+
+
+void mx_command_remove_handler(mx_connection_t *c, mx_token_t *tokens)
+{
+    mx_queue_t *queue;
+
+    mx_failed_and_reply(
+        hash_remove(mx_global->queue_table, tokens[1].value, (void **)&queue) == -1,
+        "failed"
+    );
+
+    mx_queue_free(queue);
+    mx_send_ok_reply(c, "removed");
+
+    return;
+}
+
+
+void mx_command_size_handler(mx_connection_t *c, mx_token_t *tokens)
+{
+    mx_queue_t *queue;
+    char sndbuf[32];
+
+    mx_failed_and_reply(
+        hash_lookup(mx_global->queue_table, tokens[1].value, (void **)&queue) == -1,
+        "failed"
+    );
+
+    sprintf(sndbuf, "%d", mx_queue_size(queue));
+    mx_send_ok_reply(c, sndbuf);
+
+    return;
+}
+
+
+/*
+ * Check arguments of exec and async: <function> <params> <args> ...
+ */
+static int mx_lua_check_args(mx_token_t *tokens, int *params)
+{
+    int i;
+
+    if (!tokens[1].value || !tokens[2].value ||
+        mx_token_int(&tokens[2], params) == -1 || *params < 0)
+    {
+        return -1;
     }
 
-    mx_send_job(c, job);
-    mx_skiplist_delete_top(queue->list);
+    for (i = 0; i < *params; i++) {
+        if (!tokens[i+3].value) {
+            return -1;
+        }
+    }
 
-    return;
+    return tokens[i+3].value ? -1 : 0;
 }
 
 
-void mx_command_dequeue_handler(mx_connection_t *c, mx_token_t *tokens)
+/*
+ * The function was called by a Lua worker, the connection waits
+ * for the reply like a blocking dequeue
+ */
+void mx_command_exec_handler(mx_connection_t *c, mx_token_t *tokens)
 {
-    mx_dequeue_comm_handler(c, tokens[1].value, 0);
+    int params;
+
+    mx_failed_and_reply(!mx_global->lua_enable, "disable");
+
+    mx_failed_and_reply(mx_lua_check_args(tokens, &params) == -1, "invaild");
+
+    mx_failed_and_reply(mx_lua_submit(c, tokens, params, 0) == -1, "failed");
+
+    c->revent_handler = mx_read_blocked_handler;
+
+    /* pending replies would be sent first */
+    if (c->state != mx_wevent_state) {
+        c->state = mx_blocking_state;
+    }
 }
 
 
-void mx_command_touch_handler(mx_connection_t *c, mx_token_t *tokens)
+void mx_exec_done(mx_connection_t *c, mx_lua_result_t *result)
 {
-    mx_dequeue_comm_handler(c, tokens[1].value, 1);
+    if (c->slow_start) { /* time of workers isn't counted */
+        c->slow_mark = mx_clock_usec();
+    }
+
+    c->revent_handler = mx_read_request_handler;
+    if (c->state == mx_blocking_state) {
+        c->state = mx_revent_state;
+    }
+
+    mx_send_lua_result(c, result);
 }
 
 
-void mx_command_recycle_handler(mx_connection_t *c, mx_token_t *tokens)
+/*
+ * Reply the result of Lua call, the text and jobs are freed:
+ * true is +OK done, a number is +OK <number>, a string is replied
+ * like a bulk text and an array like mdequeue
+ */
+void mx_send_lua_result(mx_connection_t *c, mx_lua_result_t *result)
 {
-    int recycle_id, prival, delay;
-    mx_job_t *job;
-    int ret;
+    int bytes = 0, i;
 
-    mx_failed_and_reply(
-        mx_atoi(tokens[1].value, &recycle_id) == -1 ||
-        mx_atoi(tokens[2].value, &prival) == -1 ||
-        mx_atoi(tokens[3].value, &delay) == -1,
-        "invaild"
-    );
+    switch (result->status) {
+    case mx_lua_done:
+        mx_send_ok_reply(c, "done");
+        break;
+    case mx_lua_exceeded:
+        mx_send_fail_reply(c, "exceeded");
+        break;
+    case mx_lua_number:
+        mx_send_ok_reply(c, result->text);
+        break;
+    case mx_lua_string:
+        mx_send_bulk_reply(c, result->text, result->length);
+        break;
+    case mx_lua_array:
+        /* iov of header is needed even if empty */
+        if (mx_connection_reserve_jobs(c, result->count ? result->count : 1) == -1 ||
+            c->sendend - c->sendlast < 32)
+        {
+            mx_send_fail_reply(c, "failed");
+            break;
+        }
 
-    mx_failed_and_reply(
-        mx_skiplist_delete_key(mx_global->recycle_queue,
-              recycle_id, (void **)&job) == SKL_STATUS_KEY_NOT_FOUND,
-        "failed"
-    );
+        for (i = 0; i < result->count; i++) {
+            c->jobs[i] = result->jobs[i];
+            bytes += result->jobs[i]->length;
+        }
 
-    job->prival = prival;
-    if (delay > 0) {
-        job->timeout = mx_current_time + delay;
-        ret = mx_skiplist_insert(mx_global->delay_queue, job->timeout, job);
-    } else {
-    	job->timeout = 0;
-    	ret = mx_skiplist_insert(job->belong->list, job->prival, job);
-    }
+        c->jobs_count = result->count;
+        c->jobs_touch = 0;
+        c->jobs_recycle_id = 0;
+        result->count = 0;  /* released after sent */
 
-    if (ret == SKL_STATUS_OK) {
-        mx_send_ok_reply(c, "recycled");
-    } else {
+        mx_send_jobs(c, bytes);
+        break;
+    default:
         mx_send_fail_reply(c, "failed");
-        mx_job_free(job);
+        break;
     }
 
-    return;
+    for (i = 0; i < result->count; i++) {
+        mx_job_free(result->jobs[i]);
+    }
+
+    free(result->text);
+    free(result->jobs);
 }
 
 
-void mx_command_remove_handler(mx_connection_t *c, mx_token_t *tokens)
+/*
+ * Don't wait for the function, reply the handle to fetch the result
+ */
+void mx_command_async_handler(mx_connection_t *c, mx_token_t *tokens)
 {
-    mx_queue_t *queue;
+    char sndbuf[32];
+    int params, handle;
 
-    mx_failed_and_reply(
-        hash_remove(mx_global->queue_table, tokens[1].value, (void **)&queue) == -1,
-        "failed"
-    );
+    mx_failed_and_reply(!mx_global->lua_enable, "disable");
 
-    mx_queue_free(queue);
-    mx_send_ok_reply(c, "removed");
+    mx_failed_and_reply(mx_lua_check_args(tokens, &params) == -1, "invaild");
 
-    return;
+    handle = mx_lua_submit(c, tokens, params, 1);
+
+    mx_failed_and_reply(handle == -1, "failed");
+
+    sprintf(sndbuf, "%d", handle);
+
+    mx_send_ok_reply(c, sndbuf);
 }
 
 
-void mx_command_size_handler(mx_connection_t *c, mx_token_t *tokens)
+/*
+ * result <handle>
+ *
+ * Reply the result of async call like exec, -ERR pending if the call
+ * haven't finished. A result can be fetched once in 60 seconds
+ */
+void mx_command_result_handler(mx_connection_t *c, mx_token_t *tokens)
 {
-    mx_queue_t *queue;
-    char sndbuf[32];
+    mx_lua_result_t result;
+    int handle, found;
 
-    mx_failed_and_reply(
-        hash_lookup(mx_global->queue_table, tokens[1].value, (void **)&queue) == -1,
-        "failed"
-    );
+    mx_failed_and_reply(!mx_global->lua_enable, "disable");
 
-    sprintf(sndbuf, "%d", mx_skiplist_size(queue->list));
-    mx_send_ok_reply(c, sndbuf);
+    mx_failed_and_reply(mx_token_int(&tokens[1], &handle) == -1, "invaild");
 
-    return;
+    found = mx_lua_fetch(handle, &result);
+
+    mx_failed_and_reply(found == -1, "failed");
+    mx_failed_and_reply(found == 0, "pending");
+
+    mx_send_lua_result(c, &result);
 }
 
 
-void mx_command_exec_handler(mx_connection_t *c, mx_token_t *tokens)
+/*
+ * slowlog get [count] | slowlog len | slowlog reset
+ */
+void mx_command_slowlog_handler(mx_connection_t *c, mx_token_t *tokens)
 {
-    int params, i, index;
-    int retval;
+    char sndbuf[32], *text;
+    int count = 0, size;
 
-    if (!mx_global->lua_enable) {
-        mx_send_fail_reply(c, "disable");
+    mx_failed_and_reply(!tokens[1].value, "invaild");
+
+    if (!strcmp(tokens[1].value, "len") && !tokens[2].value) {
+        sprintf(sndbuf, "%d", mx_slowlog_len());
+        mx_send_ok_reply(c, sndbuf);
         return;
     }
 
-    /* try to get lvm lock */
-    if (pthread_mutex_trylock(&mx_global->lvm_lock) != 0) {
-        mx_send_fail_reply(c, "locked");
+    if (!strcmp(tokens[1].value, "reset") && !tokens[2].value) {
+        mx_slowlog_reset();
+        mx_send_ok_reply(c, "done");
         return;
     }
 
     mx_failed_and_reply(
-        mx_atoi(tokens[2].value, &params) == -1,
+        strcmp(tokens[1].value, "get") || (tokens[2].value && (tokens[3].value ||
+        mx_token_int(&tokens[2], &count) == -1 || count <= 0)),
         "invaild"
     );
 
-    lua_getglobal(mx_global->lvm, tokens[1].value);
+    text = mx_slowlog_get(count, &size);
+    mx_failed_and_reply(text == NULL, "failed");
+    mx_send_bulk_reply(c, text, size);
+    free(text);
+}
+
+
+/* state of queue lines while walking queue table */
+static char *mx_info_pos;
+static long mx_info_size;
+static long mx_info_job_bytes;
+
+
+static int mx_info_queue_size(char *key, int length, void *value)
+{
+    mx_queue_t *queue = value;
+
+    (void)key;
+    (void)length;
+
+    mx_info_size += queue->name_len + 96;
+    mx_info_job_bytes += queue->bytes;
+
+    return 0;
+}
+
 
-    /* push params to stack */
-    for (i = 0; i < params; i++) {
-        index = i + 3;
-        lua_pushlstring(mx_global->lvm, tokens[index].value,
-                                        tokens[index].length);
+static int mx_info_queue(char *key, int length, void *value)
+{
+    mx_queue_t *queue = value;
+
+    (void)key;
+    (void)length;
+
+    mx_info_pos += sprintf(mx_info_pos, "queue name=%.*s jobs=%d spilled=%d bytes=%ld\n",
+                           queue->name_len, queue->name, mx_queue_size(queue),
+                           mx_spill_jobs(queue), queue->bytes);
+    return 0;
+}
+
+
+static long mx_info_rss()
+{
+    FILE *fp;
+    long pages = 0;
+
+    fp = fopen("/proc/self/statm", "r");
+    if (!fp) {
+        return 0;
     }
 
-    retval = lua_pcall(mx_global->lvm, params, 1, 0);
-    if (retval != 0) {
-        mx_write_log(mx_log_notice, "failed to call function `%s', error: %s\n",
-                tokens[1].value, lua_tostring(mx_global->lvm, -1));
-        mx_send_fail_reply(c, "failed");
-        return;
+    if (fscanf(fp, "%*d %ld", &pages) != 1) {
+        pages = 0;
     }
 
-    if (!lua_isboolean(mx_global->lvm, -1)) {
-        mx_send_fail_reply(c, "failed");
-        return;
+    fclose(fp);
+
+    return pages * sysconf(_SC_PAGESIZE);
+}
+
+
+static int mx_info_want(char *section, char *name)
+{
+    return !section || !strcmp(section, name);
+}
+
+
+/*
+ * info [section], one line of "section key=value ..." per item,
+ * only the lines of section are replied if given
+ */
+void mx_command_info_handler(mx_connection_t *c, mx_token_t *tokens)
+{
+    struct list_head *pos;
+    struct rusage usage;
+    char *text, *section = tokens[1].value;
+    long long calls = 0;
+    long lines, dropped;
+    int ops = 0, blocked = 0, i;
+
+    mx_failed_and_reply(section && tokens[2].value, "invaild");
+
+    mx_info_size = 2048 + mx_op_count * 96;
+    mx_info_job_bytes = 0;
+
+    hash_foreach(mx_global->queue_table, mx_info_queue_size);
+
+    text = malloc(mx_info_size);
+    mx_failed_and_reply(text == NULL, "failed");
+
+    mx_info_pos = text;
+    *mx_info_pos = 0;
+
+    if (mx_info_want(section, "server")) {
+        mx_info_pos += sprintf(mx_info_pos,
+            "server version=%s pid=%d uptime=%ld lua=%d arena=%d spill=%d\n",
+            MX_VERSION, (int)getpid(), (long)(mx_current_time - mx_global->start_time),
+            mx_global->lua_enable, mx_global->arena_enable, mx_global->spill_enable);
     }
 
-    retval = lua_toboolean(mx_global->lvm, -1);
+    if (mx_info_want(section, "clients")) {
+        list_for_each(pos, &mx_global->blocked) {
+            blocked++;
+        }
 
-    switch (retval) {
-    case 0:
-        mx_send_fail_reply(c, "failed");
-        break;
-    default:
-        mx_send_ok_reply(c, "done");
-        break;
+        mx_info_pos += sprintf(mx_info_pos, "clients connected=%d blocked=%d\n",
+                               mx_global->clients, blocked);
     }
 
-    lua_pop(mx_global->lvm, 1); /* clean stack */
+    if (mx_info_want(section, "net")) {
+        mx_info_pos += sprintf(mx_info_pos, "net bytes_in=%lld bytes_out=%lld\n",
+                               mx_global->stat_bytes_in, mx_global->stat_bytes_out);
+    }
 
-    pthread_mutex_unlock(&mx_global->lvm_lock);
+    for (i = 0; i < mx_op_count; i++) {
+        calls += mx_global->stat_commands[i];
+        ops += mx_stat_ops_sec[i];
+    }
 
-    return;
+    if (mx_info_want(section, "ops")) {
+        mx_info_pos += sprintf(mx_info_pos, "ops calls=%lld per_sec=%d\n", calls, ops);
+    }
+
+    if (mx_info_want(section, "command")) {
+        for (i = 0; i < mx_op_count; i++) {
+            if (mx_global->stat_commands[i] == 0) {
+                continue;
+            }
+            mx_info_pos += sprintf(mx_info_pos, "command name=%s calls=%lld per_sec=%d\n",
+                                   mx_commands[i].name, mx_global->stat_commands[i],
+                                   mx_stat_ops_sec[i]);
+        }
+    }
+
+    if (mx_info_want(section, "queue")) {
+        hash_foreach(mx_global->queue_table, mx_info_queue);
+    }
+
+    if (mx_info_want(section, "delay")) {
+        mx_info_pos += sprintf(mx_info_pos, "delay jobs=%d\n",
+                               mx_skiplist_size(mx_global->delay_queue));
+    }
+
+    if (mx_info_want(section, "recycle")) {
+        mx_info_pos += sprintf(mx_info_pos, "recycle jobs=%d\n", mx_inflight_jobs());
+    }
+
+    if (mx_info_want(section, "memory")) {
+        getrusage(RUSAGE_SELF, &usage);
+
+        mx_info_pos += sprintf(mx_info_pos,
+            "memory rss=%ld peak_rss=%ld job_bytes=%ld outof_memory=%d\n",
+            mx_info_rss(), usage.ru_maxrss * 1024L, mx_info_job_bytes,
+            mx_global->outof_memory);
+    }
+
+    if (mx_info_want(section, "persistence")) {
+        mx_info_pos += sprintf(mx_info_pos,
+            "persistence bgsave=%d in_progress=%d running_ms=%lld dirty=%d "
+            "last_save_time=%ld last_status=%s last_duration_ms=%lld\n",
+            mx_global->bgsave_enable, mx_global->bgsave_pid != -1,
+            mx_global->bgsave_pid != -1 ?
+                (mx_clock_usec() - mx_global->bgsave_start) / 1000 : 0,
+            mx_global->dirty, (long)mx_global->last_bgsave_time,
+            mx_global->last_bgsave_status == 0 ? "ok" : "failed",
+            mx_global->last_bgsave_duration / 1000);
+    }
+
+    if (mx_info_want(section, "loop")) {
+        mx_info_pos += sprintf(mx_info_pos,
+            "loop iterations_per_sec=%d busy_avg_us=%d busy_max_us=%d\n",
+            mx_loop_per_sec, mx_loop_avg_us, mx_loop_max_us);
+    }
+
+    if (mx_info_want(section, "log")) {
+        mx_log_stats(&lines, &dropped);
+        mx_info_pos += sprintf(mx_info_pos, "log lines=%ld dropped=%ld slowlog=%d\n",
+                               lines, dropped, mx_slowlog_len());
+    }
+
+    mx_send_bulk_reply(c, text, mx_info_pos - text);
+    free(text);
 }
 
 
-void *mx_lua_async_handler(void *arg)
+static void mx_script_load_finish(mx_connection_t *c)
 {
-    int params = (int)arg;
-    char nil = '\0';
+    char sha[MX_SHA1_HEX_SIZE + 1];
     int ret;
 
-    /* here had get the lvm lock */
+    ret = !c->binary && (c->script[c->script_len] != CR_CHR ||
+                         c->script[c->script_len+1] != LF_CHR);
 
-    ret = lua_pcall(mx_global->lvm, params, 1, 0); /* slowly call */
+    if (!ret) {
+        ret = mx_lua_script_load(c->script, c->script_len, sha) == -1 ? 2 : 0;
+    }
+
+    free(c->script);
+
+    c->script = NULL;
+    c->job_body_cptr = NULL;
+    c->job_body_read = 0;
+    c->revent_handler = mx_read_request_handler;
 
-    if (ret != 0) {
-        mx_write_log(mx_log_notice, "failed to call async function, error: %s\n",
-              lua_tostring(mx_global->lvm, -1));
-        goto complete;
+    switch (ret) {
+    case 0:
+        mx_send_ok_reply(c, sha);
+        break;
+    case 1:
+        mx_send_fail_reply(c, "invaild");
+        break;
+    default:
+        mx_send_fail_reply(c, "failed");
+        break;
     }
+}
+
+
+static void mx_read_script_handler(mx_connection_t *c)
+{
+    int rbytes;
+
+    rbytes = read(c->sock, c->job_body_cptr, c->job_body_read);
+
+    if (rbytes == -1) {
+        if (errno != EAGAIN && errno != EWOULDBLOCK) {
+            mx_connection_free(c);
+        }
+        return;
 
-    if (!lua_isboolean(mx_global->lvm, -1)) {
-        goto complete;
+    } else if (rbytes == 0) {
+        mx_connection_free(c);
+        return;
     }
 
-    (void)lua_toboolean(mx_global->lvm, -1); /* ignore return value */
-    lua_pop(mx_global->lvm, 1);              /* clean return stack */
+    mx_global->stat_bytes_in += rbytes;
+    c->job_body_cptr += rbytes;
+    c->job_body_read -= rbytes;
 
-complete:
-    write(mx_global->lvm_pipe[1], &nil, 1); /* notify main thread unlock lvm */
-    return NULL;
+    if (c->job_body_read <= 0) {
+        mx_script_load_finish(c);
+    }
 }
 
 
-void mx_command_async_handler(mx_connection_t *c, mx_token_t *tokens)
+/*
+ * script load <size>\r\n<chunk>\r\n
+ * script flush
+ * script reload
+ * script stats [reset]
+ * script hook <function>|off
+ *
+ * The chunk is called by its SHA1 digest: exec <sha1> <params> ...,
+ * arguments are passed as `...'. Reload runs the lualib file again.
+ * Stats reply the calls and latency of every function as bulk text.
+ * Hook sets the function of lualib called before new jobs inserted
+ */
+void mx_command_script_handler(mx_connection_t *c, mx_token_t *tokens)
 {
-    pthread_t tid;
-    int params, i, index;
-    int ret;
+    int size, remain;
+    char *text;
+
+    mx_failed_and_reply(!mx_global->lua_enable, "disable");
+
+    mx_failed_and_reply(!tokens[1].value, "invaild");
+
+    if (!strcmp(tokens[1].value, "flush") && !tokens[2].value) {
+        mx_lua_script_flush();
+        mx_send_ok_reply(c, "done");
+        return;
+    }
+
+    if (!strcmp(tokens[1].value, "reload") && !tokens[2].value) {
+        mx_failed_and_reply(mx_lua_script_reload() == -1, "failed");
+        mx_send_ok_reply(c, "done");
+        return;
+    }
 
-    if (!mx_global->lua_enable) {
-        mx_send_fail_reply(c, "disable");
+    if (!strcmp(tokens[1].value, "stats") && !tokens[2].value) {
+        text = mx_lua_stats(&size);
+        mx_failed_and_reply(text == NULL, "failed");
+        mx_send_bulk_reply(c, text, size);
+        free(text);
         return;
     }
 
-    /* try to get lvm lock */
-    if (pthread_mutex_trylock(&mx_global->lvm_lock) != 0) {
-        mx_send_fail_reply(c, "locked");
+    if (!strcmp(tokens[1].value, "stats") && !strcmp(tokens[2].value, "reset") &&
+        !tokens[3].value)
+    {
+        mx_lua_stats_reset();
+        mx_send_ok_reply(c, "done");
+        return;
+    }
+
+    if (!strcmp(tokens[1].value, "hook") && tokens[2].value && !tokens[3].value) {
+        mx_failed_and_reply(mx_lua_hook_set(strcmp(tokens[2].value, "off") ?
+                                            tokens[2].value : NULL) == -1, "failed");
+        mx_send_ok_reply(c, "done");
         return;
     }
 
     mx_failed_and_reply(
-        mx_atoi(tokens[2].value, &params) == -1,
+        strcmp(tokens[1].value, "load") || !tokens[2].value || tokens[3].value ||
+        mx_token_int(&tokens[2], &size) == -1 || size <= 0,
         "invaild"
     );
 
-    lua_getglobal(mx_global->lvm, tokens[1].value);
+    c->script = malloc(size + 2);
+    if (c->script == NULL) {
+        c->job_body_read  = size + (c->binary ? 0 : 2);
+        c->revent_handler = mx_discard_body_handler;
+
+        remain = c->recvlast - c->recvpos;
+        if (remain > 0) {
+            remain = remain > c->job_body_read ? c->job_body_read : remain;
+            c->job_body_read -= remain;
+            c->recvpos += remain;
+        }
 
-    /* push params to stack */
-    for (i = 0; i < params; i++) {
-        index = i + 3;
-        lua_pushlstring(mx_global->lvm, tokens[index].value,
-                                        tokens[index].length);
+        if (c->job_body_read <= 0) {
+            c->revent_handler(c);
+        }
+        return;
     }
 
-    ret = pthread_create(&tid, NULL, mx_lua_async_handler, (void *)params);
-    if (ret != 0) {
-        mx_send_fail_reply(c, "failed");
-    } else {
-        mx_send_ok_reply(c, "done");
-        pthread_detach(tid);
+    c->job_body_cptr = c->script;
+    c->job_body_read = size + (c->binary ? 0 : 2); /* crlf */
+    c->script_len = size;
+
+    remain = c->recvlast - c->recvpos;
+
+    if (remain > 0) {
+        int tocpy = remain > c->job_body_read ?
+                             c->job_body_read : remain;
+
+        memcpy(c->job_body_cptr, c->recvpos, tocpy);
+
+        c->job_body_cptr += tocpy;
+        c->job_body_read -= tocpy;
+
+        c->recvpos += tocpy;
     }
 
-    /* don't unlock lvm lock, because thread would unlock it */
+    if (c->job_body_read <= 0) {
+        mx_script_load_finish(c);
+        return;
+    }
 
-    return;
+    c->revent_handler = mx_read_script_handler;
 }
-
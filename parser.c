@@ -0,0 +1,160 @@
+/*
+ * Copyright (c) 2012 - 2013, YukChung Lee <liexusong@qq.com>
+ * All rights reserved.
+ *  __   __  __   __         _______  __   __  _______  __   __  _______  ______
+ * |  |_|  ||  |_|  |       |       ||  | |  ||       ||  | |  ||       ||      |
+ * |       ||       | ____  |   _   ||  | |  ||    ___||  | |  ||    ___||  _    |
+ * |       ||       ||____| |  | |  ||  |_|  ||   |___ |  |_|  ||   |___ | | |   |
+ * |       | |     |        |  |_|  ||       ||    ___||       ||    ___|| |_|   |
+ * | ||_|| ||   _   |       |      | |       ||   |___ |       ||   |___ |       |
+ * |_|   |_||__| |__|       |____||_||_______||_______||_______||_______||______|
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/*
+ * Request line parsing.
+ *
+ * The command name is dispatched by a switch on its length and first
+ * characters, every case has only one candidate to compare, so no hashing
+ * is needed. Tokenizer splits arguments with memchr and stops when the
+ * command got all its arguments.
+ */
+
+#include <string.h>
+#include "global.h"
+
+
+#define mx_opcode_match(str, op)  \
+    (memcmp(name, str, sizeof(str) - 1) == 0 ? (op) : -1)
+
+
+/*
+ * Find opcode of the command name, return -1 if not found.
+ * Keep in sync with mx_commands when add new command.
+ */
+int mx_command_opcode(char *name, int length)
+{
+    switch (length) {
+    case 3:
+        return mx_opcode_match("ack", mx_op_ack);
+    case 4:
+        switch (name[0]) {
+        case 'p': return mx_opcode_match("ping", mx_op_ping);
+        case 'a': return mx_opcode_match("auth", mx_op_auth);
+        case 's': return mx_opcode_match("size", mx_op_size);
+        case 'e': return mx_opcode_match("exec", mx_op_exec);
+        case 'n': return mx_opcode_match("nack", mx_op_nack);
+        case 'm': return mx_opcode_match("move", mx_op_move);
+        case 'i': return mx_opcode_match("info", mx_op_info);
+        }
+        break;
+    case 5:
+        switch (name[0]) {
+        case 't': return mx_opcode_match("touch", mx_op_touch);
+        case 'a': return mx_opcode_match("async", mx_op_async);
+        }
+        break;
+    case 6:
+        switch (name[0]) {
+        case 'm': return mx_opcode_match("mtouch", mx_op_mtouch);
+        case 'b': return mx_opcode_match("btouch", mx_op_btouch);
+        case 'r': /* remove or result */
+            switch (name[2]) {
+            case 'm': return mx_opcode_match("remove", mx_op_remove);
+            case 's': return mx_opcode_match("result", mx_op_result);
+            }
+            break;
+        case 'e': return mx_opcode_match("extend", mx_op_extend);
+        case 'f': return mx_opcode_match("fanout", mx_op_fanout);
+        case 'c': return mx_opcode_match("credit", mx_op_credit);
+        case 's': return mx_opcode_match("script", mx_op_script);
+        }
+        break;
+    case 7:
+        switch (name[0]) {
+        case 'e': return mx_opcode_match("enqueue", mx_op_enqueue);
+        case 'd': return mx_opcode_match("dequeue", mx_op_dequeue);
+        case 'r': return mx_opcode_match("recycle", mx_op_recycle);
+        case 's': return mx_opcode_match("slowlog", mx_op_slowlog);
+        }
+        break;
+    case 8:
+        switch (name[1]) {
+        case 'e': return mx_opcode_match("menqueue", mx_op_menqueue);
+        case 'd': /* mdequeue or bdequeue */
+            switch (name[0]) {
+            case 'm': return mx_opcode_match("mdequeue", mx_op_mdequeue);
+            case 'b': return mx_opcode_match("bdequeue", mx_op_bdequeue);
+            }
+            break;
+        }
+        break;
+    case 9:
+        switch (name[0]) {
+        case 't': return mx_opcode_match("touch_any", mx_op_touch_any);
+        case 's': return mx_opcode_match("subscribe", mx_op_subscribe);
+        }
+        break;
+    case 11:
+        switch (name[0]) {
+        case 'd': return mx_opcode_match("dequeue_any", mx_op_dequeue_any);
+        case 'u': return mx_opcode_match("unsubscribe", mx_op_unsubscribe);
+        }
+        break;
+    }
+
+    return -1;
+}
+
+
+/*
+ * Split at most max tokens from *pos to end (where must be zero),
+ * the tokens are terminated in place. *pos is moved to the first
+ * character not parsed, equals to end if no more tokens.
+ */
+int mx_tokenize_command(char **pos, char *end, mx_token_t *tokens, int max)
+{
+    char *s = *pos, *e;
+    int ntokens = 0;
+
+    for (;;) {
+        while (*s == ' ') {
+            s++;
+        }
+
+        if (s >= end || ntokens >= max) {
+            break;
+        }
+
+        e = memchr(s, ' ', end - s);
+        if (NULL == e) {
+            e = end;
+        }
+
+        tokens[ntokens].value = s;
+        tokens[ntokens].length = e - s;
+        tokens[ntokens].is_integer = 0;
+        ntokens++;
+
+        *e = 0;
+        s = e < end ? e + 1 : end;
+    }
+
+    *pos = s;
+
+    return ntokens;
+}
@@ -0,0 +1,263 @@
+/*
+ * Copyright (c) 2012 - 2013, YukChung Lee <liexusong@qq.com>
+ * All rights reserved.
+ *  __   __  __   __         _______  __   __  _______  __   __  _______  ______
+ * |  |_|  ||  |_|  |       |       ||  | |  ||       ||  | |  ||       ||      |
+ * |       ||       | ____  |   _   ||  | |  ||    ___||  | |  ||    ___||  _    |
+ * |       ||       ||____| |  | |  ||  |_|  ||   |___ |  |_|  ||   |___ | | |   |
+ * |       | |     |        |  |_|  ||       ||    ___||       ||    ___|| |_|   |
+ * | ||_|| ||   _   |       |      | |       ||   |___ |       ||   |___ |       |
+ * |_|   |_||__| |__|       |____||_||_______||_______||_______||_______||______|
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/*
+ * Parser microbenchmark: compare the request line parsing of server
+ * (memchr tokenizer + switch dispatch) with the old one (byte by byte
+ * tokenizer + HashTable lookup).
+ *
+ *   make parserbench && ./mx-parserbench [iterations]
+ */
+
+#include <sys/time.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include "global.h"
+
+#define MX_BENCH_ITERATIONS  5000000
+
+static char *mx_bench_lines[] = {
+    "enqueue email_queue 10 0 128\r\n",
+    "dequeue email_queue\r\n",
+    "touch email_queue\r\n",
+    "recycle 1986 10 30\r\n",
+    "size email_queue\r\n",
+    "mtouch email_queue 100 60 65536\r\n",
+    "dequeue_any 5 high:3 normal:2 low:1\r\n",
+    "ping\r\n",
+    NULL
+};
+
+/* command names with arguments count, same as mx_commands */
+static struct {
+    char *name;
+    int argc;
+} mx_bench_commands[mx_op_count] = {
+    [mx_op_ping]        = {"ping",        0},
+    [mx_op_auth]        = {"auth",        2},
+    [mx_op_enqueue]     = {"enqueue",     4},
+    [mx_op_menqueue]    = {"menqueue",    1},
+    [mx_op_dequeue]     = {"dequeue",     1},
+    [mx_op_touch]       = {"touch",       1},
+    [mx_op_mdequeue]    = {"mdequeue",   -1},
+    [mx_op_mtouch]      = {"mtouch",     -1},
+    [mx_op_bdequeue]    = {"bdequeue",    2},
+    [mx_op_btouch]      = {"btouch",      2},
+    [mx_op_dequeue_any] = {"dequeue_any", -1},
+    [mx_op_touch_any]   = {"touch_any",  -1},
+    [mx_op_recycle]     = {"recycle",     3},
+    [mx_op_remove]      = {"remove",      1},
+    [mx_op_size]        = {"size",        1},
+    [mx_op_exec]        = {"exec",       -1},
+    [mx_op_ack]         = {"ack",         1},
+    [mx_op_nack]        = {"nack",        2},
+    [mx_op_extend]      = {"extend",      2},
+    [mx_op_move]        = {"move",       -1},
+    [mx_op_fanout]      = {"fanout",     -1},
+    [mx_op_subscribe]   = {"subscribe",  -1},
+    [mx_op_unsubscribe] = {"unsubscribe", 0},
+    [mx_op_credit]      = {"credit",      1},
+    [mx_op_async]       = {"async",      -1},
+    [mx_op_script]      = {"script",     -1},
+    [mx_op_result]      = {"result",      1},
+    [mx_op_slowlog]     = {"slowlog",    -1},
+    [mx_op_info]        = {"info",       -1},
+};
+
+
+static double mx_bench_elapsed(struct timeval *begin)
+{
+    struct timeval end;
+
+    gettimeofday(&end, NULL);
+
+    return (end.tv_sec - begin->tv_sec) +
+           (end.tv_usec - begin->tv_usec) / 1000000.0;
+}
+
+
+/* the tokenizer before switch dispatch */
+static size_t mx_bench_old_tokenize(char *command, mx_token_t *tokens,
+    size_t max_tokens)
+{
+    char *s, *e;
+    size_t ntokens = 0;
+
+    for (s = e = command; ntokens < max_tokens - 1; ++e) {
+        if (*e == ' ') {
+            if (s != e) {
+                tokens[ntokens].value = s;
+                tokens[ntokens].length = e - s;
+                ntokens++;
+                *e = 0;
+            }
+            s = e + 1;
+        }
+        else if (*e == 0) {
+            if (s != e) {
+                tokens[ntokens].value = s;
+                tokens[ntokens].length = e - s;
+                ntokens++;
+            }
+
+            break;
+        }
+    }
+
+    return ntokens;
+}
+
+
+static char *mx_bench_line_end(char *begin, int length)
+{
+    char *last;
+
+    last = memchr(begin, LF_CHR, length);
+    if (last - begin > 1 && *(last - 1) == CR_CHR)
+        last--;
+    *last = 0;
+
+    return last;
+}
+
+
+static long mx_bench_old(char **lines, int *lengths, int count, long times)
+{
+    mx_token_t tokens[MX_MAX_TOKENS];
+    char buf[MX_RECVBUF_SIZE];
+    HashTable *table;
+    void *cmd;
+    long i, found = 0;
+    int j, amount;
+
+    table = hash_alloc(32);
+    for (j = 0; j < mx_op_count; j++) {
+        hash_insert(table, mx_bench_commands[j].name, &mx_bench_commands[j]);
+    }
+
+    for (i = 0; i < times; i++) {
+        j = i % count;
+
+        memcpy(buf, lines[j], lengths[j]);
+        mx_bench_line_end(buf, lengths[j]);
+
+        amount = mx_bench_old_tokenize(buf, tokens, MX_MAX_TOKENS);
+        tokens[amount].value = NULL;
+
+        if (hash_lookup(table, tokens[0].value, &cmd) == 0) {
+            found += amount;
+        }
+    }
+
+    hash_destroy(table, NULL);
+
+    return found;
+}
+
+
+static long mx_bench_new(char **lines, int *lengths, int count, long times)
+{
+    mx_token_t tokens[MX_MAX_TOKENS];
+    char buf[MX_RECVBUF_SIZE];
+    char *pos, *last;
+    long i, found = 0;
+    int j, amount, opcode, argc;
+
+    for (i = 0; i < times; i++) {
+        j = i % count;
+
+        memcpy(buf, lines[j], lengths[j]);
+        last = mx_bench_line_end(buf, lengths[j]);
+
+        pos = buf;
+        if (mx_tokenize_command(&pos, last, tokens, 1) == 0) {
+            continue;
+        }
+
+        opcode = mx_command_opcode(tokens[0].value, tokens[0].length);
+        if (opcode == -1) {
+            continue;
+        }
+
+        argc = mx_bench_commands[opcode].argc;
+        if (argc == -1) {
+            argc = MX_MAX_TOKENS - 2;
+        }
+
+        amount = 1 + mx_tokenize_command(&pos, last, tokens + 1, argc);
+        tokens[amount].value = NULL;
+
+        found += amount;
+    }
+
+    return found;
+}
+
+
+int main(int argc, char *argv[])
+{
+    int lengths[MX_MAX_TOKENS];
+    struct timeval begin;
+    double old_elapsed, new_elapsed;
+    long times = MX_BENCH_ITERATIONS, old_found, new_found;
+    int count;
+
+    if (argc > 1) {
+        times = atol(argv[1]);
+        if (times <= 0) {
+            fprintf(stderr, "Usage: %s [iterations]\n", argv[0]);
+            return 1;
+        }
+    }
+
+    for (count = 0; mx_bench_lines[count]; count++) {
+        lengths[count] = strlen(mx_bench_lines[count]);
+    }
+
+    gettimeofday(&begin, NULL);
+    old_found = mx_bench_old(mx_bench_lines, lengths, count, times);
+    old_elapsed = mx_bench_elapsed(&begin);
+
+    gettimeofday(&begin, NULL);
+    new_found = mx_bench_new(mx_bench_lines, lengths, count, times);
+    new_elapsed = mx_bench_elapsed(&begin);
+
+    printf("parsed %ld request lines\n", times);
+    printf("old (tokenize + hash):  %.3f seconds, %.1f ns/line\n",
+           old_elapsed, old_elapsed * 1e9 / times);
+    printf("new (memchr + switch):  %.3f seconds, %.1f ns/line\n",
+           new_elapsed, new_elapsed * 1e9 / times);
+
+    if (old_found != new_found) {
+        fprintf(stderr, "[error] tokens mismatch: %ld != %ld\n",
+                old_found, new_found);
+        return 1;
+    }
+
+    return 0;
+}
@@ -0,0 +1,144 @@
+/*
+ * Copyright (c) 2012 - 2013, YukChung Lee <liexusong@qq.com>
+ * All rights reserved.
+ *  __   __  __   __         _______  __   __  _______  __   __  _______  ______
+ * |  |_|  ||  |_|  |       |       ||  | |  ||       ||  | |  ||       ||      |
+ * |       ||       | ____  |   _   ||  | |  ||    ___||  | |  ||    ___||  _    |
+ * |       ||       ||____| |  | |  ||  |_|  ||   |___ |  |_|  ||   |___ | | |   |
+ * |       | |     |        |  |_|  ||       ||    ___||       ||    ___|| |_|   |
+ * | ||_|| ||   _   |       |      | |       ||   |___ |       ||   |___ |       |
+ * |_|   |_||__| |__|       |____||_||_______||_______||_______||_______||______|
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/*
+ * SHA-1 digest (FIPS 180-1), names the scripts loaded by
+ * `script load' like Redis does
+ */
+
+#include <string.h>
+#include "sha1.h"
+
+#define MX_SHA1_ROL(v, n)  (((v) << (n)) | ((v) >> (32 - (n))))
+
+
+static void mx_sha1_transform(unsigned int state[5], const unsigned char block[64])
+{
+    unsigned int w[80], a, b, c, d, e, t;
+    int i;
+
+    for (i = 0; i < 16; i++) {
+        w[i] = (unsigned int)block[i*4] << 24 | (unsigned int)block[i*4+1] << 16 |
+               (unsigned int)block[i*4+2] << 8 | (unsigned int)block[i*4+3];
+    }
+
+    for (i = 16; i < 80; i++) {
+        w[i] = MX_SHA1_ROL(w[i-3] ^ w[i-8] ^ w[i-14] ^ w[i-16], 1);
+    }
+
+    a = state[0];
+    b = state[1];
+    c = state[2];
+    d = state[3];
+    e = state[4];
+
+    for (i = 0; i < 80; i++) {
+        if (i < 20) {
+            t = ((b & c) | (~b & d)) + 0x5A827999;
+        } else if (i < 40) {
+            t = (b ^ c ^ d) + 0x6ED9EBA1;
+        } else if (i < 60) {
+            t = ((b & c) | (b & d) | (c & d)) + 0x8F1BBCDC;
+        } else {
+            t = (b ^ c ^ d) + 0xCA62C1D6;
+        }
+
+        t += MX_SHA1_ROL(a, 5) + e + w[i];
+        e = d;
+        d = c;
+        c = MX_SHA1_ROL(b, 30);
+        b = a;
+        a = t;
+    }
+
+    state[0] += a;
+    state[1] += b;
+    state[2] += c;
+    state[3] += d;
+    state[4] += e;
+}
+
+
+void mx_sha1(const char *data, size_t length, unsigned char digest[MX_SHA1_SIZE])
+{
+    unsigned int state[5] = {
+        0x67452301, 0xEFCDAB89, 0x98BADCFE, 0x10325476, 0xC3D2E1F0
+    };
+    unsigned char block[64];
+    unsigned long long bits = (unsigned long long)length * 8;
+    size_t remain = length;
+    int i, fill;
+
+    while (remain >= 64) {
+        mx_sha1_transform(state, (const unsigned char *)data);
+        data += 64;
+        remain -= 64;
+    }
+
+    /* the last block: rest data, 0x80, zeros and the bits length */
+    memcpy(block, data, remain);
+    fill = remain;
+    block[fill++] = 0x80;
+
+    if (fill > 56) {
+        memset(block + fill, 0, 64 - fill);
+        mx_sha1_transform(state, block);
+        fill = 0;
+    }
+
+    memset(block + fill, 0, 56 - fill);
+
+    for (i = 0; i < 8; i++) {
+        block[56+i] = (unsigned char)(bits >> (56 - i * 8));
+    }
+
+    mx_sha1_transform(state, block);
+
+    for (i = 0; i < MX_SHA1_SIZE; i++) {
+        digest[i] = (unsigned char)(state[i/4] >> (24 - (i % 4) * 8));
+    }
+}
+
+
+/*
+ * Hex string of the digest, hex must have MX_SHA1_HEX_SIZE+1 bytes
+ */
+void mx_sha1_hex(const char *data, size_t length, char *hex)
+{
+    static const char digits[] = "0123456789abcdef";
+    unsigned char digest[MX_SHA1_SIZE];
+    int i;
+
+    mx_sha1(data, length, digest);
+
+    for (i = 0; i < MX_SHA1_SIZE; i++) {
+        hex[i*2] = digits[digest[i] >> 4];
+        hex[i*2+1] = digits[digest[i] & 0x0F];
+    }
+
+    hex[MX_SHA1_HEX_SIZE] = 0;
+}
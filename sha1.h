@@ -0,0 +1,12 @@
+#ifndef MX_SHA1_H
+#define MX_SHA1_H
+
+#include <stddef.h>
+
+#define MX_SHA1_SIZE      20
+#define MX_SHA1_HEX_SIZE  40
+
+void mx_sha1(const char *data, size_t length, unsigned char digest[MX_SHA1_SIZE]);
+void mx_sha1_hex(const char *data, size_t length, char *hex);
+
+#endif
@@ -201,6 +201,46 @@ int mx_skiplist_delete_key(mx_skiplist_t *list, int key, void **rec)
     return SKL_STATUS_OK;
 }
 
+/**
+ * Delete the first node whose key is between from and to (in list order)
+ */
+int mx_skiplist_delete_first(mx_skiplist_t *list, int from, int to, void **rec)
+{
+    int i;
+    mx_skiplist_node_t *update[MAXLEVEL+1], *x;
+
+    x = list->root;
+    for (i = list->level; i >= 0; i--) {
+        while (x->forward[i] != list->root
+                && list->cmp(x->forward[i]->key, from))
+            x = x->forward[i];
+        update[i] = x;
+    }
+
+    x = x->forward[0];
+    if (x == list->root || list->cmp(to, x->key))
+        return SKL_STATUS_KEY_NOT_FOUND;
+
+    for (i = 0; i <= list->level; i++) {
+        if (update[i]->forward[i] != x) break;
+        update[i]->forward[i] = x->forward[i];
+    }
+
+    if (rec) *rec = x->rec;
+
+    zfree(x);
+
+    while ((list->level > 0) &&
+           (list->root->forward[list->level] == list->root))
+    {
+        list->level--;
+    }
+
+    list->size--;
+
+    return SKL_STATUS_OK;
+}
+
 /**
  * Find the first node of the key
  */
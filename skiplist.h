@@ -56,6 +56,7 @@ int mx_skiplist_find_top(mx_skiplist_t *list, void **rec);
 void mx_skiplist_delete_top(mx_skiplist_t *list);
 int mx_skiplist_find_key(mx_skiplist_t *list, int key, void **rec);
 int mx_skiplist_delete_key(mx_skiplist_t *list, int key, void **rec);
+int mx_skiplist_delete_first(mx_skiplist_t *list, int from, int to, void **rec);
 int mx_skiplist_find_node(mx_skiplist_t *list, int key, mx_skiplist_node_t **node);
 int mx_skiplist_get_iterator(mx_skiplist_t *list,
     mx_skiplist_iterator_t *iterator, int key, int limit);
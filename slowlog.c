@@ -0,0 +1,162 @@
+/*
+ * Copyright (c) 2012 - 2013, YukChung Lee <liexusong@qq.com>
+ * All rights reserved.
+ *  __   __  __   __         _______  __   __  _______  __   __  _______  ______
+ * |  |_|  ||  |_|  |       |       ||  | |  ||       ||  | |  ||       ||      |
+ * |       ||       | ____  |   _   ||  | |  ||    ___||  | |  ||    ___||  _    |
+ * |       ||       ||____| |  | |  ||  |_|  ||   |___ |  |_|  ||   |___ | | |   |
+ * |       | |     |        |  |_|  ||       ||    ___||       ||    ___|| |_|   |
+ * | ||_|| ||   _   |       |      | |       ||   |___ |       ||   |___ |       |
+ * |_|   |_||__| |__|       |____||_||_______||_______||_______||_______||______|
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/*
+ * Slow log.
+ *
+ * The commands whose parse + execution + send time reached the threshold
+ * are kept in a bounded ring, the oldest entry is overwritten when the
+ * ring is full. Only the time spent by the event loop is measured, waiting
+ * for the body of enqueue, for jobs of blocking dequeue or for the Lua
+ * workers isn't counted.
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include "global.h"
+
+typedef struct {
+    long long id;
+    time_t time;
+    const char *command;
+    char queue[MX_SLOWLOG_NAME_SIZE];
+    int bytes;
+    long long parse_us;
+    long long exec_us;
+    long long send_us;
+} mx_slowlog_entry_t;
+
+static mx_slowlog_entry_t *mx_slowlog_ring = NULL;
+static int mx_slowlog_size = 0;
+static int mx_slowlog_count = 0;
+static int mx_slowlog_next = 0;      /* slot of the next entry */
+static long long mx_slowlog_last_id = 0;
+
+
+int mx_slowlog_init(int size)
+{
+    mx_slowlog_ring = calloc(size, sizeof(mx_slowlog_entry_t));
+    if (!mx_slowlog_ring) {
+        return -1;
+    }
+
+    mx_slowlog_size = size;
+    mx_slowlog_count = 0;
+    mx_slowlog_next = 0;
+
+    return 0;
+}
+
+
+void mx_slowlog_add(const char *command, const char *queue, int bytes,
+    long long parse_us, long long exec_us, long long send_us)
+{
+    mx_slowlog_entry_t *entry;
+
+    if (!mx_slowlog_ring) {
+        return;
+    }
+
+    entry = &mx_slowlog_ring[mx_slowlog_next];
+
+    entry->id = ++mx_slowlog_last_id;
+    entry->time = mx_current_time;
+    entry->command = command;
+    entry->bytes = bytes;
+    entry->parse_us = parse_us;
+    entry->exec_us = exec_us;
+    entry->send_us = send_us;
+
+    strncpy(entry->queue, queue, MX_SLOWLOG_NAME_SIZE - 1);
+    entry->queue[MX_SLOWLOG_NAME_SIZE - 1] = '\0';
+
+    mx_slowlog_next = (mx_slowlog_next + 1) % mx_slowlog_size;
+    if (mx_slowlog_count < mx_slowlog_size) {
+        mx_slowlog_count++;
+    }
+}
+
+
+/*
+ * Text of the newest count entries (all if count <= 0), one entry
+ * per line, the newest first. The text must be freed by caller
+ */
+char *mx_slowlog_get(int count, int *length)
+{
+    mx_slowlog_entry_t *entry;
+    char *text, *pos;
+    int i, slot;
+
+    if (count <= 0 || count > mx_slowlog_count) {
+        count = mx_slowlog_count;
+    }
+
+    text = pos = malloc(count * (MX_SLOWLOG_NAME_SIZE + 192) + 1);
+    if (!text) {
+        return NULL;
+    }
+
+    *pos = 0;
+
+    for (i = 0; i < count; i++) {
+        slot = (mx_slowlog_next - 1 - i + mx_slowlog_size) % mx_slowlog_size;
+        entry = &mx_slowlog_ring[slot];
+
+        pos += sprintf(pos, "id=%lld time=%ld command=%s queue=%s bytes=%d "
+                       "parse_us=%lld exec_us=%lld send_us=%lld\n",
+                       entry->id, (long)entry->time, entry->command,
+                       entry->queue[0] ? entry->queue : "-", entry->bytes,
+                       entry->parse_us, entry->exec_us, entry->send_us);
+    }
+
+    *length = pos - text;
+
+    return text;
+}
+
+
+int mx_slowlog_len()
+{
+    return mx_slowlog_count;
+}
+
+
+void mx_slowlog_reset()
+{
+    mx_slowlog_count = 0;
+    mx_slowlog_next = 0;
+}
+
+
+void mx_slowlog_destroy()
+{
+    free(mx_slowlog_ring);
+    mx_slowlog_ring = NULL;
+    mx_slowlog_count = 0;
+}
@@ -0,0 +1,503 @@
+/*
+ * Copyright (c) 2012 - 2013, YukChung Lee <liexusong@qq.com>
+ * All rights reserved.
+ *  __   __  __   __         _______  __   __  _______  __   __  _______  ______
+ * |  |_|  ||  |_|  |       |       ||  | |  ||       ||  | |  ||       ||      |
+ * |       ||       | ____  |   _   ||  | |  ||    ___||  | |  ||    ___||  _    |
+ * |       ||       ||____| |  | |  ||  |_|  ||   |___ |  |_|  ||   |___ | | |   |
+ * |       | |     |        |  |_|  ||       ||    ___||       ||    ___|| |_|   |
+ * | ||_|| ||   _   |       |      | |       ||   |___ |       ||   |___ |       |
+ * |_|   |_||__| |__|       |____||_||_______||_______||_______||_______||______|
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/*
+ * Spill-over storage for big queues.
+ *
+ * When the jobs of a queue use more than `spill_threshold' bytes of memory,
+ * the new jobs are appended to segment files instead of the queue's skiplist.
+ * Once a queue has spilled, all new jobs go to the tail segment (so the old
+ * jobs were served first), and the head segment is mapped and read back into
+ * the skiplist when the memory part drains under the half of the threshold.
+ * Priority is only honored between the jobs in memory.
+ */
+
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <sys/uio.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <dirent.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include "global.h"
+
+#define MX_SPILL_SEGMENT_SIZE  (64 * 1024 * 1024)
+#define MX_SPILL_PREFIX        "mx-spill-"
+
+typedef struct mx_spill_segment_s mx_spill_segment_t;
+
+struct mx_spill_record {
+    int prival;
+    int length;
+};
+
+struct mx_spill_segment_s {
+    mx_spill_segment_t *next;
+    int fd;         /* -1 when the segment was sealed */
+    off_t size;     /* bytes had written */
+    char *map;      /* mapped when reading */
+    off_t rpos;     /* read position */
+    char path[0];
+};
+
+struct mx_spill_s {
+    mx_spill_segment_t *head; /* reading segment */
+    mx_spill_segment_t *tail; /* writing segment */
+    int jobs;
+    long bytes;
+};
+
+
+static int mx_spill_last_id = 0;
+static mx_spill_segment_t *mx_spill_deferred = NULL;  /* to be unlinked */
+
+
+static mx_spill_segment_t *mx_spill_segment_create()
+{
+    mx_spill_segment_t *seg;
+    char path[2048];
+    int len;
+
+    len = snprintf(path, sizeof(path), "%s/" MX_SPILL_PREFIX "%d.seg",
+                   mx_global->spill_path, ++mx_spill_last_id);
+
+    seg = malloc(sizeof(*seg) + len + 1);
+    if (!seg) {
+        mx_global->outof_memory++;
+        return NULL;
+    }
+
+    seg->fd = open(path, O_WRONLY|O_CREAT|O_TRUNC|O_APPEND, 0644);
+    if (seg->fd == -1) {
+        mx_write_log(mx_log_error, "failed to create spill segment `%s', message(%s)",
+                     path, strerror(errno));
+        free(seg);
+        return NULL;
+    }
+
+    seg->next = NULL;
+    seg->size = 0;
+    seg->map = NULL;
+    seg->rpos = 0;
+    memcpy(seg->path, path, len + 1);
+
+    return seg;
+}
+
+
+static void mx_spill_segment_free(mx_spill_segment_t *seg)
+{
+    if (seg->fd != -1) {
+        close(seg->fd);
+    }
+
+    if (seg->map) {
+        munmap(seg->map, seg->size);
+    }
+
+    /* background save process may read it, unlink after it exited */
+    if (mx_global->bgsave_pid != -1) {
+        seg->fd = -1;
+        seg->map = NULL;
+        seg->next = mx_spill_deferred;
+        mx_spill_deferred = seg;
+        return;
+    }
+
+    unlink(seg->path);
+    free(seg);
+}
+
+
+/* stop writing to the segment, next spill would create a new one */
+static void mx_spill_segment_seal(mx_spill_segment_t *seg)
+{
+    if (seg->fd != -1) {
+        close(seg->fd);
+        seg->fd = -1;
+    }
+}
+
+
+static int mx_spill_segment_map(mx_spill_segment_t *seg)
+{
+    int fd;
+
+    mx_spill_segment_seal(seg);
+
+    if (seg->size == 0) {
+        return 0;
+    }
+
+    fd = open(seg->path, O_RDONLY);
+    if (fd == -1) {
+        return -1;
+    }
+
+    seg->map = mmap(NULL, seg->size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+
+    if (seg->map == MAP_FAILED) {
+        seg->map = NULL;
+        return -1;
+    }
+
+    madvise(seg->map, seg->size, MADV_SEQUENTIAL);
+
+    return 0;
+}
+
+
+int mx_spill_need(mx_queue_t *queue, mx_job_t *job)
+{
+    if (!mx_global->spill_enable) {
+        return 0;
+    }
+
+    return queue->spill != NULL ||
+           queue->bytes + job->length > mx_global->spill_threshold;
+}
+
+
+/*
+ * Append the job to the tail segment and free it
+ */
+int mx_spill_push(mx_queue_t *queue, mx_job_t *job)
+{
+    mx_spill_t *spill = queue->spill;
+    mx_spill_segment_t *seg;
+    struct mx_spill_record record;
+    struct iovec iov[2];
+    ssize_t wsize;
+
+    if (!spill) {
+        spill = calloc(1, sizeof(*spill));
+        if (!spill) {
+            mx_global->outof_memory++;
+            return -1;
+        }
+        queue->spill = spill;
+    }
+
+    seg = spill->tail;
+
+    if (!seg || seg->fd == -1 ||
+        seg->size + sizeof(record) + job->length > MX_SPILL_SEGMENT_SIZE)
+    {
+        if (seg) {
+            mx_spill_segment_seal(seg);
+        }
+
+        seg = mx_spill_segment_create();
+        if (!seg) {
+            goto failed;
+        }
+
+        if (spill->tail) {
+            spill->tail->next = seg;
+        } else {
+            spill->head = seg;
+        }
+        spill->tail = seg;
+    }
+
+    record.prival = job->prival;
+    record.length = job->length;
+
+    iov[0].iov_base = &record;
+    iov[0].iov_len = sizeof(record);
+    iov[1].iov_base = job->body;
+    iov[1].iov_len = job->length;
+
+    wsize = writev(seg->fd, iov, 2);
+    if (wsize != (ssize_t)(sizeof(record) + job->length)) {
+        mx_write_log(mx_log_error, "failed to write spill segment `%s', message(%s)",
+                     seg->path, strerror(errno));
+        if (wsize > 0) { /* drop the broken record */
+            (void)ftruncate(seg->fd, seg->size);
+        }
+        mx_spill_segment_seal(seg);
+        goto failed;
+    }
+
+    seg->size += wsize;
+    spill->jobs++;
+    spill->bytes += job->length;
+
+    mx_job_free(job);
+
+    return 0;
+
+failed:
+    if (spill->jobs == 0) {
+        mx_spill_free(spill);
+        queue->spill = NULL;
+    }
+    return -1;
+}
+
+
+/*
+ * Read jobs back from the head segments until the memory part
+ * of the queue reach 3/4 of the spill threshold
+ */
+int mx_spill_load(mx_queue_t *queue)
+{
+    mx_spill_t *spill = queue->spill;
+    mx_spill_segment_t *seg;
+    struct mx_spill_record record;
+    mx_job_t *job;
+    long watermark = mx_global->spill_threshold / 4 * 3;
+    int count = 0;
+
+    while (spill && spill->jobs > 0 &&
+           (count == 0 || queue->bytes < watermark))
+    {
+        seg = spill->head;
+
+        if (seg->rpos >= seg->size) {
+            if (seg == spill->tail && seg->fd != -1) {
+                break; /* nothing was written */
+            }
+            spill->head = seg->next;
+            if (spill->tail == seg) {
+                spill->tail = NULL;
+            }
+            mx_spill_segment_free(seg);
+            continue;
+        }
+
+        if (!seg->map && mx_spill_segment_map(seg) != 0) {
+            mx_write_log(mx_log_error, "failed to map spill segment `%s', message(%s)",
+                         seg->path, strerror(errno));
+            break;
+        }
+
+        memcpy(&record, seg->map + seg->rpos, sizeof(record));
+
+        job = mx_job_create(queue, record.prival, 0, record.length);
+        if (!job) {
+            break;
+        }
+
+        memcpy(job->body, seg->map + seg->rpos + sizeof(record), record.length);
+        job->body[job->length] = CR_CHR;
+        job->body[job->length+1] = LF_CHR;
+
+        if (mx_skiplist_insert(queue->list, job->prival, job) != SKL_STATUS_OK) {
+            mx_job_free(job);
+            break;
+        }
+
+        seg->rpos += sizeof(record) + record.length;
+        queue->bytes += job->length;
+        spill->jobs--;
+        spill->bytes -= job->length;
+        count++;
+    }
+
+    /* all jobs back to memory */
+    if (spill && spill->jobs == 0) {
+        mx_spill_free(spill);
+        queue->spill = NULL;
+    }
+
+    return count;
+}
+
+
+/*
+ * Walk the spilled jobs without loading them into queue (used by
+ * background save in the child process, the server process doesn't
+ * unlink segments until it exited)
+ */
+int mx_spill_foreach(mx_queue_t *queue, int (*handler)(mx_job_t *job))
+{
+    mx_spill_segment_t *seg;
+    struct mx_spill_record record;
+    mx_job_t *job = NULL;
+    int capacity = 0;
+    off_t pos;
+    FILE *fp = NULL;
+
+    if (!queue->spill) {
+        return 0;
+    }
+
+    for (seg = queue->spill->head; seg; seg = seg->next) {
+
+        if (seg->rpos >= seg->size) {
+            continue;
+        }
+
+        fp = fopen(seg->path, "rb");
+        if (!fp || fseeko(fp, seg->rpos, SEEK_SET) != 0) {
+            goto failed;
+        }
+
+        for (pos = seg->rpos; pos < seg->size;
+             pos += sizeof(record) + record.length)
+        {
+            if (fread(&record, sizeof(record), 1, fp) != 1) {
+                goto failed;
+            }
+
+            if (record.length + 2 > capacity) {
+                free(job);
+                capacity = record.length + 2;
+                job = malloc(sizeof(*job) + capacity);
+                if (!job) {
+                    goto failed;
+                }
+                job->shared = NULL;
+                job->body = job->data;
+            }
+
+            job->belong = queue;
+            job->prival = record.prival;
+            job->timeout = 0;
+            job->length = record.length;
+
+            if (record.length > 0 &&
+                fread(job->body, record.length, 1, fp) != 1)
+            {
+                goto failed;
+            }
+
+            if (handler(job) != 0) {
+                goto failed;
+            }
+        }
+
+        fclose(fp);
+        fp = NULL;
+    }
+
+    free(job);
+    return 0;
+
+failed:
+    if (fp) {
+        fclose(fp);
+    }
+    free(job);
+    return -1;
+}
+
+
+int mx_spill_jobs(mx_queue_t *queue)
+{
+    return queue->spill ? queue->spill->jobs : 0;
+}
+
+
+long mx_spill_bytes(mx_queue_t *queue)
+{
+    return queue->spill ? queue->spill->bytes : 0;
+}
+
+
+void mx_spill_free(mx_spill_t *spill)
+{
+    mx_spill_segment_t *seg, *next;
+
+    if (!spill) {
+        return;
+    }
+
+    for (seg = spill->head; seg; seg = next) {
+        next = seg->next;
+        mx_spill_segment_free(seg);
+    }
+
+    free(spill);
+}
+
+
+/*
+ * Background save finished, unlink the segments freed meanwhile
+ */
+void mx_spill_release_deferred()
+{
+    mx_spill_segment_t *seg;
+
+    while (mx_spill_deferred) {
+        seg = mx_spill_deferred;
+        mx_spill_deferred = seg->next;
+        unlink(seg->path);
+        free(seg);
+    }
+}
+
+
+/*
+ * Remove the segments left by last running. Nothing reads them back
+ * (a segment doesn't know its queue), the spilled jobs were kept only
+ * if they were stored in the database file
+ */
+int mx_spill_init()
+{
+    struct stat st;
+    struct dirent *entry;
+    char path[2048];
+    DIR *dir;
+    int count = 0;
+
+    if (stat(mx_global->spill_path, &st) == -1) {
+        if (mkdir(mx_global->spill_path, 0755) == -1) {
+            return -1;
+        }
+        return 0;
+    }
+
+    if (!S_ISDIR(st.st_mode) || !(dir = opendir(mx_global->spill_path))) {
+        return -1;
+    }
+
+    while ((entry = readdir(dir)) != NULL) {
+        if (strncmp(entry->d_name, MX_SPILL_PREFIX, sizeof(MX_SPILL_PREFIX) - 1)) {
+            continue;
+        }
+        snprintf(path, sizeof(path), "%s/%s", mx_global->spill_path, entry->d_name);
+        if (unlink(path) == 0) {
+            count++;
+        }
+    }
+
+    closedir(dir);
+
+    if (count > 0) {
+        mx_write_log(mx_log_notice, "removed %d spill segments left in (%s)",
+                     count, mx_global->spill_path);
+    }
+
+    return 0;
+}
@@ -3,6 +3,7 @@
 #include <sys/stat.h>
 #include <fcntl.h>
 #include <unistd.h>
+#include <time.h>
 
 
 int mx_set_nonblocking(int fd)
@@ -98,3 +99,13 @@ char *mx_str_trim(char *input)
     return retptr;
 }
 
+
+/* monotonic clock in microseconds */
+long long mx_clock_usec(void)
+{
+    struct timespec now;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+
+    return (long long)now.tv_sec * 1000000 + now.tv_nsec / 1000;
+}
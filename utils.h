@@ -5,5 +5,6 @@ int mx_set_nonblocking(int fd);
 void mx_daemonize(void);
 int mx_atoi(const char *str, int *retval);
 char *mx_str_trim(char *input);
+long long mx_clock_usec(void);
 
 #endif